@@ -3,82 +3,311 @@
  *  \author  Peter Chapin <spicacality@kelseymountain.org>
  */
 
-#include <cstring>
+#include <cctype>
+#include <cstdlib>
+#include <sstream>
 #include <stdexcept>
 
+#include <vector>
+
 #include <unistd.h>
 #include "istring.hpp"
 #include "ClientConnection.hpp"
-#include "Console.hpp"
 
 using namespace std;
 
+chrono::seconds ClientConnection::reply_timeout( 300 );
+
+// ==============
+// DeliveryResult
+// ==============
+
+DeliveryResult::DeliveryResult( )
+{
+    pthread_mutex_init( &lock, nullptr );
+    pthread_cond_init( &changed, nullptr );
+    done = false;
+    succeeded = false;
+}
+
+
+DeliveryResult::~DeliveryResult( )
+{
+    pthread_cond_destroy( &changed );
+    pthread_mutex_destroy( &lock );
+}
+
+
+//! Record the outcome of the delivery and wake the waiting thread.
+/*!
+ * \param delivered True if the server accepted the message for the recipients it accepted.
+ * \param error Why the message wasn't delivered, if it wasn't.
+ * \param outcomes The server's replies to RCPT, one for each recipient it was sent.
+ */
+void DeliveryResult::set( bool delivered, const string &error, const vector<Recipient> &outcomes )
+{
+    pthread_mutex_lock( &lock );
+    done = true;
+    succeeded = delivered;
+    reason = error;
+    recipients = outcomes;
+    pthread_cond_signal( &changed );
+    pthread_mutex_unlock( &lock );
+}
+
+
+//! Wait for the outcome of the delivery.
+/*!
+ * A recipient missing from the outcomes was not sent to the server; the attempt failed before
+ * it got that far.
+ *
+ * \param error Receives the reason the delivery failed, if it did.
+ * \param outcomes Receives the server's reply to each recipient it was sent.
+ * \return true if the message was delivered to the recipients marked ACCEPTED.
+ */
+bool DeliveryResult::wait( string &error, vector<Recipient> &outcomes )
+{
+    pthread_mutex_lock( &lock );
+    while( !done ) {
+        pthread_cond_wait( &changed, &lock );
+    }
+    error = reason;
+    outcomes = recipients;
+    bool result = succeeded;
+    pthread_mutex_unlock( &lock );
+    return result;
+}
+
 // ===============
 // Private Methods
 // ===============
 
-//! Read a line of text from the connection.
-istring ClientConnection::line_in( )
+//! Read a (possibly multi-line) reply from the server.
+/*!
+ * \return The reply code.
+ * \throw std::runtime_error if the reply is malformed.
+ */
+Task<int> ClientConnection::get_reply( )
 {
-    istring result;
-
-    while( true ) {
-        if( buffer_index == buffer_size ) {
-            buffer_size = read( socket_handle, buffer, MAX_BUFFER_SIZE );
-            if( buffer_size == 0 || buffer_size == -1 ) break;
-            buffer[buffer_size] = '\0';
-            buffer_index = 0;
-        }
+    do {
+        std::string_view line = co_await line_in( );
+        reply.assign( line.data( ), line.size( ));
 
-        char ch = buffer[buffer_index++];
-        if( ch == '\r' ) continue;
-        if( ch == '\n' ) break;
+        // Extensions are listed one per line in the reply to EHLO.
+        if( reply.size( ) > 4 && reply.substr( 4 ) == "PIPELINING" ) pipelining = true;
+    } while( reply.size( ) > 3 && reply[3] == '-' );
 
-        result += ch;
+    if( reply.size( ) < 3 || !isdigit( static_cast<unsigned char>( reply[0] )) ||
+                              !isdigit( static_cast<unsigned char>( reply[1] )) ||
+                              !isdigit( static_cast<unsigned char>( reply[2] ))) {
+        throw runtime_error( "Malformed reply from server" );
     }
-    return result;
+    co_return atoi( reply.substr( 0, 3 ).c_str( ));
+}
+
+
+//! Send a command to the server and check the class of its reply.
+/*!
+ * \param line The command to send or nullptr to just read a reply (such as the greeting).
+ * \param expected_class The first digit of a successful reply code.
+ * \throw std::runtime_error if the server's reply is not in the expected class.
+ */
+Task<> ClientConnection::command( const char *line, int expected_class )
+{
+    if( line != nullptr ) co_await line_out( line );
+
+    int code = co_await get_reply( );
+    expect( code, expected_class );
+}
+
+
+//! Check the class of a reply code.
+/*!
+ * \throw std::runtime_error if the code is not in the expected class.
+ */
+void ClientConnection::expect( int code, int expected_class ) const
+{
+    if( code / 100 != expected_class ) {
+        ostringstream formatter;
+        formatter << "Server replied: " << reply.c_str( );
+        throw runtime_error( formatter.str( ));
+    }
+}
+
+
+//! Read the server's reply to RCPT for a recipient and record the outcome.
+/*!
+ * A 2xx reply accepts the recipient and a 5xx reply refuses it for good. Any other reply is
+ * taken as a temporary refusal (RFC 5321, 4.2.1).
+ *
+ * \param index The recipient's index in the spool record.
+ * \return true if the recipient was accepted.
+ */
+Task<bool> ClientConnection::recipient_reply( size_t index )
+{
+    int code = co_await get_reply( );
+
+    DeliveryResult::outcome what = DeliveryResult::DEFERRED;
+    if( code / 100 == 2 ) what = DeliveryResult::ACCEPTED;
+    if( code / 100 == 5 ) what = DeliveryResult::REJECTED;
+    outcomes.push_back( { index, what, string( reply.data( ), reply.size( )) } );
+    co_return what == DeliveryResult::ACCEPTED;
+}
+
+
+//! Record why the conversation is being ended. See Connection::time_out().
+void ClientConnection::timed_out( )
+{
+    if( error.empty( )) error = "Timed out waiting for the server";
 }
 
 
-//! Write a line of text to the connection.
-void ClientConnection::line_out( const char *line ) const
+//! Have an SMTP conversation with the server.
+/*!
+ * This coroutine executes the full SMTP conversation with the server, sending as many mail
+ * messages as necessary [currently only a single message is supported]. If the server supports
+ * PIPELINING (RFC 2920) the envelope commands and DATA are sent together and their replies
+ * are checked afterwards.
+ *
+ * The message is sent if the server accepts at least one recipient. If it accepts none, the
+ * transaction is abandoned; with PIPELINING the server should already have refused DATA, but
+ * if it didn't an empty message is sent to end the transaction.
+ */
+Task<> ClientConnection::run( )
 {
-    if( line == nullptr )
-        throw invalid_argument( "ServerConnection::line_out" );
+    try {
+        co_await command( nullptr, 2 );
+
+        char host_name[256] = "localhost";
+        gethostname( host_name, sizeof( host_name ) - 1 );
+        string greeting = "EHLO ";
+        greeting += host_name;
+        co_await command( greeting.c_str( ), 2 );
+
+        // The envelope: MAIL, one RCPT per recipient (stored grouped by domain), then DATA.
+        vector<string> envelope;
+        envelope.push_back( "MAIL FROM:<" );
+        envelope.back( ).append( email.get_sender( )).append( ">" );
+        for( size_t index : recipients ) {
+            envelope.push_back( "RCPT TO:<" );
+            envelope.back( ).append( email.get_recipient( index )).append( ">" );
+        }
+        envelope.push_back( "DATA" );
+
+        size_t accepted = 0;
+        if( pipelining ) {
+            for( const string &envelope_line : envelope ) {
+                co_await line_out( envelope_line.c_str( ));
+            }
+            co_await command( nullptr, 2 );
+            for( size_t index : recipients ) {
+                if( co_await recipient_reply( index )) ++accepted;
+            }
+            int code = co_await get_reply( );
+            if( accepted == 0 ) {
+                if( code / 100 == 3 ) {
+                    co_await line_out( "." );
+                    co_await get_reply( );
+                }
+                error = "No recipients were accepted";
+                co_await command( "QUIT", 2 );
+                co_return;
+            }
+            expect( code, 3 );
+        }
+        else {
+            co_await command( envelope.front( ).c_str( ), 2 );
+            for( size_t i = 0; i < recipients.size( ); ++i ) {
+                co_await line_out( envelope[i + 1] );
+                if( co_await recipient_reply( recipients[i] )) ++accepted;
+            }
+            if( accepted == 0 ) {
+                error = "No recipients were accepted";
+                co_await command( "QUIT", 2 );
+                co_return;
+            }
+            co_await command( envelope.back( ).c_str( ), 3 );
+        }
+        // The text is sent a line at a time, straight from the spool record. Lines may end with
+        // CR LF (as received) or with just LF.
+        string stuffed;
+        string_view text = email.get_body( );
+        while( !text.empty( )) {
+            size_t end = text.find( '\n' );
+            string_view line = text.substr( 0, end );
+            text.remove_prefix( end == string_view::npos ? text.size( ) : end + 1 );
+            if( !line.empty( ) && line.back( ) == '\r' ) line.remove_suffix( 1 );
 
-    write( socket_handle, line, strlen( line ));
-    write( socket_handle, "\r\n", 2 );
+            // Lines starting with a period are transparently escaped (RFC 5321, 4.5.2).
+            if( !line.empty( ) && line[0] == '.' ) {
+                stuffed = ".";
+                stuffed += line;
+                co_await line_out( stuffed );
+            }
+            else {
+                co_await line_out( line );
+            }
+        }
+        // The server may take longer to accept the message (RFC 5321, 4.5.3.2).
+        set_timeout( 2 * reply_timeout );
+        co_await command( ".", 2 );
+        delivered = true;
+        set_timeout( reply_timeout );
+
+        co_await command( "QUIT", 2 );
+    }
+    catch( exception &e ) {
+        error = e.what( );
+    }
 }
 
 // ==============
 // Public Methods
 // ==============
 
+//! Set the time limit on each wait for the server, for connections created from now on.
+void ClientConnection::set_reply_timeout( chrono::seconds limit )
+{
+    reply_timeout = limit;
+}
+
+
 //! Construct the object.
 /*!
- * The constructor initializes SMTP state variables as well as the buffers used to hold the raw
- * data on the connection. This class assumes a connection with the server has been previously
- * established. \param handle The socket handle of the connection with the server.
+ * This class assumes a connection with the server has been previously established.
  *
- * \param the_message A reference to the email message to send. Eventually this should be
- * generalized to support a collection of messages.
+ * \param handle The socket handle of the connection with the server.
+ *
+ * \param the_message The spooled email message to send. It must remain valid until the
+ * result has been reported. Eventually this should be generalized to support a collection of
+ * messages.
+ *
+ * \param the_recipients The indexes, in the_message, of the recipients to send it to.
+ *
+ * \param the_result The object to receive the outcome of the delivery.
  */
-ClientConnection::ClientConnection( int handle, const Message &the_message )
+ClientConnection::ClientConnection(
+    int handle, const SpoolRecord &the_message,
+    const vector<size_t> &the_recipients, DeliveryResult *the_result ) :
+    Connection( handle ), email( the_message ), recipients( the_recipients )
 {
-    if( handle < 0 )
+    if( the_result == nullptr )
         throw invalid_argument( "ClientConnection::ClientConnection" );
 
-    buffer_size = 0;
-    buffer_index = 0;
-    socket_handle = handle;
+    result = the_result;
+    delivered = false;
+    pipelining = false;
+    set_timeout( reply_timeout );
 }
 
-//! Have an SMTP conversation with the server.
+
+//! Report the outcome of the delivery.
 /*!
- * This method executes the full SMTP conversation with the server, sending as many mail
- * messages as necessary [currently only a single message is supported].
+ * The object is destroyed by the event loop that ran it, whether the conversation finished or
+ * the connection was lost.
  */
-void ClientConnection::doSMTP( )
+ClientConnection::~ClientConnection( )
 {
-    // TODO: Finish me!
+    if( !delivered && error.empty( )) error = "Connection to server lost";
+    result->set( delivered, error, outcomes );
 }
@@ -6,31 +6,101 @@
 #ifndef CLIENTCONNECTION_HPP
 #define CLIENTCONNECTION_HPP
 
-#include "Message.hpp"
+#include <chrono>
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include "Connection.hpp"
+#include "SpoolRecord.hpp"
 #include "istring.hpp"
 
+//! Class to represent the outcome of a delivery attempt.
+/*!
+ * A ClientConnection runs on an event loop thread while the thread that asked for the delivery
+ * waits for the result. Objects of this class carry the result from one to the other.
+ *
+ * The result says whether the server accepted the message and also what it said about each
+ * recipient. The message is only delivered to the recipients the server accepted.
+ */
+class DeliveryResult {
+public:
+    //! What the server said to a recipient's RCPT command.
+    enum outcome { ACCEPTED, DEFERRED, REJECTED };
+
+    //! The outcome for one recipient.
+    struct Recipient {
+        std::size_t index;   //!< The recipient's index in the spool record.
+        outcome     what;
+        std::string reply;   //!< The server's reply to RCPT.
+    };
+
+    DeliveryResult( );
+
+    ~DeliveryResult( );
+
+    void set( bool delivered, const std::string &error, const std::vector<Recipient> &outcomes );
+
+    bool wait( std::string &error, std::vector<Recipient> &outcomes );
+
+private:
+    pthread_mutex_t lock;
+    pthread_cond_t  changed;
+    bool            done;
+    bool            succeeded;
+    std::string     reason;
+    std::vector<Recipient> recipients;
+
+    // Make copying illegal.
+    DeliveryResult( const DeliveryResult & );
+
+    DeliveryResult &operator=( const DeliveryResult & );
+};
+
+
 //! Class to represent a client-oriented endpoint.
 /*!
- * Instances of this class execute a client side SMTP conversation with a given server.
- * \todo Provide more details.
+ * Instances of this class execute a client side SMTP conversation with a given server. The
+ * conversation is a coroutine running on an event loop in the same way as the server side
+ * conversations. See Connection.hpp. It delivers a single message to some of its recipients
+ * and reports the outcome to a DeliveryResult when the object is destroyed. A recipient that the
+ * server refuses does not stop the delivery to the others.
+ *
+ * Each wait for the server, for a reply or for room to send more of the message, is limited by
+ * the reply timeout. A server that stays silent longer than that fails the delivery attempt.
  */
-class ClientConnection {
+class ClientConnection : public Connection {
 public:
-    ClientConnection( int handle, const Message &the_message );
-    ~ClientConnection( ) = default;
+    ClientConnection( int handle, const SpoolRecord &the_message,
+                      const std::vector<std::size_t> &the_recipients, DeliveryResult *the_result );
+
+    ~ClientConnection( ) override;
 
-    void doSMTP( );
+    static void set_reply_timeout( std::chrono::seconds limit );
 
 private:
-    static const int MAX_BUFFER_SIZE = 128;
-    char    buffer[MAX_BUFFER_SIZE + 1]; //!< Holds raw text from the client.
-    ssize_t buffer_size;                 //!< Amount of valid text in buffer.
-    int     buffer_index;                //!< "Current point" in buffer.
-    int     socket_handle;               //!< Client socket.
+    static std::chrono::seconds reply_timeout;  //!< Longest wait for the server.
+
+    const SpoolRecord &email;   //!< The message to deliver.
+    std::vector<std::size_t> recipients;  //!< Indexes of the recipients to deliver to.
+    std::vector<DeliveryResult::Recipient> outcomes;  //!< The replies to RCPT so far.
+    DeliveryResult *result;     //!< Where to report the outcome.
+    bool            delivered;  //!< True once the server has accepted the message.
+    bool            pipelining; //!< True if the server supports PIPELINING.
+    std::string     error;      //!< Reason the delivery failed, if it did.
+    istring         reply;      //!< The last line of the server's most recent reply.
+
+    Task<> run( ) override;
+
+    Task<int> get_reply( );
+
+    Task<> command( const char *line, int expected_class );
+
+    void expect( int code, int expected_class ) const;
 
-    istring line_in( );
+    Task<bool> recipient_reply( std::size_t index );
 
-    void line_out( const char *line ) const;
+    void timed_out( ) override;
 
     // Make copying illegal.
     ClientConnection( const ClientConnection & );
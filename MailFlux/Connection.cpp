@@ -0,0 +1,377 @@
+/*! \file    Connection.cpp
+ *  \brief   Implementation of the common base of SMTP connections.
+ *  \author  Peter Chapin <spicacality@kelseymountain.org>
+ */
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <utility>
+
+#include <sys/socket.h>
+#include <unistd.h>
+#include "Connection.hpp"
+#include "IoStatistics.hpp"
+
+using namespace std;
+
+size_t Connection::input_buffer_size = 64 * 1024;
+
+// ===============
+// Private Methods
+// ===============
+
+//! Record the coroutine that is suspending and the reason it is suspending.
+void Connection::suspend(
+    coroutine_handle<> awaiting, wait_reason reason, string_view *text, size_t count )
+{
+    waiting = awaiting;
+    waiting_for = reason;
+    awaited_input = text;
+    awaited_count = count;
+
+    // Waiting for another thread is this side's own doing and is not limited.
+    if( reason == EVENT || timeout == chrono::steady_clock::duration::zero( ))
+        deadline = chrono::steady_clock::time_point::max( );
+    else
+        deadline = chrono::steady_clock::now( ) + timeout;
+}
+
+
+//! Resume the conversation for as long as what it is waiting for is available.
+/*!
+ * \throw Whatever exception ended the conversation, if one did.
+ */
+void Connection::wake( )
+{
+    while( waiting ) {
+        if( waiting_for == INPUT ) {
+            if( !input_available( *awaited_input, awaited_count )) return;
+        }
+        else if( waiting_for == EVENT ) {
+            if( !event_ready ) return;
+            event_ready = false;
+        }
+        else if( output_backlogged( )) {
+            return;
+        }
+
+        coroutine_handle<> resumed = exchange( waiting, nullptr );
+        waiting_for = NONE;
+        resumed.resume( );
+        session.rethrow( );
+    }
+}
+
+
+//! Copy text into the input buffer for as long as the conversation is reading.
+/*!
+ * The conversation is resumed with each complete line. Copying stops when it waits for something
+ * other than input, so the buffer only fills if a single line is longer than it can hold.
+ *
+ * \return The number of characters copied.
+ * \throw std::length_error if a line does not fit in the input buffer.
+ * \throw Whatever exception ended the conversation, if one did.
+ */
+size_t Connection::deliver_input( const char *data, size_t size )
+{
+    size_t delivered = 0;
+    while( delivered < size && wants_input( )) {
+        size_t space;
+        char  *area  = input.write_area( space );
+        size_t count = ( size - delivered < space ) ? size - delivered : space;
+        memcpy( area, data + delivered, count );
+        input.commit( count );
+        delivered += count;
+        wake( );
+    }
+    return delivered;
+}
+
+
+//! Give the conversation the text held back by receive(), if it is reading again.
+void Connection::release_held_input( )
+{
+    if( held_input.empty( )) return;
+
+    size_t count = deliver_input( held_input.data( ), held_input.size( ));
+    held_input.erase( 0, count );
+}
+
+
+//! Write as much pending output to the connection as the socket will accept.
+/*!
+ * All the replies queued since the last flush go out in a single send(). A short write means
+ * the socket's buffer is full, so no further attempt is made until the socket becomes writable
+ * again.
+ */
+void Connection::flush_output( )
+{
+    while( output_offset < pending_output.size( )) {
+        size_t  size  = pending_output.size( ) - output_offset;
+        ssize_t count = send( socket_handle,
+                              pending_output.data( ) + output_offset, size, MSG_NOSIGNAL );
+        IoStatistics::count( IoStatistics::socket_writes );
+        if( count == -1 ) {
+            if( errno == EINTR ) continue;
+            if( errno == EAGAIN || errno == EWOULDBLOCK ) return;
+            throw runtime_error( "Unable to write to connection" );
+        }
+        output_written( count );
+        if( static_cast<size_t>( count ) < size ) return;
+    }
+}
+
+// =================
+// Protected Methods
+// =================
+
+//! Read a line of text from the connection.
+/*!
+ * The result must be awaited. It produces a view of the next line of input without its
+ * terminator. The awaiting coroutine is suspended until the line has arrived. The view is only
+ * valid until the coroutine next reads from the connection; text that must be kept longer has
+ * to be copied.
+ */
+Connection::InputAwaiter Connection::line_in( )
+{
+    return InputAwaiter( *this, 0 );
+}
+
+
+//! Read a counted amount of raw input from the connection.
+/*!
+ * The result must be awaited. It produces a view of at least one and at most limit characters
+ * of input, without regard to line structure. The awaiting coroutine is suspended until some
+ * input has arrived. The view has the same lifetime as a line produced by line_in().
+ *
+ * \param limit The maximum number of characters wanted. Must be greater than zero.
+ */
+Connection::InputAwaiter Connection::read_bytes( size_t limit )
+{
+    if( limit == 0 )
+        throw invalid_argument( "Connection::read_bytes" );
+
+    return InputAwaiter( *this, limit );
+}
+
+
+//! Write a line of text to the connection.
+/*!
+ * The line is queued for output at once. Queued output is written when the input currently
+ * available has been processed. See resume() and get_output(). The result may be awaited to
+ * suspend the caller while too much output is waiting to be written; if the caller is not a
+ * coroutine it can simply be discarded.
+ */
+Connection::OutputAwaiter Connection::line_out( const char *line )
+{
+    if( line == nullptr )
+        throw invalid_argument( "Connection::line_out" );
+
+    return line_out( string_view( line ));
+}
+
+
+//! Write a line of text, given as a view, to the connection. See line_out( const char * ).
+Connection::OutputAwaiter Connection::line_out( string_view line )
+{
+    // The first reply of a batch is charged with the time since its input arrived.
+    if( output_offset == pending_output.size( )) {
+        pending_output.clear( );
+        output_offset = 0;
+        output_cause = input_arrival;
+    }
+    pending_output.append( line );
+    pending_output.append( "\r\n" );
+    return OutputAwaiter( *this );
+}
+
+// ==============
+// Public Methods
+// ==============
+
+//! Set the capacity of the input buffer of connections created from now on.
+/*!
+ * The capacity is also the length of the longest line a peer can send.
+ */
+void Connection::set_input_buffer_size( size_t size )
+{
+    input_buffer_size = size;
+}
+
+
+//! Construct the object.
+/*!
+ * This class assumes a connection with the peer has been previously established.
+ *
+ * \param handle The socket handle of the connection.
+ */
+Connection::Connection( int handle ) : input( input_buffer_size )
+{
+    if( handle < 0 )
+        throw invalid_argument( "Connection::Connection" );
+
+    socket_handle = handle;
+    readable = true;
+    output_offset = 0;
+    waiting_for = NONE;
+    awaited_input = nullptr;
+    awaited_count = 0;
+    event_ready = false;
+    waker = nullptr;
+    waker_context = nullptr;
+    input_arrival = output_cause = chrono::steady_clock::now( );
+    timeout = chrono::steady_clock::duration::zero( );
+    deadline = chrono::steady_clock::time_point::max( );
+}
+
+
+//! Begin the conversation.
+/*!
+ * The conversation runs until it first needs input from the peer. This method should be called
+ * once, before the first call to resume() or receive().
+ */
+void Connection::start( )
+{
+    session = run( );
+    session.start( );
+    session.rethrow( );
+}
+
+
+//! Continue the conversation.
+/*!
+ * This method is called whenever the socket might be ready. It reads and processes all the
+ * input the peer has sent so far, picking up wherever the conversation was suspended, and then
+ * writes the replies in one batch. Output is only written earlier if the conversation can't
+ * read further until it has been. The method returns when the socket has no more input, or
+ * when the socket can't accept the output that must be written first. The socket must be in
+ * non-blocking mode and registered for edge-triggered readiness notification.
+ *
+ * \param input_ready True if the socket has been reported readable since the last call.
+ * \param peer_closed True if the peer has been reported to have shut down its side of the
+ * connection. The input is then read until the end of file is seen.
+ * \return true if the conversation is still in progress; false if the connection should be
+ * closed.
+ */
+bool Connection::resume( bool input_ready, bool peer_closed )
+{
+    if( input_ready ) readable = true;
+
+    while( readable && !is_finished( )) {
+        if( !wants_input( )) {
+            flush_output( );
+            if( !wants_input( )) break;
+        }
+
+        size_t space;
+        char  *area  = input.write_area( space );
+        ssize_t count = read( socket_handle, area, space );
+        IoStatistics::count( IoStatistics::socket_reads );
+        if( count == -1 ) {
+            if( errno == EINTR ) continue;
+            if( errno == EAGAIN || errno == EWOULDBLOCK ) {
+                readable = false;
+                break;
+            }
+            return false;
+        }
+        if( count == 0 ) return false;   // The peer closed the connection.
+
+        // A short read empties the socket. Further input will be reported as a new edge.
+        if( static_cast<size_t>( count ) < space && !peer_closed ) readable = false;
+        input_arrival = chrono::steady_clock::now( );
+        input.commit( count );
+        wake( );
+    }
+    flush_output( );
+
+    // Keep the connection until the final output has been delivered.
+    return !is_finished( ) || output_offset < pending_output.size( );
+}
+
+
+//! Process text received from the peer.
+/*!
+ * This method copies the given text into the input buffer and resumes the conversation with
+ * every complete line that is then available. An incomplete line at the end of the text is
+ * completed by the next call. Output is queued and can be retrieved with get_output(). This
+ * method does no socket I/O.
+ *
+ * If the conversation stops reading (to wait for an event, or for its output to be written)
+ * the rest of the text is held and given to it when it reads again. The caller should not
+ * read more from the peer until wants_input() is true.
+ *
+ * \param data Pointer to the text received from the peer.
+ * \param size The number of characters at data.
+ * \return true if the conversation is still in progress; false if it has ended.
+ * \throw Whatever exception ended the conversation, if one did.
+ */
+bool Connection::receive( const char *data, size_t size )
+{
+    input_arrival = chrono::steady_clock::now( );
+    if( held_input.empty( )) {
+        size_t count = deliver_input( data, size );
+        data += count;
+        size -= count;
+    }
+    held_input.append( data, size );
+    return !is_finished( );
+}
+
+
+//! End a conversation that has waited too long for the peer. See has_expired().
+/*!
+ * The derived class is told first, through timed_out(), and may queue a final reply. The
+ * conversation is then destroyed where it is suspended and is_finished() becomes true. The
+ * event loop writes what it can of the remaining output and closes the connection.
+ */
+void Connection::time_out( )
+{
+    timed_out( );
+    waiting = nullptr;
+    waiting_for = NONE;
+    session = Task<>( );
+}
+
+
+//! Resume a conversation that is waiting in wait_event().
+/*!
+ * The event loop calls this method, on its own thread, when it is asked to by notify(). Input
+ * held back by receive() is then processed. The caller writes the output and, if the
+ * conversation wants it, reads more input as usual.
+ *
+ * \return true if the conversation is still in progress; false if it has ended.
+ * \throw Whatever exception ended the conversation, if one did.
+ */
+bool Connection::event_happened( )
+{
+    event_ready = true;
+    wake( );
+    release_held_input( );
+    return !is_finished( );
+}
+
+
+//! Account for text that has been written to the peer.
+/*!
+ * If the conversation was waiting for output to drain it is resumed, and processes any input
+ * held back by receive().
+ *
+ * \param count The number of characters at the start of get_output() that were written.
+ * \throw Whatever exception ended the conversation, if one did.
+ */
+void Connection::output_written( size_t count )
+{
+    output_offset += count;
+    if( output_offset == pending_output.size( )) {
+        IoStatistics::record_reply_latency( chrono::steady_clock::now( ) - output_cause );
+    }
+    else if( output_offset >= OUTPUT_HIGH_WATER ) {
+        // Don't let written text accumulate while the peer is slow to read.
+        pending_output.erase( 0, output_offset );
+        output_offset = 0;
+    }
+    wake( );
+    release_held_input( );
+}
@@ -0,0 +1,246 @@
+/*! \file    Connection.hpp
+ *  \brief   Interface to the common base of SMTP connections.
+ *  \author  Peter Chapin <spicacality@kelseymountain.org>
+ */
+
+#ifndef CONNECTION_HPP
+#define CONNECTION_HPP
+
+#include <chrono>
+#include <coroutine>
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include "LineBuffer.hpp"
+#include "Task.hpp"
+
+//! Class to represent one end of an SMTP conversation.
+/*!
+ * This class holds what the server side and client side of an SMTP conversation have in
+ * common: the socket, the input and output buffering, and the coroutine that carries out the
+ * conversation. Derived classes express the conversation as a coroutine (see run()) that uses
+ * co_await on line_in() and line_out(). The coroutine is suspended whenever it needs input that
+ * has not arrived yet, or when too much of its output is waiting to be written, and is resumed
+ * by an event loop when the situation changes. See Reactor.hpp. Thus many conversations can
+ * share a few threads while the code for each one reads as if it were a simple sequential
+ * program.
+ *
+ * An event loop can either let the object do its own socket I/O by calling resume(), or it can
+ * do the I/O itself: passing the text it reads to receive() and writing the text returned by
+ * get_output(). The second approach is used with completion based I/O such as io_uring. Either
+ * way input is only taken into the input buffer while the conversation is reading it. Text
+ * given to receive() at other times is held back until the conversation reads again, so a
+ * client that pipelines many commands can't fill the buffer while the replies are delayed.
+ *
+ * A conversation can also wait for work done by another thread, such as a spool commit, with
+ * wait_event(). The other thread calls notify() when it is done, and the event loop is asked,
+ * through the waker it installed with set_waker(), to call event_happened() on its own thread.
+ * While it waits for an event the conversation reads no input.
+ *
+ * A derived class can limit how long the conversation waits for the peer with set_timeout().
+ * The event loop checks has_expired() from time to time and ends a conversation that has waited
+ * too long with time_out(). Waits for an event are not limited; they end when the other thread
+ * is done.
+ */
+class Connection {
+public:
+    //! Function that asks an event loop to call event_happened(). Called from any thread.
+    using Waker = void (*)( void *context );
+
+    explicit Connection( int handle );
+
+    virtual ~Connection( ) = default;
+
+    static void set_input_buffer_size( std::size_t size );
+
+    void start( );
+
+    bool resume( bool input_ready = true, bool peer_closed = false );
+
+    bool receive( const char *data, std::size_t size );
+
+    //! Return the text that has not yet been written to the peer.
+    [[nodiscard]] std::string_view get_output( ) const
+    { return std::string_view( pending_output ).substr( output_offset ); }
+
+    void output_written( std::size_t count );
+
+    //! Install the function used by notify(). Must be done before the conversation starts.
+    void set_waker( Waker function, void *context )
+    { waker = function; waker_context = context; }
+
+    //! Ask the event loop to resume a conversation waiting in wait_event(). Thread safe.
+    void notify( )
+    { waker( waker_context ); }
+
+    bool event_happened( );
+
+    //! Return true if the conversation is waiting for more input from the peer.
+    [[nodiscard]] bool wants_input( ) const
+    { return waiting_for == INPUT; }
+
+    //! Return true if the conversation is waiting for notify(). It must not be destroyed.
+    [[nodiscard]] bool wants_event( ) const
+    { return waiting_for == EVENT; }
+
+    //! Return true once the conversation has ended.
+    [[nodiscard]] bool is_finished( ) const
+    { return session.done( ); }
+
+    //! Return the socket handle of the connection.
+    [[nodiscard]] int get_handle( ) const
+    { return socket_handle; }
+
+    //! Return true if the conversation has waited for the peer past its time limit.
+    [[nodiscard]] bool has_expired( std::chrono::steady_clock::time_point now ) const
+    { return ( waiting_for == INPUT || waiting_for == OUTPUT ) && now >= deadline; }
+
+    void time_out( );
+
+protected:
+    //! Awaitable that produces the next line of input, or the next counted piece of input.
+    /*!
+     * The input is a view of the connection's input buffer. It remains valid until the awaiting
+     * coroutine next waits for input.
+     */
+    class InputAwaiter {
+    public:
+        InputAwaiter( Connection &owner, std::size_t limit ) : connection( owner ), count( limit )
+        { }
+
+        bool await_ready( )
+        { return connection.input_available( text, count ); }
+
+        void await_suspend( std::coroutine_handle<> awaiting )
+        { connection.suspend( awaiting, INPUT, &text, count ); }
+
+        std::string_view await_resume( ) const
+        { return text; }
+
+    private:
+        Connection      &connection;
+        std::size_t      count;      //!< Maximum size of a counted piece; zero for a line.
+        std::string_view text;
+    };
+
+    //! Awaitable that waits until there is room for more output.
+    class OutputAwaiter {
+    public:
+        explicit OutputAwaiter( Connection &owner ) : connection( owner )
+        { }
+
+        bool await_ready( ) const
+        { return !connection.output_backlogged( ); }
+
+        void await_suspend( std::coroutine_handle<> awaiting )
+        { connection.suspend( awaiting, OUTPUT, nullptr, 0 ); }
+
+        void await_resume( ) const
+        { }
+
+    private:
+        Connection &connection;
+    };
+
+    //! Awaitable that waits until another thread calls notify().
+    class EventAwaiter {
+    public:
+        explicit EventAwaiter( Connection &owner ) : connection( owner )
+        { }
+
+        bool await_ready( ) const
+        { return false; }
+
+        void await_suspend( std::coroutine_handle<> awaiting )
+        { connection.suspend( awaiting, EVENT, nullptr, 0 ); }
+
+        void await_resume( ) const
+        { }
+
+    private:
+        Connection &connection;
+    };
+
+    InputAwaiter line_in( );
+
+    InputAwaiter read_bytes( std::size_t limit );
+
+    OutputAwaiter line_out( const char *line );
+
+    OutputAwaiter line_out( std::string_view line );
+
+    //! Return an awaitable that waits until there is room for more output.
+    OutputAwaiter output_space( )
+    { return OutputAwaiter( *this ); }
+
+    //! Return an awaitable that waits for notify(). The work that calls it must already be started.
+    EventAwaiter wait_event( )
+    { return EventAwaiter( *this ); }
+
+    //! The conversation itself. It is started by start().
+    virtual Task<> run( ) = 0;
+
+    //! Limit each later wait for the peer to the given time. Zero means no limit.
+    void set_timeout( std::chrono::steady_clock::duration limit )
+    { timeout = limit; }
+
+    //! Called by time_out() before the conversation ends. It may queue a final line of output.
+    virtual void timed_out( )
+    { }
+
+    int socket_handle;  //!< The connection's socket.
+
+private:
+    enum wait_reason { NONE, INPUT, OUTPUT, EVENT };
+
+    //! Output backlog above which line_out() suspends the conversation.
+    static const std::size_t OUTPUT_HIGH_WATER = 16 * 1024;
+
+    static std::size_t input_buffer_size;  //!< Capacity of each connection's input buffer.
+
+    LineBuffer  input;                   //!< Text from the peer not yet processed.
+    std::string held_input;              //!< Text given to receive() not yet in input.
+    bool        readable;                //!< The socket may have input not yet read.
+    std::string pending_output;          //!< Output; the text before output_offset is written.
+    std::size_t output_offset;           //!< Amount of pending_output already written.
+
+    // Used to measure reply latency.
+    std::chrono::steady_clock::time_point input_arrival;  //!< When input last arrived.
+    std::chrono::steady_clock::time_point output_cause;   //!< Arrival of the input being answered.
+
+    std::chrono::steady_clock::duration   timeout;   //!< Longest wait for the peer; zero for none.
+    std::chrono::steady_clock::time_point deadline;  //!< When the current wait for the peer ends.
+
+    Task<>                  session;     //!< The coroutine returned by run().
+    std::coroutine_handle<> waiting;     //!< The innermost suspended coroutine.
+    wait_reason             waiting_for; //!< Why the conversation is suspended.
+    std::string_view       *awaited_input; //!< Where to put the input awaited by waiting.
+    std::size_t             awaited_count; //!< Size of the awaited piece; zero for a line.
+    bool                    event_ready;   //!< event_happened() has been called.
+    Waker                   waker;         //!< Used by notify().
+    void                   *waker_context;
+
+    bool input_available( std::string_view &text, std::size_t count )
+    { return ( count == 0 ) ? input.next_line( text ) : input.next_bytes( count, text ); }
+
+    [[nodiscard]] bool output_backlogged( ) const
+    { return pending_output.size( ) - output_offset >= OUTPUT_HIGH_WATER; }
+
+    void suspend( std::coroutine_handle<> awaiting,
+                  wait_reason reason, std::string_view *text, std::size_t count );
+
+    void wake( );
+
+    void flush_output( );
+
+    std::size_t deliver_input( const char *data, std::size_t size );
+
+    void release_held_input( );
+
+    // Make copying illegal.
+    Connection( const Connection & );
+
+    Connection &operator=( const Connection & );
+};
+
+#endif
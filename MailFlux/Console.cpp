@@ -7,6 +7,7 @@
  * curses is not thread-safe.
  */
 
+#include <map>
 #include <curses.h>
 #include <pthread.h>
 #include <sys/select.h>
@@ -36,6 +37,9 @@ namespace {
     WINDOW *asynchronous;  //!< Curses window for asynchronous messages.
     WINDOW *interaction;   //!< Curses window for user dialog.
 
+    //! Commands supplied by other subsystems, indexed by command name.
+    map<string, Console::command_handler> commands;
+
     //! Display a banner.
     /*!
      * This function executes in the interactive thread. It outputs a welcome banner to the
@@ -203,6 +207,24 @@ namespace Console {
     }
 
 
+    //! Adds a command to the set understood by the interactive display area.
+    /*!
+     * Subsystems use this function to make their internal state available to the user. When
+     * the user types the given name at the prompt the handler is called and the text it
+     * returns is displayed. This function should only be called during initialization, before
+     * command_loop() starts.
+     *
+     * \param name The name of the command. Registering a name a second time replaces the
+     * previous handler.
+     *
+     * \param handler The function that executes the command.
+     */
+    void register_command( const char *name, command_handler handler )
+    {
+        commands[name] = handler;
+    }
+
+
     //! Interact with the user.
     /*!
      * This function accepts and handles console commands from the user. It executes in its own
@@ -222,6 +244,16 @@ namespace Console {
                 }
                 line = get_line( );
                 if( line == "quit" ) return;
+                if( line.empty( )) continue;
+
+                auto command = commands.find( line );
+                string response = ( command == commands.end( )) ?
+                    "Unknown command: " + line : command->second( );
+                {
+                    CursesMutex lock;
+                    wprintw( interaction, "%s\n", response.c_str( ));
+                    wrefresh( interaction );
+                }
             }
         }
         catch( exception &e ) {
@@ -22,6 +22,14 @@
  * thread.
  */
 namespace Console {
+
+    //! Type of functions that implement console commands.
+    /*!
+     * A command handler returns the text to display in the interactive display area. The text
+     * can contain several lines separated by '\n' characters.
+     */
+    typedef std::string (*command_handler)( );
+
     void initialize( );
 
     void cleanup( );
@@ -34,6 +42,8 @@ namespace Console {
 
     void put_debug_line( const char *line );
 
+    void register_command( const char *name, command_handler handler );
+
     void command_loop( );
 }
 
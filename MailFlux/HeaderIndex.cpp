@@ -0,0 +1,131 @@
+/*! \file    HeaderIndex.cpp
+ *  \brief   Implementation of an index of the header fields of a message.
+ *  \author  Peter Chapin <spicacality@kelseymountain.org>
+ */
+
+#include <limits>
+#include "HeaderIndex.hpp"
+
+using namespace std;
+
+// Anonymous namespace for module private items.
+namespace {
+
+    //! Names of the common header fields, in the order of HeaderIndex::common_header.
+    const istring_view common_names[] = {
+        "Message-ID", "Date", "From", "To", "Cc", "Subject"
+    };
+
+    //! Return true if the text is a valid header field name (RFC 5322, 2.2).
+    bool is_field_name( istring_view name )
+    {
+        if( name.empty( )) return false;
+        for( char ch : name ) {
+            if( ch < 33 || ch > 126 ) return false;
+        }
+        return true;
+    }
+
+}   // End of anonymous namespace.
+
+
+//! Construct an empty index.
+HeaderIndex::HeaderIndex( ) : complete( false )
+{
+    common.fill( -1 );
+}
+
+
+//! Add the next line of the header to the index.
+/*!
+ * The header ends at the first empty line. A line that is neither a header field nor a
+ * continuation of one also ends the header, as does a line beyond the first 4 GiB of the text.
+ * Lines given after the end of the header are ignored.
+ *
+ * \param text The text holding the header.
+ * \param start The offset of the line in the text.
+ * \param length The length of the line, without its terminator.
+ * \return false if the line ends the header. It is not part of the header.
+ */
+bool HeaderIndex::add_line( const char *text, size_t start, size_t length )
+{
+    if( complete ) return false;
+    if( start + length > numeric_limits<uint32_t>::max( )) {
+        complete = true;
+        return false;
+    }
+    istring_view line( text + start, length );
+    uint32_t line_end = static_cast<uint32_t>( start + length );
+
+    if( !line.empty( ) && ( line[0] == ' ' || line[0] == '\t' ) && !fields.empty( )) {
+        // A folded continuation of the previous field.
+        fields.back( ).value_end = line_end;
+        return true;
+    }
+
+    istring_view::size_type colon = line.find( ':' );
+    if( colon == istring_view::npos || !is_field_name( line.substr( 0, colon ))) {
+        complete = true;
+        return false;
+    }
+
+    istring_view::size_type value = colon + 1;
+    while( value < line.size( ) && ( line[value] == ' ' || line[value] == '\t' )) {
+        ++value;
+    }
+    fields.push_back( { static_cast<uint32_t>( start ), static_cast<uint32_t>( colon ),
+                        static_cast<uint32_t>( start + value ), line_end } );
+
+    // The first occurrence of a common field is the one that is found.
+    istring_view name = line.substr( 0, colon );
+    for( size_t i = 0; i < COMMON_HEADER_COUNT; ++i ) {
+        if( name == common_names[i] ) {
+            if( common[i] < 0 ) common[i] = static_cast<int>( fields.size( ) - 1 );
+            break;
+        }
+    }
+    return true;
+}
+
+
+//! Forget the index.
+void HeaderIndex::clear( )
+{
+    fields.clear( );
+    common.fill( -1 );
+    complete = false;
+}
+
+
+//! Find a header field by name. The name is compared without regard to case.
+/*!
+ * \param text The text holding the header.
+ * \param name The name of the field wanted.
+ * \return The index of the field's first occurrence, or -1 if it is absent.
+ */
+int HeaderIndex::find( const char *text, istring_view name ) const
+{
+    for( size_t i = 0; i < fields.size( ); ++i ) {
+        if( get_name( text, i ) == name ) return static_cast<int>( i );
+    }
+    return -1;
+}
+
+
+//! Return the name of the field with the given index, counting from zero.
+istring_view HeaderIndex::get_name( const char *text, size_t index ) const
+{
+    const Field &field = fields.at( index );
+    return istring_view( text + field.name_offset, field.name_length );
+}
+
+
+//! Return the value of the field with the given index, counting from zero.
+/*!
+ * Leading white space is not included in the value.
+ */
+istring_view HeaderIndex::get_value( const char *text, size_t index ) const
+{
+    const Field &field = fields.at( index );
+    return istring_view( text + field.value_offset, field.value_end - field.value_offset );
+}
@@ -0,0 +1,76 @@
+/*! \file    HeaderIndex.hpp
+ *  \brief   Interface to an index of the header fields of a message.
+ *  \author  Peter Chapin <spicacality@kelseymountain.org>
+ */
+
+#ifndef HEADERINDEX_HPP
+#define HEADERINDEX_HPP
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "istring.hpp"
+
+//! Class to record where the fields of a message header (RFC 5322, 2.2) are in its text.
+/*!
+ * The lines of the header are given to add_line() in order, as offsets into some text that the
+ * index does not own. The index records the offsets of each field's name and value, so nothing
+ * is copied; the text must be supplied again to look at a field. A field's value runs from the
+ * first character after the colon and any white space that follows it to the end of the last
+ * line of the field. If the lines of the text are stored without their terminators this is the
+ * unfolded value; otherwise it includes the line breaks of a folded field.
+ *
+ * Message indexes its header as it is received and SpoolRecord indexes the text of a spooled
+ * message when one of its header fields is first wanted.
+ */
+class HeaderIndex {
+public:
+    //! Header fields that can be found without searching.
+    enum common_header {
+        MESSAGE_ID, DATE, FROM, TO, CC, SUBJECT, COMMON_HEADER_COUNT
+    };
+
+    //! Location of a header field in the text.
+    struct Field {
+        std::uint32_t name_offset;
+        std::uint32_t name_length;
+        std::uint32_t value_offset;
+        std::uint32_t value_end;    //!< End of the last line of the field.
+    };
+
+    HeaderIndex( );
+
+    bool add_line( const char *text, std::size_t start, std::size_t length );
+
+    void clear( );
+
+    //! Return true once the end of the header has been found.
+    [[nodiscard]] bool is_complete( ) const
+    { return complete; }
+
+    //! Return the number of fields in the header.
+    [[nodiscard]] std::size_t size( ) const
+    { return fields.size( ); }
+
+    //! Return the location of the field with the given index, counting from zero.
+    [[nodiscard]] const Field &operator[]( std::size_t index ) const
+    { return fields.at( index ); }
+
+    //! Return the index of the first occurrence of a common field, or -1 if it is absent.
+    [[nodiscard]] int find( common_header which ) const
+    { return common[which]; }
+
+    int find( const char *text, istring_view name ) const;
+
+    istring_view get_name( const char *text, std::size_t index ) const;
+
+    istring_view get_value( const char *text, std::size_t index ) const;
+
+private:
+    std::vector<Field>                    fields;
+    std::array<int, COMMON_HEADER_COUNT>  common;    //!< Index or -1 if absent.
+    bool                                  complete;
+};
+
+#endif
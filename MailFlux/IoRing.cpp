@@ -0,0 +1,228 @@
+/*! \file    IoRing.cpp
+ *  \brief   Implementation of a minimal io_uring submission/completion ring.
+ *  \author  Peter Chapin <spicacality@kelseymountain.org>
+ *
+ * The ring buffers are shared with the kernel. The kernel reads the submission tail and writes
+ * the submission head; it writes the completion tail and reads the completion head. The head
+ * and tail indices are accessed with acquire/release ordering so that entries are fully written
+ * before the other side can see them.
+ */
+
+#include "IoRing.hpp"
+
+#ifdef MAILFLUX_HAVE_IO_URING
+
+#include <cerrno>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace {
+
+    int io_uring_setup( unsigned entries, io_uring_params *parameters )
+    {
+        return static_cast<int>( syscall( __NR_io_uring_setup, entries, parameters ));
+    }
+
+    int io_uring_enter( int handle, unsigned to_submit, unsigned min_complete, unsigned flags )
+    {
+        return static_cast<int>(
+            syscall( __NR_io_uring_enter, handle, to_submit, min_complete, flags, nullptr, 0 ));
+    }
+
+    int io_uring_register( int handle, unsigned opcode, const void *arg, unsigned count )
+    {
+        return static_cast<int>( syscall( __NR_io_uring_register, handle, opcode, arg, count ));
+    }
+
+    //! Return a pointer to a field of a ring given its offset from the start of the mapping.
+    template<typename T>
+    T *ring_field( void *ring, unsigned offset )
+    {
+        return reinterpret_cast<T *>( static_cast<char *>( ring ) + offset );
+    }
+
+    [[noreturn]] void ring_error( const char *what )
+    {
+        ostringstream formatter;
+        formatter << what << ": " << strerror( errno );
+        throw runtime_error( formatter.str( ));
+    }
+
+}   // End of anonymous namespace.
+
+
+//! Create a ring.
+/*!
+ * \param entries The number of submission queue entries. The kernel rounds this up to a power
+ * of two and sizes the completion queue to twice that.
+ *
+ * \throw std::runtime_error if the kernel does not support io_uring or the ring can't be
+ * mapped.
+ */
+IoRing::IoRing( unsigned entries )
+{
+    io_uring_params parameters;
+    memset( &parameters, 0, sizeof( parameters ));
+
+    if(( ring_handle = io_uring_setup( entries, &parameters )) < 0 )
+        ring_error( "Problem creating io_uring" );
+
+    sq_ring_size = parameters.sq_off.array + parameters.sq_entries * sizeof( unsigned );
+    cq_ring_size = parameters.cq_off.cqes + parameters.cq_entries * sizeof( io_uring_cqe );
+    sqes_size    = parameters.sq_entries * sizeof( io_uring_sqe );
+
+    // Newer kernels allow both rings to share one mapping.
+    bool single_mmap = ( parameters.features & IORING_FEAT_SINGLE_MMAP ) != 0;
+    if( single_mmap ) {
+        if( cq_ring_size > sq_ring_size ) sq_ring_size = cq_ring_size;
+        cq_ring_size = sq_ring_size;
+    }
+
+    sq_ring = mmap( nullptr, sq_ring_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring_handle, IORING_OFF_SQ_RING );
+    if( sq_ring == MAP_FAILED ) {
+        close( ring_handle );
+        ring_error( "Problem mapping io_uring submission queue" );
+    }
+
+    if( single_mmap ) {
+        cq_ring = sq_ring;
+    }
+    else {
+        cq_ring = mmap( nullptr, cq_ring_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring_handle, IORING_OFF_CQ_RING );
+        if( cq_ring == MAP_FAILED ) {
+            munmap( sq_ring, sq_ring_size );
+            close( ring_handle );
+            ring_error( "Problem mapping io_uring completion queue" );
+        }
+    }
+
+    void *sqe_map = mmap( nullptr, sqes_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, ring_handle, IORING_OFF_SQES );
+    if( sqe_map == MAP_FAILED ) {
+        if( !single_mmap ) munmap( cq_ring, cq_ring_size );
+        munmap( sq_ring, sq_ring_size );
+        close( ring_handle );
+        ring_error( "Problem mapping io_uring submission entries" );
+    }
+    sqes = static_cast<io_uring_sqe *>( sqe_map );
+
+    sq_head    = ring_field<unsigned>( sq_ring, parameters.sq_off.head );
+    sq_tail    = ring_field<unsigned>( sq_ring, parameters.sq_off.tail );
+    sq_mask    = ring_field<unsigned>( sq_ring, parameters.sq_off.ring_mask );
+    sq_array   = ring_field<unsigned>( sq_ring, parameters.sq_off.array );
+    sq_entries = parameters.sq_entries;
+
+    cq_head = ring_field<unsigned>( cq_ring, parameters.cq_off.head );
+    cq_tail = ring_field<unsigned>( cq_ring, parameters.cq_off.tail );
+    cq_mask = ring_field<unsigned>( cq_ring, parameters.cq_off.ring_mask );
+    cqes    = ring_field<io_uring_cqe>( cq_ring, parameters.cq_off.cqes );
+
+    local_tail = *sq_tail;
+}
+
+
+//! Release the ring.
+IoRing::~IoRing( )
+{
+    munmap( sqes, sqes_size );
+    if( cq_ring != sq_ring ) munmap( cq_ring, cq_ring_size );
+    munmap( sq_ring, sq_ring_size );
+    close( ring_handle );
+}
+
+
+//! Return a cleared submission queue entry.
+/*!
+ * The entry becomes part of the next batch handed to the kernel by submit() or
+ * submit_and_wait().
+ *
+ * \return A pointer to the entry or nullptr if the submission queue is full. In that case the
+ * caller should call submit() and try again.
+ */
+io_uring_sqe *IoRing::get_sqe( )
+{
+    unsigned head = __atomic_load_n( sq_head, __ATOMIC_ACQUIRE );
+    if( local_tail - head >= sq_entries ) return nullptr;
+
+    unsigned index = local_tail & *sq_mask;
+    io_uring_sqe *sqe = &sqes[index];
+    memset( sqe, 0, sizeof( *sqe ));
+    sq_array[index] = index;
+    ++local_tail;
+    return sqe;
+}
+
+
+//! Hand all prepared entries to the kernel without waiting for completions.
+/*!
+ * \return The number of entries submitted.
+ */
+int IoRing::submit( )
+{
+    return submit_and_wait( 0 );
+}
+
+
+//! Hand all prepared entries to the kernel and wait for completions.
+/*!
+ * \param wait_count The minimum number of completions to wait for.
+ * \return The number of entries submitted, or -1 if interrupted by a signal.
+ * \throw std::runtime_error if the kernel rejects the request.
+ */
+int IoRing::submit_and_wait( unsigned wait_count )
+{
+    // Entries the kernel has not yet consumed, including any left over from a previous call.
+    unsigned to_submit = local_tail - __atomic_load_n( sq_head, __ATOMIC_ACQUIRE );
+
+    __atomic_store_n( sq_tail, local_tail, __ATOMIC_RELEASE );
+    if( to_submit == 0 && wait_count == 0 ) return 0;
+
+    int result = io_uring_enter(
+        ring_handle, to_submit, wait_count, wait_count > 0 ? IORING_ENTER_GETEVENTS : 0 );
+    if( result < 0 ) {
+        if( errno == EINTR ) return -1;
+        ring_error( "Problem submitting to io_uring" );
+    }
+    return result;
+}
+
+
+//! Return the oldest unretired completion, or nullptr if there are none.
+io_uring_cqe *IoRing::peek_cqe( )
+{
+    unsigned head = *cq_head;
+    if( head == __atomic_load_n( cq_tail, __ATOMIC_ACQUIRE )) return nullptr;
+    return &cqes[head & *cq_mask];
+}
+
+
+//! Retire the completion most recently returned by peek_cqe().
+void IoRing::cqe_seen( )
+{
+    __atomic_store_n( cq_head, *cq_head + 1, __ATOMIC_RELEASE );
+}
+
+
+//! Register buffers for use by fixed buffer operations.
+/*!
+ * Registered buffers are pinned by the kernel once, instead of on every operation. They are
+ * referred to by index in IORING_OP_READ_FIXED and IORING_OP_WRITE_FIXED requests.
+ *
+ * \return true if successful; false if the kernel refused (for example because of the locked
+ * memory limit).
+ */
+bool IoRing::register_buffers( const iovec *buffers, unsigned count )
+{
+    return io_uring_register( ring_handle, IORING_REGISTER_BUFFERS, buffers, count ) == 0;
+}
+
+#endif
@@ -0,0 +1,83 @@
+/*! \file    IoRing.hpp
+ *  \brief   Interface to a minimal io_uring submission/completion ring.
+ *  \author  Peter Chapin <spicacality@kelseymountain.org>
+ */
+
+#ifndef IORING_HPP
+#define IORING_HPP
+
+// The io_uring backend is available when building for Linux with kernel headers that define
+// it. It can be excluded explicitly by defining MAILFLUX_NO_IO_URING (make IO_URING=no).
+//
+#if defined( __linux__ ) && !defined( MAILFLUX_NO_IO_URING ) && __has_include( <linux/io_uring.h> )
+#define MAILFLUX_HAVE_IO_URING 1
+#endif
+
+#ifdef MAILFLUX_HAVE_IO_URING
+
+#include <cstddef>
+#include <linux/io_uring.h>
+#include <sys/uio.h>
+
+//! Class to represent an io_uring instance.
+/*!
+ * This is a thin wrapper around the kernel's io_uring interface. It deliberately talks to the
+ * kernel directly rather than depending on liburing. Only the operations needed by the reactor
+ * are provided. Submission queue entries are obtained with get_sqe(), filled in by the caller,
+ * and handed to the kernel in batches by submit_and_wait(). Completions are then examined with
+ * peek_cqe() and retired with cqe_seen().
+ *
+ * An IoRing object must only be used by one thread at a time.
+ */
+class IoRing {
+public:
+    explicit IoRing( unsigned entries );
+
+    ~IoRing( );
+
+    io_uring_sqe *get_sqe( );
+
+    int submit( );
+
+    int submit_and_wait( unsigned wait_count );
+
+    io_uring_cqe *peek_cqe( );
+
+    void cqe_seen( );
+
+    bool register_buffers( const iovec *buffers, unsigned count );
+
+private:
+    int      ring_handle;         //!< File descriptor of the ring.
+    unsigned local_tail;          //!< Submission tail including entries not yet submitted.
+
+    // Submission queue (shared with the kernel).
+    unsigned     *sq_head;
+    unsigned     *sq_tail;
+    unsigned     *sq_mask;
+    unsigned     *sq_array;
+    unsigned      sq_entries;
+    io_uring_sqe *sqes;
+
+    // Completion queue (shared with the kernel).
+    unsigned     *cq_head;
+    unsigned     *cq_tail;
+    unsigned     *cq_mask;
+    io_uring_cqe *cqes;
+
+    // Mappings to release in the destructor.
+    void  *sq_ring;
+    size_t sq_ring_size;
+    void  *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+
+    // Make copying illegal.
+    IoRing( const IoRing & );
+
+    IoRing &operator=( const IoRing & );
+};
+
+#endif
+
+#endif
@@ -0,0 +1,71 @@
+/*! \file    IoStatistics.cpp
+ *  \brief   Implementation of the connection I/O counters.
+ *  \author  Peter Chapin <spicacality@kelseymountain.org>
+ */
+
+#include <sstream>
+#include "IoStatistics.hpp"
+
+using namespace std;
+
+// Anonymous namespace for module private items.
+namespace {
+
+    // Reply latency, in microseconds.
+    atomic<unsigned long> reply_batches( 0 );
+    atomic<unsigned long> total_latency( 0 );
+    atomic<unsigned long> maximum_latency( 0 );
+
+}   // End of anonymous namespace.
+
+
+namespace IoStatistics {
+
+    atomic<unsigned long> socket_reads( 0 );
+    atomic<unsigned long> socket_writes( 0 );
+    atomic<unsigned long> event_waits( 0 );
+    atomic<unsigned long> ring_enters( 0 );
+
+
+    //! Account for a batch of replies that has been completely written.
+    void record_reply_latency( chrono::steady_clock::duration latency )
+    {
+        unsigned long microseconds = static_cast<unsigned long>(
+            chrono::duration_cast<chrono::microseconds>( latency ).count( ));
+
+        count( reply_batches );
+        total_latency.fetch_add( microseconds, memory_order_relaxed );
+
+        unsigned long maximum = maximum_latency.load( memory_order_relaxed );
+        while( microseconds > maximum &&
+               !maximum_latency.compare_exchange_weak( maximum, microseconds,
+                                                       memory_order_relaxed )) { }
+    }
+
+
+    //! Display the counters. This is the console's "io" command.
+    string report( )
+    {
+        unsigned long reads   = socket_reads.load( memory_order_relaxed );
+        unsigned long writes  = socket_writes.load( memory_order_relaxed );
+        unsigned long waits   = event_waits.load( memory_order_relaxed );
+        unsigned long enters  = ring_enters.load( memory_order_relaxed );
+        unsigned long batches = reply_batches.load( memory_order_relaxed );
+        unsigned long total   = total_latency.load( memory_order_relaxed );
+
+        ostringstream formatter;
+        formatter << "Socket reads  : " << reads << "\n"
+                  << "Socket writes : " << writes << "\n"
+                  << "System calls  : " << ( enters == 0 ? reads + writes + waits : enters )
+                  << " (" << waits << " epoll waits, " << enters << " ring enters)\n"
+                  << "Reply batches : " << batches << "\n"
+                  << "Reply latency : ";
+        if( batches == 0 )
+            formatter << "n/a";
+        else
+            formatter << total / batches << " us average, "
+                      << maximum_latency.load( memory_order_relaxed ) << " us maximum";
+        return formatter.str( );
+    }
+
+}
@@ -0,0 +1,39 @@
+/*! \file    IoStatistics.hpp
+ *  \brief   Interface to the connection I/O counters.
+ *  \author  Peter Chapin <spicacality@kelseymountain.org>
+ */
+
+#ifndef IOSTATISTICS_HPP
+#define IOSTATISTICS_HPP
+
+#include <atomic>
+#include <chrono>
+#include <string>
+
+//! Namespace for counters that describe the I/O done on behalf of SMTP connections.
+/*!
+ * The counters are updated by every event loop thread, without locking. They are displayed by
+ * the console command "io". Socket reads and writes are system calls with the epoll backend;
+ * with the io_uring backend they are ring operations and the system calls are the ring enters.
+ *
+ * Reply latency is measured from the arrival of the input that prompted a batch of replies (or
+ * the start of the conversation, for the greeting) to the moment the last of those replies has
+ * been written to the socket.
+ */
+namespace IoStatistics {
+
+    extern std::atomic<unsigned long> socket_reads;   //!< Reads from connection sockets.
+    extern std::atomic<unsigned long> socket_writes;  //!< Writes to connection sockets.
+    extern std::atomic<unsigned long> event_waits;    //!< Calls to epoll_wait().
+    extern std::atomic<unsigned long> ring_enters;    //!< Calls to io_uring_enter().
+
+    //! Count an event, relaxing the memory ordering since the counters are only displayed.
+    inline void count( std::atomic<unsigned long> &counter )
+    { counter.fetch_add( 1, std::memory_order_relaxed ); }
+
+    void record_reply_latency( std::chrono::steady_clock::duration latency );
+
+    std::string report( );
+}
+
+#endif
@@ -0,0 +1,94 @@
+/*! \file    LineBuffer.cpp
+ *  \brief   Implementation of a buffer that splits network input into lines.
+ *  \author  Peter Chapin <spicacality@kelseymountain.org>
+ */
+
+#include <cstring>
+#include <stdexcept>
+#include "LineBuffer.hpp"
+
+using namespace std;
+
+//! Construct an empty buffer.
+/*!
+ * \param size The capacity of the buffer. This is also the length of the longest line that can
+ * be handled.
+ */
+LineBuffer::LineBuffer( size_t size ) : storage( new char[size] )
+{
+    capacity = size;
+    begin = 0;
+    scanned = 0;
+    end = 0;
+}
+
+
+//! Return the free space at the end of the buffer.
+/*!
+ * Text that has already been taken out of the buffer is discarded to make room if necessary.
+ * This invalidates all views previously returned by next_line().
+ *
+ * \param space Receives the number of characters that can be written at the returned address.
+ * \return A pointer to the free space.
+ * \throw std::length_error if the buffer is full of text that does not contain a complete line.
+ */
+char *LineBuffer::write_area( size_t &space )
+{
+    // Slide the remaining text to the front once the free space gets small.
+    if( begin == end ) {
+        begin = scanned = end = 0;
+    }
+    else if( begin > 0 && capacity - end < capacity / 4 ) {
+        memmove( storage.get( ), storage.get( ) + begin, end - begin );
+        scanned -= begin;
+        end -= begin;
+        begin = 0;
+    }
+
+    if( end == capacity )
+        throw length_error( "Input line too long" );
+
+    space = capacity - end;
+    return storage.get( ) + end;
+}
+
+
+//! Take the next complete line out of the buffer.
+/*!
+ * \param line Receives a view of the line without its CR LF (or bare LF) terminator.
+ * \return true if a complete line was available; false if more input is needed.
+ */
+bool LineBuffer::next_line( string_view &line )
+{
+    const char *base = storage.get( );
+    const char *terminator =
+        static_cast<const char *>( memchr( base + scanned, '\n', end - scanned ));
+    if( terminator == nullptr ) {
+        scanned = end;
+        return false;
+    }
+
+    size_t length = terminator - ( base + begin );
+    if( length > 0 && base[begin + length - 1] == '\r' ) --length;
+    line = string_view( base + begin, length );
+    begin = scanned = ( terminator - base ) + 1;
+    return true;
+}
+
+
+//! Take up to a given number of characters out of the buffer, regardless of line structure.
+/*!
+ * \param limit The maximum number of characters to take.
+ * \param bytes Receives a view of the characters taken. It is never empty.
+ * \return true if any characters were available; false if more input is needed.
+ */
+bool LineBuffer::next_bytes( size_t limit, string_view &bytes )
+{
+    if( begin == end || limit == 0 ) return false;
+
+    size_t count = ( end - begin < limit ) ? end - begin : limit;
+    bytes = string_view( storage.get( ) + begin, count );
+    begin += count;
+    if( scanned < begin ) scanned = begin;
+    return true;
+}
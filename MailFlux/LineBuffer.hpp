@@ -0,0 +1,50 @@
+/*! \file    LineBuffer.hpp
+ *  \brief   Interface to a buffer that splits network input into lines.
+ *  \author  Peter Chapin <spicacality@kelseymountain.org>
+ */
+
+#ifndef LINEBUFFER_HPP
+#define LINEBUFFER_HPP
+
+#include <cstddef>
+#include <memory>
+#include <string_view>
+
+//! Class to represent the input side of a connection.
+/*!
+ * Raw text from the peer is read directly into the buffer's free space (see write_area() and
+ * commit()) and complete lines are then taken out of it with next_line(). Counted amounts of
+ * data can be taken out with next_bytes() instead. Both are returned as views of the buffer's
+ * own storage; no text is copied. A view remains valid until the next call to write_area().
+ *
+ * The end of each line is located with memchr() which the C library implements with the widest
+ * vector instructions the processor supports. Text that has already been scanned is not scanned
+ * again when a line arrives in several pieces.
+ */
+class LineBuffer {
+public:
+    explicit LineBuffer( std::size_t size );
+
+    char *write_area( std::size_t &space );
+
+    //! Add count characters, just written into the write area, to the buffered text.
+    void commit( std::size_t count )
+    { end += count; }
+
+    bool next_line( std::string_view &line );
+
+    bool next_bytes( std::size_t limit, std::string_view &bytes );
+
+    //! Return the number of characters not yet taken out of the buffer.
+    [[nodiscard]] std::size_t available( ) const
+    { return end - begin; }
+
+private:
+    std::unique_ptr<char[]> storage;
+    std::size_t capacity;   //!< Size of storage.
+    std::size_t begin;      //!< Start of the text not yet taken out of the buffer.
+    std::size_t scanned;    //!< End of the text known not to contain a line terminator.
+    std::size_t end;        //!< End of the buffered text.
+};
+
+#endif
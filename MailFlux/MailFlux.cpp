@@ -8,6 +8,7 @@
 
 // Standard C
 #include <cerrno>
+#include <clocale>
 #include <csignal>
 #include <cstdio>
 #include <cstdlib>
@@ -32,7 +33,8 @@
 // MailFlux
 #include "config.hpp"
 #include "Console.hpp"
-#include "ServerConnection.hpp"
+#include "istring.hpp"
+#include "Reactor.hpp"
 #include "Spool.hpp"
 
 #define BUFFER_SIZE 128
@@ -84,8 +86,11 @@ int daemonize( )
  * returns the listening socket handle if successful, otherwise it returns -1.
  *
  * \param port The port on which MailFlux should listen for client connections.
+ *
+ * \param shared If true the socket is bound with SO_REUSEPORT so that several listening sockets
+ * can share the port. See Reactor.hpp.
  */
-int initialize_network( unsigned short port )
+int initialize_network( unsigned short port, bool shared )
 {
     int listen_handle;
     struct sockaddr_in server_address;
@@ -98,6 +103,17 @@ int initialize_network( unsigned short port )
         return -1;
     }
 
+    // Allow a restarted server to bind while old connections linger in TIME_WAIT.
+    int option = 1;
+    setsockopt( listen_handle, SOL_SOCKET, SO_REUSEADDR, &option, sizeof( option ));
+    if( shared &&
+        setsockopt( listen_handle, SOL_SOCKET, SO_REUSEPORT, &option, sizeof( option )) < 0 ) {
+        formatter << "Problem sharing port: " << strerror(errno);
+        Console::put_exception_line( formatter.str( ).c_str( ));
+        close( listen_handle );
+        return -1;
+    }
+
     // Prepare the server socket address structure.
     memset( &server_address, 0, sizeof( server_address ));
     server_address.sin_family = AF_INET;
@@ -125,35 +141,8 @@ int initialize_network( unsigned short port )
 
 
 /*!
- * This function deals with a single connection. A new thread is created for each connection
- * that arrives and that thread executes this function. Thus there might be multiple activations
- * of this function occurring at the same time.
- */
-void *connection_processor( void *arg )
-{
-    int *i_arg = static_cast<int *>(arg);
-    int connection_handle = *i_arg;
-    delete i_arg;
-
-    try {
-        ServerConnection client( connection_handle );
-        client.doSMTP( );
-    }
-    catch( exception &e ) {
-        Console::put_exception_line( e.what( ));
-    }
-    catch( ... ) {
-        Console::put_exception_line( "Unknown exception in connection_processor()" );
-    }
-
-    close( connection_handle );
-    return nullptr;
-}
-
-
-/*!
- * This function is the main server loop. It accepts connections and starts a thread to handle
- * each one. This function returns zero if it ended normally; one otherwise.
+ * This function is the main server loop. It accepts connections and hands each one to the event
+ * loops for processing. See Reactor.hpp.
  */
 void *accept_loop( void *arg )
 {
@@ -161,7 +150,6 @@ void *accept_loop( void *arg )
     int connection_handle;    // Socket handle for each connection.
     struct sockaddr_in client_address;       // Remote address.
     socklen_t client_length;        // Size of remote address.
-    pthread_t connection_thread;    // ID of connection handling thread.
     char buffer[BUFFER_SIZE];  // Holds client address.
     ostringstream formatter;            // Used to format error messages.
 
@@ -185,9 +173,7 @@ void *accept_loop( void *arg )
         client_info += buffer;
         Console::put_line( client_info.c_str( ));
 
-        int *i_arg = new int( connection_handle );
-        pthread_create( &connection_thread, nullptr, connection_processor, i_arg );
-        pthread_detach( connection_thread );
+        Reactor::add_connection( connection_handle );
     }
     return nullptr;
 }
@@ -204,6 +190,28 @@ int main( int argc, char **argv )
         // Get the configuration early in case we want to use it below.
         Support::register_parameter( "PORT", "25", false );
         Support::register_parameter( "SPOOL", "spool", false );
+        Support::register_parameter( "SPOOL_SHARD", "0", false );
+        Support::register_parameter( "SPOOL_BACKEND", "directory", false );
+        Support::register_parameter( "SEGMENT_SIZE", "67108864", false );
+        Support::register_parameter( "SPOOL_SYNC", "group", false );
+        Support::register_parameter( "GROUP_COMMIT_WINDOW", "0", false );
+        Support::register_parameter( "GROUP_COMMIT_SIZE", "64", false );
+        Support::register_parameter( "RETRY_INTERVAL", "60", false );
+        Support::register_parameter( "MAX_RETRY_INTERVAL", "3600", false );
+        Support::register_parameter( "MAX_QUEUE_LIFETIME", "432000", false );
+        Support::register_parameter( "CONNECT_TIMEOUT", "30", false );
+        Support::register_parameter( "REPLY_TIMEOUT", "300", false );
+        Support::register_parameter( "EVENT_THREADS", "2", false );
+        Support::register_parameter( "MAX_SESSIONS", "1000", false );
+        Support::register_parameter( "PENDING_CONNECTIONS", "100", false );
+        Support::register_parameter( "SESSION_TIMEOUT", "300", false );
+        Support::register_parameter( "LISTEN_SHARDS", "0", false );
+        Support::register_parameter( "PIN_EVENT_THREADS", "no", false );
+        Support::register_parameter( "IO_BACKEND", "epoll", false );
+        Support::register_parameter( "URING_BUFFERS", "256", false );
+        Support::register_parameter( "INPUT_BUFFER_SIZE", "65536", false );
+        Support::register_parameter( "MAX_MESSAGE_SIZE", "10485760", false );
+        Support::register_parameter( "CASE_FOLDING", "ascii", false );
         Support::read_config_files( "./MailFlux.cfg" );
 
         // Setup defaults.
@@ -214,19 +222,44 @@ int main( int argc, char **argv )
             if( port == 0 ) port = 25;
         }
 
+        // Case insensitive strings follow the environment's locale only if asked to.
+        parameter = Support::lookup_parameter( "CASE_FOLDING" );
+        if( parameter != nullptr && *parameter == "locale" ) {
+            setlocale( LC_CTYPE, "" );
+            ichar_traits::use_locale( true );
+        }
+
+        // A client that disconnects while a reply is being written must not kill the server.
+        signal( SIGPIPE, SIG_IGN );
+
         // Start up the various subsystems. This needs to be done early so that email messages
         // and console messages are handled properly during the rest of the program's
-        // initialization activities.
+        // initialization activities. The reactor must be running before the spool because the
+        // spool thread starts delivering the messages already in the spool at once.
         //
         Console::initialize( );
+        Reactor::initialize( );
         Spool::initialize( );
 
-        // Set up the network handling.
-        if(( listen_handle = initialize_network( port )) == -1 ) {
-            Console::put_warning_line( "Network failed to initialize" );
+        // Set up the network handling. In sharded mode each event loop accepts its own
+        // connections and no acceptor thread is needed.
+        size_t shards = Reactor::shard_count( );
+        if( shards == 0 ) {
+            if(( listen_handle = initialize_network( port, false )) == -1 ) {
+                Console::put_warning_line( "Network failed to initialize" );
+            }
+            pthread_create( &accept_thread, nullptr, accept_loop, &listen_handle );
+            pthread_detach( accept_thread );
+        }
+        else {
+            for( size_t i = 0; i < shards; ++i ) {
+                if(( listen_handle = initialize_network( port, true )) == -1 ) {
+                    Console::put_warning_line( "Network failed to initialize" );
+                    break;
+                }
+                Reactor::add_listener( listen_handle );
+            }
         }
-        pthread_create( &accept_thread, nullptr, accept_loop, &listen_handle );
-        pthread_detach( accept_thread );
 
         // Interact with the user on the console.
         Console::command_loop( );
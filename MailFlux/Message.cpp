@@ -3,8 +3,140 @@
  *  \author  Peter Chapin <spicacality@kelseymountain.org>
  */
 
+#include <limits>
+#include <stdexcept>
 #include "Message.hpp"
 
+using namespace std;
+
+// ==============
+// Public Methods
+// ==============
+
+//! Construct an empty message.
+Message::Message( ) : body_start( 0 )
+{ }
+
+
+//! Return the number of fields in the header of the message.
+size_t Message::header_count( ) const
+{
+    return header_index.size( );
+}
+
+
+//! Return the name of the header field with the given index, counting from zero.
+istring_view Message::get_header_name( size_t index ) const
+{
+    return header_index.get_name( text.data( ), index );
+}
+
+
+//! Return the unfolded value of the header field with the given index, counting from zero.
+/*!
+ * Leading white space is not included in the value.
+ */
+istring_view Message::get_header_value( size_t index ) const
+{
+    return header_index.get_value( text.data( ), index );
+}
+
+
+//! Look up one of the common header fields.
+/*!
+ * \param which The field wanted.
+ * \param value Receives the unfolded value of the field's first occurrence.
+ * \return true if the field is present.
+ */
+bool Message::find_header( common_header which, istring_view &value ) const
+{
+    int index = header_index.find( which );
+    if( index < 0 ) return false;
+    value = get_header_value( static_cast<size_t>( index ));
+    return true;
+}
+
+
+//! Look up a header field by name. The name is compared without regard to case.
+/*!
+ * \param name The name of the field wanted.
+ * \param value Receives the unfolded value of the field's first occurrence.
+ * \return true if the field is present.
+ */
+bool Message::find_header( istring_view name, istring_view &value ) const
+{
+    int index = header_index.find( text.data( ), name );
+    if( index < 0 ) return false;
+    value = get_header_value( static_cast<size_t>( index ));
+    return true;
+}
+
+
+//! Return the index of the first line of the body.
+/*!
+ * If the end of the header has not been seen yet this is the number of lines in the message.
+ */
+size_t Message::get_body_start( ) const
+{
+    return header_index.is_complete( ) ? body_start : line_starts.size( );
+}
+
+
+//! Add an additional recipient to this message's recipient list.
+/*!
+ * A message can have multiple recipients. A recipient that is already on the list, ignoring
+ * case, is not added again.
+ *
+ * \param the_recipient The email address of the new recipient.
+ * \return true if the recipient was added; false if it was already on the list.
+ */
+bool Message::add_recipient( istring_view the_recipient )
+{
+    if( recipient_set.find( the_recipient ) != recipient_set.end( )) return false;
+
+    recipients.push_back( Recipient{ istring( the_recipient ), istring::npos } );
+    Recipient &recipient = recipients.back( );
+    recipient.at = recipient.address.find_last_of( '@' );
+    recipient_set.insert( recipient.address );
+
+    istring_view domain = recipient.domain( );
+    auto group = domain_index.find( domain );
+    if( group == domain_index.end( )) {
+        group = domain_index.emplace( domain, domains.size( )).first;
+        domains.push_back( DomainGroup{ domain, { } } );
+    }
+    domains[group->second].members.push_back( &recipient );
+    return true;
+}
+
+
+//! Add a line of text to the message itself.
+/*!
+ * The structure and validity of the message is not checked. Note that the line added should
+ * not have any line ending delimiters (CR, LF, etc). Such delimiters should be added when
+ * the message is formatted for saving or transmission.
+ *
+ * \param line The line of text to save at the end of the current message.
+ * \throw std::length_error if the message text would exceed 4 GiB.
+ */
+void Message::append_text( istring_view line )
+{
+    if( line.size( ) > numeric_limits<uint32_t>::max( ) - text.size( ))
+        throw length_error( "Message text too long" );
+
+    size_t start = text.size( );
+    line_starts.push_back( static_cast<uint32_t>( start ));
+    text.append( line.data( ), line.size( ));
+
+    // The header ends at the first empty line, which is not part of the body. A line that is
+    // neither a header field nor a continuation of one also ends the header; it is taken to be
+    // the first line of the body.
+    if( !header_index.is_complete( ) &&
+        !header_index.add_line( text.data( ), start, line.size( ))) {
+        body_start = line_starts.size( ) - ( line.empty( ) ? 0 : 1 );
+    }
+}
+
 
 //! Erases the sender, recipient list, and message text for this Message object.
 /*!
@@ -14,7 +146,13 @@
 void Message::clear( )
 {
     sender.clear( );
+    recipient_set.clear( );
+    domain_index.clear( );
+    domains.clear( );
     recipients.clear( );
+
     text.clear( );
+    line_starts.clear( );
+    header_index.clear( );
+    body_start = 0;
 }
-
@@ -6,7 +6,15 @@
 #ifndef MESSAGE_HPP
 #define MESSAGE_HPP
 
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <iterator>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
+#include "HeaderIndex.hpp"
 #include "istring.hpp"
 
 //! Class representing a single email message.
@@ -17,9 +25,119 @@
  * this class (at this time). In theory it should never be necessary to look at the message
  * itself because that's at a different protocol layer than SMTP. In practice it probably will
  * be necessary to examine the message at some point.
+ *
+ * The text of the message is kept in a single string, its lines back to back without their
+ * terminators, together with the offset where each line starts. Received mail does not pass
+ * through this class (see Spool::MessageWriter); the text is used for messages composed by
+ * MailFlux itself, such as bounces, and is small.
+ *
+ * The header of the message (RFC 5322, 2.2) is indexed as its lines are added. The index
+ * records where each header field's name and value are in the text and where the body starts,
+ * so no header text is copied. Since the lines have no terminators, the text from the start of
+ * a field's value to the end of its last continuation line is exactly the unfolded value
+ * (RFC 5322, 2.2.3). A Message must not be used by two threads at the same time.
+ *
+ * Each recipient is kept only once, however many times it is added. Recipients are compared
+ * without regard to case, through a hash set, and each is split into its local part and domain
+ * when it is added. They can be visited in the order they were added or grouped by domain.
  */
 class Message {
 public:
+    //! A recipient's address.
+    struct Recipient {
+        istring            address;
+        istring::size_type at;        //!< Position of the '@' in address, or npos.
+
+        //! Return the part of the address before the '@'.
+        [[nodiscard]] istring_view local_part( ) const
+        { return istring_view( address ).substr( 0, at ); }
+
+        //! Return the part of the address after the '@'. It is empty if there is no '@'.
+        [[nodiscard]] istring_view domain( ) const
+        {
+            if( at == istring::npos ) return istring_view( );
+            return istring_view( address ).substr( at + 1 );
+        }
+    };
+
+    //! The recipients that share a domain.
+    struct DomainGroup {
+        istring_view                    domain;
+        std::vector<const Recipient *>  members;   //!< In the order they were added.
+    };
+
+    //! Header fields that can be found without searching.
+    using common_header = HeaderIndex::common_header;
+
+    //! Iterator over the lines of the message text. Each line is an istring_view.
+    class TextIterator {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type        = istring_view;
+        using difference_type   = std::ptrdiff_t;
+        using pointer           = const istring_view *;
+        using reference         = istring_view;
+
+        TextIterator( ) : owner( nullptr ), line( 0 )
+        { }
+
+        TextIterator( const Message *the_owner, std::size_t the_line ) :
+            owner( the_owner ), line( the_line )
+        { }
+
+        istring_view operator*( ) const
+        { return owner->get_line( line ); }
+
+        TextIterator &operator++( )
+        { ++line; return *this; }
+
+        TextIterator operator++( int )
+        { TextIterator old( *this ); ++line; return old; }
+
+        bool operator==( const TextIterator &other ) const
+        { return line == other.line; }
+
+    private:
+        const Message *owner;
+        std::size_t    line;
+    };
+
+    //! The lines of the message text, as returned by get_text().
+    class TextLines {
+    public:
+        explicit TextLines( const Message &the_owner ) : owner( the_owner )
+        { }
+
+        [[nodiscard]] TextIterator begin( ) const
+        { return TextIterator( &owner, 0 ); }
+
+        [[nodiscard]] TextIterator end( ) const
+        { return TextIterator( &owner, owner.line_starts.size( )); }
+
+        [[nodiscard]] std::size_t size( ) const
+        { return owner.line_starts.size( ); }
+
+        [[nodiscard]] bool empty( ) const
+        { return owner.line_starts.empty( ); }
+
+    private:
+        const Message &owner;
+    };
+
+    Message( );
+
+    std::size_t header_count( ) const;
+
+    istring_view get_header_name( std::size_t index ) const;
+
+    istring_view get_header_value( std::size_t index ) const;
+
+    bool find_header( common_header which, istring_view &value ) const;
+
+    bool find_header( istring_view name, istring_view &value ) const;
+
+    std::size_t get_body_start( ) const;
+
     //! Set the message sender.
     /*!
      * This method allows you to specify the email address of the sender. There is only one
@@ -27,53 +145,62 @@ public:
      *
      * \param the_sender The email address representing the entity originating this message.
      */
-    void set_sender( const istring &the_sender )
+    void set_sender( istring_view the_sender )
     { sender = the_sender; }
 
 
-    //! Add an additional recipient to this message's recipient list.
-    /*!
-     * A message can have multiple recipients. Currently this class makes no attempt to deal
-     * with redundant copies of a recipient on the list.
-     *
-     * \param the_recipient The email address of the new recipient.
-     */
-    void add_recipient( const istring &the_recipient )
-    { recipients.push_back( the_recipient ); }
-
+    bool add_recipient( istring_view the_recipient );
 
-    //! Add a line of text to the message itself.
-    /*!
-     * The structure and validity of the message is not checked. Note that the line added should
-     * not have any line ending delimiters (CR, LF, etc). Such delimiters should be added when
-     * the message is formatted for saving or transmission.
-     *
-     * \param line The line of text to save at the end of the current message.
-     */
-    void append_text( const istring &line )
-    { text.push_back( line ); }
+    void append_text( istring_view line );
 
     void clear( );
 
     // Accessor methods just return references to internal data. This should be made better.
 
     //! Return the email address of the message sender.
-    [[nodiscard]] const istring &get_sender( ) const
+    [[nodiscard]] istring_view get_sender( ) const
     { return sender; }
 
-    //! Return a list of recipient email addresses.
-    [[nodiscard]] const std::vector<istring> &get_recipients( ) const
+    //! Return the recipients in the order they were added.
+    [[nodiscard]] const std::deque<Recipient> &get_recipients( ) const
     { return recipients; }
 
-    //! Return the message text.
-    [[nodiscard]] const std::vector<istring> &get_text( ) const
-    { return text; }
+    //! Return the recipients grouped by domain, in the order the domains were first seen.
+    [[nodiscard]] const std::vector<DomainGroup> &get_domains( ) const
+    { return domains; }
+
+    //! Return the message text, one line at a time.
+    [[nodiscard]] TextLines get_text( ) const
+    { return TextLines( *this ); }
+
+    //! Return the line of the message text with the given index, counting from zero.
+    [[nodiscard]] istring_view get_line( std::size_t index ) const
+    {
+        std::size_t end =
+            ( index + 1 < line_starts.size( )) ? line_starts[index + 1] : text.size( );
+        return istring_view( text.data( ) + line_starts[index], end - line_starts[index] );
+    }
 
 private:
-    // The sender and recipients should be some kind of email address abstract type.
+    // The sender should be some kind of email address abstract type.
     istring sender;
-    std::vector<istring> recipients;
-    std::vector<istring> text;
+
+    // Recipients don't move once added, so the set and the groups can refer to them.
+    std::deque<Recipient> recipients;
+    std::unordered_set<istring_view, istring_hash> recipient_set;
+    std::vector<DomainGroup> domains;
+    std::unordered_map<istring_view, std::size_t, istring_hash> domain_index;
+
+    std::string                text;         //!< The lines, without their terminators.
+    std::vector<std::uint32_t> line_starts;  //!< Offset in text of each line.
+
+    HeaderIndex header_index;  //!< Offsets are in text.
+    std::size_t body_start;    //!< Index of the first line of the body.
+
+    // Make copying illegal.
+    Message( const Message & );
+
+    Message &operator=( const Message & );
 };
 
 #endif
@@ -0,0 +1,478 @@
+/*! \file    MimeParser.cpp
+ *  \brief   Implementation of the MIME structure parser.
+ *  \author  Peter Chapin <spicacality@kelseymountain.org>
+ */
+
+#include <cerrno>
+#include <cstring>
+#include <sstream>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "istring.hpp"
+#include "MimeParser.hpp"
+
+using namespace std;
+
+// Anonymous namespace for module private items.
+namespace {
+
+    //! Multiparts nested more deeply than this are treated as opaque.
+    const unsigned MAX_DEPTH = 32;
+
+    //! Size of the blocks in which decoded text is written.
+    const size_t DECODE_BLOCK_SIZE = 4096;
+
+    //! Find the end of the line starting at position.
+    /*!
+     * \param text The text being parsed.
+     * \param position The start of a line.
+     * \param next Receives the start of the following line (or the end of the text).
+     * \return The end of the line's content, without its CR LF or LF.
+     */
+    size_t line_end( string_view text, size_t position, size_t &next )
+    {
+        const char *newline = static_cast<const char *>(
+            memchr( text.data( ) + position, '\n', text.size( ) - position ));
+        if( newline == nullptr ) {
+            next = text.size( );
+            return text.size( );
+        }
+        size_t end = newline - text.data( );
+        next = end + 1;
+        if( end > position && text[end - 1] == '\r' ) --end;
+        return end;
+    }
+
+
+    bool is_space( char ch )
+    { return ch == ' ' || ch == '\t' || ch == '\r' || ch == '\n'; }
+
+
+    string_view trim( string_view value )
+    {
+        while( !value.empty( ) && is_space( value.front( ))) value.remove_prefix( 1 );
+        while( !value.empty( ) && is_space( value.back( ))) value.remove_suffix( 1 );
+        return value;
+    }
+
+
+    string lower_case( string_view value )
+    {
+        string result( value );
+        for( char &ch : result ) ch = static_cast<char>( ichar_traits::fold( ch ));
+        return result;
+    }
+
+
+    bool same_name( string_view a, const char *b )
+    { return istring_view( a.data( ), a.size( )) == b; }
+
+
+    //! Return the value of a base 64 digit, or -1 if the character is not one.
+    int base64_value( char ch )
+    {
+        if( ch >= 'A' && ch <= 'Z' ) return ch - 'A';
+        if( ch >= 'a' && ch <= 'z' ) return ch - 'a' + 26;
+        if( ch >= '0' && ch <= '9' ) return ch - '0' + 52;
+        if( ch == '+' ) return 62;
+        if( ch == '/' ) return 63;
+        return -1;
+    }
+
+
+    //! Return the value of a hexadecimal digit, or -1 if the character is not one.
+    int hex_value( char ch )
+    {
+        if( ch >= '0' && ch <= '9' ) return ch - '0';
+        if( ch >= 'A' && ch <= 'F' ) return ch - 'A' + 10;
+        if( ch >= 'a' && ch <= 'f' ) return ch - 'a' + 10;
+        return -1;
+    }
+
+
+    //! Collects decoded text and writes it out in blocks.
+    class DecodeBuffer {
+    public:
+        explicit DecodeBuffer( ostream &the_output ) : output( the_output ), count( 0 )
+        { }
+
+        ~DecodeBuffer( )
+        { flush( ); }
+
+        void put( char ch )
+        {
+            block[count++] = ch;
+            if( count == DECODE_BLOCK_SIZE ) flush( );
+        }
+
+        void flush( )
+        {
+            output.write( block, count );
+            count = 0;
+        }
+
+    private:
+        ostream &output;
+        char     block[DECODE_BLOCK_SIZE];
+        size_t   count;
+    };
+
+
+    void decode_base64( string_view body, ostream &output )
+    {
+        DecodeBuffer decoded( output );
+        unsigned long bits = 0;
+        int bit_count = 0;
+
+        for( char ch : body ) {
+            if( ch == '=' ) break;
+            int value = base64_value( ch );
+            if( value < 0 ) continue;
+            bits = ( bits << 6 ) | static_cast<unsigned>( value );
+            bit_count += 6;
+            if( bit_count >= 8 ) {
+                bit_count -= 8;
+                decoded.put( static_cast<char>(( bits >> bit_count ) & 0xFF ));
+            }
+        }
+    }
+
+
+    void decode_quoted_printable( string_view body, ostream &output )
+    {
+        DecodeBuffer decoded( output );
+
+        for( size_t i = 0; i < body.size( ); ++i ) {
+            if( body[i] != '=' ) {
+                decoded.put( body[i] );
+                continue;
+            }
+            // A soft line break: '=' at the end of a line, possibly followed by white space.
+            size_t j = i + 1;
+            while( j < body.size( ) && ( body[j] == ' ' || body[j] == '\t' )) ++j;
+            if( j < body.size( ) && ( body[j] == '\r' || body[j] == '\n' )) {
+                if( body[j] == '\r' && j + 1 < body.size( ) && body[j + 1] == '\n' ) ++j;
+                i = j;
+                continue;
+            }
+            if( i + 2 < body.size( ) && hex_value( body[i + 1] ) >= 0 &&
+                                        hex_value( body[i + 2] ) >= 0 ) {
+                decoded.put( static_cast<char>( hex_value( body[i + 1] ) * 16 +
+                                                hex_value( body[i + 2] )));
+                i += 2;
+                continue;
+            }
+            decoded.put( '=' );
+        }
+    }
+
+}   // End of anonymous namespace.
+
+// ===============
+// Private Methods
+// ===============
+
+//! Release the mapped file, if there is one.
+void MimeParser::unmap( )
+{
+    if( mapping != nullptr ) {
+        munmap( mapping, mapping_size );
+        mapping = nullptr;
+        mapping_size = 0;
+    }
+}
+
+
+//! Begin a new part by parsing its header.
+/*!
+ * A line that is neither a header field nor a continuation of one ends the header; it is taken
+ * to be the first line of the body.
+ *
+ * \param parent Index of the enclosing part, or -1 for the message itself.
+ * \param position Offset of the part's header.
+ * \param default_type Content type of the part if it has no Content-Type field.
+ * \return The offset of the part's body.
+ */
+size_t MimeParser::start_part( int parent, size_t position, const char *default_type )
+{
+    Part part;
+    part.parent = parent;
+    part.depth = ( parent < 0 ) ? 0 : parts[parent].depth + 1;
+    part.header_start = position;
+    part.content_type = default_type;
+    part.encoding = "7bit";
+
+    string_view field_name;
+    string      field_value;
+    while( position < text.size( )) {
+        size_t next;
+        size_t end = line_end( text, position, next );
+        string_view line = text.substr( position, end - position );
+
+        if( !line.empty( ) && ( line[0] == ' ' || line[0] == '\t' ) && !field_name.empty( )) {
+            field_value += line;
+        }
+        else {
+            if( !field_name.empty( )) apply_field( part, field_name, field_value );
+            field_name = string_view( );
+
+            if( line.empty( )) {
+                position = next;
+                break;
+            }
+            string_view::size_type colon = line.find( ':' );
+            if( colon == string_view::npos || colon == 0 ) break;
+
+            field_name = trim( line.substr( 0, colon ));
+            field_value = line.substr( colon + 1 );
+        }
+        position = next;
+    }
+    if( !field_name.empty( )) apply_field( part, field_name, field_value );
+
+    part.body_start = part.body_end = position;
+    if( part.content_type.compare( 0, 10, "multipart/" ) != 0 || part.depth >= MAX_DEPTH ) {
+        part.boundary.clear( );
+    }
+    parts.push_back( part );
+    open_parts.push_back( { parts.size( ) - 1, part.boundary.empty( ) } );
+    return position;
+}
+
+
+//! Take what is needed from one (unfolded) header field.
+void MimeParser::apply_field( Part &part, string_view name, const string &value )
+{
+    if( same_name( name, "Content-Transfer-Encoding" )) {
+        part.encoding = lower_case( trim( value ));
+        return;
+    }
+    if( !same_name( name, "Content-Type" )) return;
+
+    // The type and subtype, then parameters separated by ';' (RFC 2045, 5.1).
+    string_view rest( value );
+    string_view::size_type semicolon = rest.find( ';' );
+    string_view type = trim( rest.substr( 0, semicolon ));
+    if( type.find( '/' ) != string_view::npos ) part.content_type = lower_case( type );
+
+    while( semicolon != string_view::npos ) {
+        rest.remove_prefix( semicolon + 1 );
+        string_view::size_type equals = rest.find( '=' );
+        if( equals == string_view::npos ) break;
+        string_view parameter = trim( rest.substr( 0, equals ));
+        rest.remove_prefix( equals + 1 );
+        while( !rest.empty( ) && is_space( rest.front( ))) rest.remove_prefix( 1 );
+
+        string_view parameter_value;
+        if( !rest.empty( ) && rest.front( ) == '"' ) {
+            string_view::size_type quote = rest.find( '"', 1 );
+            parameter_value = rest.substr( 1, quote == string_view::npos ? quote : quote - 1 );
+            semicolon = ( quote == string_view::npos ) ? quote : rest.find( ';', quote );
+        }
+        else {
+            semicolon = rest.find( ';' );
+            parameter_value = trim( rest.substr( 0, semicolon ));
+        }
+        if( same_name( parameter, "boundary" )) part.boundary = parameter_value;
+    }
+}
+
+
+//! Find the next delimiter line of any multipart that is still open.
+/*!
+ * \param position The start of a line from which to search.
+ * \param line Receives the offset of the delimiter line.
+ * \param level Receives the position in open_parts of the multipart the delimiter belongs to.
+ * \param closing Receives true if the delimiter is a close delimiter.
+ * \return true if a delimiter was found.
+ */
+bool MimeParser::find_delimiter(
+    size_t position, size_t &line, size_t &level, bool &closing ) const
+{
+    size_t candidate = position;
+    while( candidate + 2 <= text.size( )) {
+        if( text[candidate] == '-' && text[candidate + 1] == '-' ) {
+            string_view after_dashes = text.substr( candidate + 2 );
+
+            // The innermost multipart is the most likely owner of the delimiter.
+            for( size_t i = open_parts.size( ); i-- > 0; ) {
+                if( open_parts[i].closed ) continue;
+                const string &boundary = parts[open_parts[i].index].boundary;
+                if( after_dashes.compare( 0, boundary.size( ), boundary ) != 0 ) continue;
+
+                string_view tail = after_dashes.substr( boundary.size( ));
+                bool is_closing = tail.compare( 0, 2, "--" ) == 0;
+                if( is_closing ) tail.remove_prefix( 2 );
+                if( !tail.empty( ) && !is_space( tail.front( ))) continue;
+
+                line = candidate;
+                level = i;
+                closing = is_closing;
+                return true;
+            }
+        }
+
+        const void *hit = memmem( text.data( ) + candidate, text.size( ) - candidate, "\n--", 3 );
+        if( hit == nullptr ) break;
+        candidate = static_cast<const char *>( hit ) - text.data( ) + 1;
+    }
+    return false;
+}
+
+
+//! End the open parts from the given level up, at the given offset.
+void MimeParser::end_parts( size_t level, size_t end )
+{
+    while( open_parts.size( ) > level ) {
+        Part &part = parts[open_parts.back( ).index];
+        part.body_end = ( end < part.body_start ) ? part.body_start : end;
+        open_parts.pop_back( );
+    }
+}
+
+//! Find the parts of the text in a single pass.
+void MimeParser::find_structure( )
+{
+    parts.clear( );
+    open_parts.clear( );
+
+    size_t position = start_part( -1, 0, "text/plain" );
+    bool   just_started = true;
+    while( true ) {
+        // An encapsulated message that is not encoded starts right away.
+        const Part &top = parts[open_parts.back( ).index];
+        if( just_started && top.content_type == "message/rfc822" && top.depth < MAX_DEPTH &&
+            ( top.encoding == "7bit" || top.encoding == "8bit" || top.encoding == "binary" )) {
+            position = start_part( static_cast<int>( open_parts.back( ).index ),
+                                   top.body_start, "text/plain" );
+            continue;
+        }
+        just_started = false;
+
+        size_t line;
+        size_t level;
+        bool   closing;
+        if( !find_delimiter( position, line, level, closing )) {
+            end_parts( 0, text.size( ));
+            break;
+        }
+
+        // The line break before a delimiter belongs to the delimiter (RFC 2046, 5.1.1).
+        size_t body_end = line;
+        if( body_end > 0 && text[body_end - 1] == '\n' ) --body_end;
+        if( body_end > 0 && text[body_end - 1] == '\r' ) --body_end;
+        end_parts( level + 1, body_end );
+
+        size_t next;
+        line_end( text, line, next );
+        if( closing ) {
+            open_parts[level].closed = true;
+            position = next;
+        }
+        else {
+            const Part &multipart = parts[open_parts[level].index];
+            const char *default_type =
+                ( multipart.content_type == "multipart/digest" ) ? "message/rfc822" : "text/plain";
+            position = start_part( static_cast<int>( open_parts[level].index ), next, default_type );
+            just_started = true;
+        }
+    }
+}
+
+
+// ==============
+// Public Methods
+// ==============
+
+//! Find the structure of a message held in memory.
+/*!
+ * \param message_text The raw text of the message, header and body, with line terminators. It
+ * must remain valid while the results are used.
+ */
+void MimeParser::parse( string_view message_text )
+{
+    unmap( );
+    text = message_text;
+    find_structure( );
+}
+
+
+MimeParser::MimeParser( ) : mapping( nullptr ), mapping_size( 0 )
+{ }
+
+
+MimeParser::~MimeParser( )
+{
+    unmap( );
+}
+
+
+//! Find the structure of a message in a file.
+/*!
+ * The file is mapped into memory, so even a very large message is not read into the heap. The
+ * mapping is kept until the next parse or until the parser is destroyed.
+ *
+ * \param file_name The name of the file.
+ * \param offset The offset of the message text in the file, for example after a spool envelope.
+ * The offsets in the parts are relative to it.
+ * \throw MimeError if the file can't be mapped.
+ */
+void MimeParser::parse_file( const char *file_name, size_t offset )
+{
+    unmap( );
+    text = string_view( );
+
+    int handle = open( file_name, O_RDONLY );
+    struct stat file_information;
+    if( handle == -1 || fstat( handle, &file_information ) == -1 ) {
+        ostringstream formatter;
+        formatter << "Can't open " << file_name << ": " << strerror( errno );
+        if( handle != -1 ) close( handle );
+        throw MimeError( formatter.str( ));
+    }
+
+    size_t size = static_cast<size_t>( file_information.st_size );
+    if( size > 0 ) {
+        void *address = mmap( nullptr, size, PROT_READ, MAP_PRIVATE, handle, 0 );
+        if( address == MAP_FAILED ) {
+            ostringstream formatter;
+            formatter << "Can't map " << file_name << ": " << strerror( errno );
+            close( handle );
+            throw MimeError( formatter.str( ));
+        }
+        madvise( address, size, MADV_SEQUENTIAL );
+        mapping = address;
+        mapping_size = size;
+    }
+    close( handle );
+
+    if( offset > size ) offset = size;
+    text = string_view( static_cast<const char *>( mapping ) + offset, size - offset );
+    find_structure( );
+}
+
+
+//! Write the decoded body of a part.
+/*!
+ * Bodies in base64 and quoted-printable are decoded (RFC 2045, 6.7 and 6.8) as they are written,
+ * in blocks, so decoding a large part takes little memory. Other bodies are written unchanged.
+ *
+ * \param index The index of the part in get_parts().
+ * \param output The stream to receive the decoded body.
+ */
+void MimeParser::decode( size_t index, ostream &output ) const
+{
+    const Part &part = parts.at( index );
+    string_view body = text.substr( part.body_start, part.size( ));
+
+    if( part.encoding == "base64" )
+        decode_base64( body, output );
+    else if( part.encoding == "quoted-printable" )
+        decode_quoted_printable( body, output );
+    else
+        output.write( body.data( ), body.size( ));
+}
@@ -0,0 +1,109 @@
+/*! \file    MimeParser.hpp
+ *  \brief   Interface to the MIME structure parser.
+ *  \author  Peter Chapin <spicacality@kelseymountain.org>
+ */
+
+#ifndef MIMEPARSER_HPP
+#define MIMEPARSER_HPP
+
+#include <cstddef>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+//! Exception for problems reading a message to be parsed.
+class MimeError : public std::runtime_error {
+public:
+    explicit MimeError( const std::string &message ) : std::runtime_error( message )
+    { }
+};
+
+
+//! Class to find the MIME structure of a message (RFC 2045, RFC 2046).
+/*!
+ * The parser makes a single pass over the raw text of a message (header and body, with their
+ * line terminators) and produces a tree of parts. The parts are stored in the order in which
+ * they begin; each records the index of the part that encloses it. A part describes where its
+ * header and body are in the text, its content type, its boundary if it is a multipart, and its
+ * content transfer encoding. No part of the text is copied or decoded unless decode() is called.
+ *
+ * Between headers the parser skips through the text looking only for lines that start with
+ * "--", using memmem(), so the time taken depends mostly on the size of the message and the
+ * memory used depends only on the number of parts. A message in a file is mapped into memory
+ * rather than read; see parse_file().
+ *
+ * A delimiter line ends every part it is inside of, so a missing close delimiter in a nested
+ * multipart does not hide the rest of the message. Encapsulated messages (message/rfc822) that
+ * are not encoded are parsed as well.
+ */
+class MimeParser {
+public:
+    //! One part of a message. The whole message is the first part.
+    struct Part {
+        int          parent;        //!< Index of the enclosing part; -1 for the message.
+        unsigned     depth;         //!< Number of enclosing parts.
+        std::size_t  header_start;  //!< Offset of the part's header in the text.
+        std::size_t  body_start;    //!< Offset of the part's body.
+        std::size_t  body_end;      //!< Offset just after the body.
+        std::string  content_type;  //!< Type and subtype in lower case, e.g. "text/plain".
+        std::string  boundary;      //!< The boundary of a multipart; otherwise empty.
+        std::string  encoding;      //!< Content-Transfer-Encoding in lower case.
+
+        //! Return the size of the body, still encoded.
+        [[nodiscard]] std::size_t size( ) const
+        { return body_end - body_start; }
+    };
+
+    MimeParser( );
+
+    ~MimeParser( );
+
+    void parse( std::string_view message_text );
+
+    void parse_file( const char *file_name, std::size_t offset = 0 );
+
+    //! Return the parts found by the last call to parse() or parse_file().
+    [[nodiscard]] const std::vector<Part> &get_parts( ) const
+    { return parts; }
+
+    //! Return the text that was parsed. Views of it remain valid until the next parse.
+    [[nodiscard]] std::string_view get_text( ) const
+    { return text; }
+
+    void decode( std::size_t index, std::ostream &output ) const;
+
+private:
+    //! A part whose end has not been found yet.
+    struct OpenPart {
+        std::size_t index;
+        bool        closed;   //!< True once a multipart's close delimiter has been seen.
+    };
+
+    std::string_view      text;
+    void                 *mapping;        //!< The mapped file, if any.
+    std::size_t           mapping_size;
+    std::vector<Part>     parts;
+    std::vector<OpenPart> open_parts;
+
+    void unmap( );
+
+    void find_structure( );
+
+    std::size_t start_part( int parent, std::size_t position, const char *default_type );
+
+    void apply_field( Part &part, std::string_view name, const std::string &value );
+
+    bool find_delimiter(
+        std::size_t position, std::size_t &line, std::size_t &level, bool &closing ) const;
+
+    void end_parts( std::size_t level, std::size_t end );
+
+    // Make copying illegal.
+    MimeParser( const MimeParser & );
+
+    MimeParser &operator=( const MimeParser & );
+};
+
+#endif
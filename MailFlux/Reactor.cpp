@@ -0,0 +1,1253 @@
+/*! \file    Reactor.cpp
+ *  \brief   Implementation of the connection event loops.
+ *  \author  Peter Chapin <spicacality@kelseymountain.org>
+ *
+ * Each event loop thread waits on its own epoll instance. Connections are registered in
+ * edge-triggered mode for both input and output readiness, so a connection is only resumed when
+ * something has changed on its socket. A connection is owned by exactly one loop for its entire
+ * lifetime which means the Connection objects, and the coroutines they run, never need to be
+ * locked. Outbound connections made by the spool thread are served by the same loops.
+ *
+ * Admission is bounded. At most MAX_SESSIONS connections are active at once. Connections that
+ * arrive while all session slots are in use wait (without being read) in a queue of at most
+ * PENDING_CONNECTIONS entries. When a session ends its slot is handed directly to the oldest
+ * waiting connection. When the queue is full new clients are turned away immediately. A client
+ * that sits idle is sent a 421 reply and disconnected after SESSION_TIMEOUT seconds, which also
+ * frees its slot.
+ *
+ * Normally a single acceptor thread (see MailFlux.cpp) accepts connections and hands them to the
+ * loops in round robin order. When LISTEN_SHARDS is set there is one event loop per shard and
+ * each loop also owns its own listening socket bound to the same port with SO_REUSEPORT. The
+ * kernel then spreads incoming connections over the shards and there is no single acceptor.
+ *
+ * Two I/O backends are available, selected by the IO_BACKEND configuration parameter. The epoll
+ * backend waits for readiness and lets each Connection do its own non-blocking I/O. The
+ * io_uring backend instead submits the reads, writes, and accepts for all of a loop's sockets to
+ * the kernel in batches, using buffers registered with the ring once at startup, and feeds the
+ * completed reads to the connections. If io_uring is requested but not available the epoll
+ * backend is used instead.
+ *
+ * With either backend, each loop has an eventfd that other threads write to when they hand the
+ * loop something to do. This is also how a connection that is waiting for another thread (see
+ * Connection::wait_event()) is resumed on its own loop. A connection is never destroyed while it
+ * waits in this way, because the other thread will still notify it; if its socket fails in the
+ * meantime the session is only marked abandoned and is destroyed when the notification arrives.
+ * New sessions are handed to their loop in the same way, so that all of a loop's sessions are
+ * only touched by the loop's own thread.
+ *
+ * Each loop keeps a list of its sessions and, once a second while it has any, ends those whose
+ * connection has waited too long for the peer (see Connection::has_expired()). Whatever output
+ * the connection queued when it timed out is written if the socket will take it at once.
+ */
+
+// Standard C++
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// POSIX
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// MailFlux
+#include "config.hpp"
+#include "Console.hpp"
+#include "IoRing.hpp"
+#include "Connection.hpp"
+#include "IoStatistics.hpp"
+#include "Reactor.hpp"
+#include "ServerConnection.hpp"
+
+using namespace std;
+
+// Anonymous namespace for module private items.
+namespace {
+
+    //! Maximum number of ready events retrieved by a single call to epoll_wait().
+    const int MAX_EVENTS = 64;
+
+    //! Smallest input buffer allowed. It must hold the longest SMTP text line (RFC 5321, 4.5.3.1).
+    const size_t MIN_INPUT_BUFFER_SIZE = 4096;
+
+    //! Time between checks for sessions that have waited too long for their peers.
+    const chrono::seconds EXPIRY_INTERVAL( 1 );
+
+    struct EventLoop;
+
+    //! A connection served by an event loop.
+    struct Session {
+        Connection *connection;
+        EventLoop  *loop;        //!< The loop that owns the session.
+        int   handle;
+        bool  inbound;           //!< True for client sessions subject to admission control.
+        bool  abandoned = false; //!< Ended while waiting for an event; see end_session().
+        size_t position;         //!< Index of the session in its loop's served list.
+#ifdef MAILFLUX_HAVE_IO_URING
+        // Used by the io_uring backend only.
+        int   slot;              //!< Registered buffer slot, or -1 if buffer is on the heap.
+        char *buffer;            //!< Input buffer, followed by the output buffer.
+        bool  reading = false;   //!< A read is pending.
+        bool  writing = false;   //!< A write is pending.
+        bool  closing = false;   //!< The session is ending; no new operations are submitted.
+#endif
+    };
+
+
+    //! The state associated with a single event loop thread.
+    struct EventLoop {
+        int       epoll_handle  = -1;  //!< The epoll instance watching this loop's connections.
+        int       listen_handle = -1;  //!< The loop's own listening socket (shards only).
+        int       cpu           = -1;  //!< The processor the loop is pinned to (if any).
+        pthread_t thread;              //!< The thread running this loop.
+
+        // Statistics. These are updated by several threads.
+        atomic<unsigned long> accepted{ 0 };  //!< Connections accepted on listen_handle.
+        atomic<unsigned long> sessions{ 0 };  //!< Inbound sessions started on this loop.
+        atomic<unsigned long> active{ 0 };    //!< Inbound sessions currently owned by this loop.
+
+        int wake_handle = -1;              //!< eventfd used to wake the loop for hand offs.
+
+        // Sessions passed to the loop by other threads, protected by handoff_lock. The io_uring
+        // backend also passes listening sockets this way.
+        pthread_mutex_t  handoff_lock = PTHREAD_MUTEX_INITIALIZER;
+        vector<Session*> handoff;          //!< New sessions to be started by the loop.
+        vector<Session*> woken;            //!< Sessions whose awaited event has happened.
+
+        // Only the loop's own thread touches these.
+        vector<Session*> served;           //!< All the loop's sessions, for their time limits.
+        chrono::steady_clock::time_point next_expiry;  //!< When served is next checked.
+
+#ifdef MAILFLUX_HAVE_IO_URING
+        // The io_uring backend. Only the loop's own thread touches the ring.
+        IoRing     *ring = nullptr;        //!< Submission/completion ring.
+        uint64_t    wake_value;            //!< Target of the pending read on wake_handle.
+        bool        accepting = false;     //!< True if an accept is pending on listen_handle.
+        sockaddr_in client_address;        //!< Target of the pending accept.
+        socklen_t   client_length;         //!< Size of client_address.
+        char       *buffers = nullptr;     //!< Start of the registered buffer area.
+        vector<int> free_slots;            //!< Unused slots in the registered buffer area.
+        __kernel_timespec tick;            //!< Interval of the pending timeout.
+#endif
+    };
+
+    unique_ptr<EventLoop[]> loops;            //!< All event loops. Created by initialize().
+    size_t                  loop_count = 0;   //!< Number of elements in loops.
+    atomic<unsigned>        next_loop( 0 );   //!< Used to distribute connections over the loops.
+    atomic<unsigned>        next_shard( 0 );  //!< The next loop to receive a listening socket.
+
+    // Admission control. The counters and the queue are protected by admission_lock.
+    pthread_mutex_t admission_lock = PTHREAD_MUTEX_INITIALIZER;
+    deque<int>      pending;                  //!< Accepted connections waiting for a slot.
+    size_t          max_sessions = 0;         //!< Maximum number of active sessions.
+    size_t          max_pending  = 0;         //!< Maximum length of the pending queue.
+    size_t          active_sessions = 0;      //!< Number of sessions currently active.
+    unsigned long   rejected_sessions = 0;    //!< Number of connections turned away.
+
+    //! Reply sent to clients that arrive when the pending queue is full.
+    const char rejection[] = "421 Service not available, try later\r\n";
+
+    //! The event loop run by the current thread, if any.
+    thread_local EventLoop *current_loop = nullptr;
+
+    //! True when the io_uring backend is in use.
+    bool use_io_uring = false;
+
+
+    //! Display a message about a newly accepted client.
+    void log_client( const sockaddr_in &client_address )
+    {
+        char buffer[INET_ADDRSTRLEN];
+        string client_info = "Accepted client connection from: ";
+        inet_ntop( AF_INET, &client_address.sin_addr, buffer, sizeof( buffer ));
+        client_info += buffer;
+        Console::put_line( client_info.c_str( ));
+    }
+
+
+    //! Return a positive integer configuration parameter or the given default.
+    size_t get_count_parameter( const char *name, size_t default_value )
+    {
+        string *parameter = Support::lookup_parameter( name );
+        if( parameter == nullptr ) return default_value;
+
+        int value = atoi( parameter->c_str( ));
+        return ( value <= 0 ) ? default_value : static_cast<size_t>( value );
+    }
+
+
+    //! Begin the SMTP conversation on a client connection and register it with an event loop.
+    /*!
+     * The caller must have already reserved a session slot for the connection. If the
+     * connection can't be started its socket is closed and its slot is released.
+     */
+    void start_connection( EventLoop &loop, int handle );
+
+    //! Begin the conversation of a session and register it with an event loop. Thread safe.
+    void start_session( EventLoop &loop, Session *session );
+
+    //! Start, queue, or reject a newly accepted connection.
+    void admit( EventLoop &loop, int handle );
+
+
+    //! Give up a session slot, passing it on to the oldest waiting connection if there is one.
+    /*!
+     * This is called when a connection owned by the given loop has ended. A waiting connection
+     * that inherits the slot is started on the same loop.
+     */
+    void release_session( EventLoop &loop )
+    {
+        int handle = -1;
+
+        pthread_mutex_lock( &admission_lock );
+        if( pending.empty( )) {
+            --active_sessions;
+        }
+        else {
+            handle = pending.front( );
+            pending.pop_front( );
+        }
+        pthread_mutex_unlock( &admission_lock );
+
+        if( handle != -1 ) start_connection( loop, handle );
+    }
+
+
+    //! Add a session to its loop's served list. Must be called by the loop's own thread.
+    void serve_session( EventLoop &loop, Session *session )
+    {
+        session->position = loop.served.size( );
+        loop.served.push_back( session );
+    }
+
+
+    //! Destroy a session's connection and close its socket.
+    void destroy_session( EventLoop &loop, Session *session )
+    {
+        // The last session in the served list takes this one's place.
+        Session *last = loop.served.back( );
+        last->position = session->position;
+        loop.served[session->position] = last;
+        loop.served.pop_back( );
+
+        delete session->connection;
+        close( session->handle );
+        if( session->inbound ) {
+            --loop.active;
+            release_session( loop );
+        }
+        delete session;
+    }
+
+
+    //! End a session, unless its connection is waiting for an event.
+    /*!
+     * A connection that is waiting for an event can't be destroyed yet. The session is marked as
+     * abandoned instead and is destroyed when the event happens. See take_woken_sessions().
+     */
+    void end_session( EventLoop &loop, Session *session )
+    {
+        if( session->connection->wants_event( ))
+            session->abandoned = true;
+        else
+            destroy_session( loop, session );
+    }
+
+
+    //! Wake a loop so that it notices new entries in its hand off lists.
+    void wake( EventLoop &loop )
+    {
+        uint64_t one = 1;
+        write( loop.wake_handle, &one, sizeof( one ));
+    }
+
+
+    //! Ask a session's loop to tell its connection that an event has happened. See Connection.
+    void wake_session( void *context )
+    {
+        Session   *session = static_cast<Session *>( context );
+        EventLoop &loop    = *session->loop;
+
+        pthread_mutex_lock( &loop.handoff_lock );
+        loop.woken.push_back( session );
+        pthread_mutex_unlock( &loop.handoff_lock );
+        wake( loop );
+    }
+
+
+    //! Return the new sessions handed to the loop since the last call.
+    vector<Session*> take_new_sessions( EventLoop &loop )
+    {
+        vector<Session*> sessions;
+
+        pthread_mutex_lock( &loop.handoff_lock );
+        sessions.swap( loop.handoff );
+        pthread_mutex_unlock( &loop.handoff_lock );
+        return sessions;
+    }
+
+
+    //! Return the sessions that have waited too long for their peers.
+    /*!
+     * The served list is checked at most once per EXPIRY_INTERVAL; otherwise nothing is returned.
+     */
+    vector<Session*> take_expired_sessions( EventLoop &loop )
+    {
+        vector<Session*> sessions;
+
+        auto now = chrono::steady_clock::now( );
+        if( now < loop.next_expiry ) return sessions;
+        loop.next_expiry = now + EXPIRY_INTERVAL;
+
+        for( Session *session : loop.served ) {
+            if( session->connection->has_expired( now )) sessions.push_back( session );
+        }
+        return sessions;
+    }
+
+
+    //! Return the sessions woken since the last call, ending those that were abandoned.
+    vector<Session*> take_woken_sessions( EventLoop &loop )
+    {
+        vector<Session*> sessions;
+
+        pthread_mutex_lock( &loop.handoff_lock );
+        sessions.swap( loop.woken );
+        pthread_mutex_unlock( &loop.handoff_lock );
+
+        size_t kept = 0;
+        for( Session *session : sessions ) {
+            if( session->abandoned ) {
+                // The conversation is destroyed without being resumed.
+                destroy_session( loop, session );
+            }
+            else {
+                sessions[kept++] = session;
+            }
+        }
+        sessions.resize( kept );
+        return sessions;
+    }
+
+
+    // =================
+    // The epoll Backend
+    // =================
+
+    //! Register a session with an epoll event loop. Must be called by the loop's own thread.
+    void start_epoll_session( EventLoop &loop, Session *session )
+    {
+        serve_session( loop, session );
+        try {
+            int flags = fcntl( session->handle, F_GETFL, 0 );
+            if( flags == -1 || fcntl( session->handle, F_SETFL, flags | O_NONBLOCK ) == -1 )
+                throw runtime_error( "Unable to make socket non-blocking" );
+
+            session->connection->start( );
+
+            epoll_event event;
+            event.events   = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+            event.data.ptr = session;
+            if( epoll_ctl( loop.epoll_handle, EPOLL_CTL_ADD, session->handle, &event ) == -1 )
+                throw runtime_error( "Unable to register socket with event loop" );
+        }
+        catch( exception &e ) {
+            Console::put_exception_line( e.what( ));
+            end_session( loop, session );
+        }
+    }
+
+
+    //! Stop watching a session and end it.
+    void close_epoll_session( EventLoop &loop, Session *session )
+    {
+        epoll_ctl( loop.epoll_handle, EPOLL_CTL_DEL, session->handle, nullptr );
+        end_session( loop, session );
+    }
+
+
+    //! Accept every connection waiting on a shard's listening socket.
+    void accept_connections( EventLoop &loop )
+    {
+        while( true ) {
+            sockaddr_in client_address;
+            socklen_t   client_length = sizeof( client_address );
+
+            int handle = accept4( loop.listen_handle,
+                                  (sockaddr *) &client_address, &client_length, SOCK_NONBLOCK );
+            if( handle == -1 ) {
+                if( errno == EINTR || errno == ECONNABORTED ) continue;
+                if( errno == EAGAIN || errno == EWOULDBLOCK ) return;
+
+                // Running out of descriptors is transient; other errors are reported as well.
+                ostringstream formatter;
+                formatter << "Problem with accept: " << strerror( errno );
+                Console::put_exception_line( formatter.str( ).c_str( ));
+                return;
+            }
+            ++loop.accepted;
+            log_client( client_address );
+            admit( loop, handle );
+        }
+    }
+
+
+    //! Start the new sessions and resume the connections whose awaited events have happened.
+    void complete_epoll_wake( EventLoop &loop )
+    {
+        uint64_t value;
+        read( loop.wake_handle, &value, sizeof( value ));
+
+        for( Session *session : take_new_sessions( loop )) start_epoll_session( loop, session );
+        for( Session *session : take_woken_sessions( loop )) {
+            bool keep_open = false;
+            try {
+                session->connection->event_happened( );
+                keep_open = session->connection->resume( false, false );
+            }
+            catch( exception &e ) {
+                Console::put_exception_line( e.what( ));
+            }
+            catch( ... ) {
+                Console::put_exception_line( "Unknown exception in epoll_event_loop()" );
+            }
+            if( !keep_open ) close_epoll_session( loop, session );
+        }
+    }
+
+
+    //! End the sessions that have waited too long for their peers.
+    void expire_epoll_sessions( EventLoop &loop )
+    {
+        for( Session *session : take_expired_sessions( loop )) {
+            try {
+                session->connection->time_out( );
+                session->connection->resume( false, false );  // Writes the final output.
+            }
+            catch( exception &e ) {
+                Console::put_exception_line( e.what( ));
+            }
+            close_epoll_session( loop, session );
+        }
+    }
+
+
+    /*!
+     * This is the epoll event loop thread function. It waits for socket readiness events and
+     * resumes the corresponding connections. Exceptions thrown while resuming a connection
+     * terminate that connection only.
+     *
+     * A session that is woken can be destroyed as soon as its connection finishes, yet a batch
+     * of events from epoll_wait() can still hold that session's socket event (removing the
+     * socket from the epoll instance doesn't withdraw it). The woken sessions are therefore
+     * dealt with only after all the socket events in the batch, and so are the sessions that
+     * have timed out. While the loop has sessions it wakes at least once per EXPIRY_INTERVAL.
+     */
+    void *epoll_event_loop( void *arg )
+    {
+        EventLoop  *loop = static_cast<EventLoop *>( arg );
+        epoll_event events[MAX_EVENTS];
+
+        const int interval = static_cast<int>(
+            chrono::duration_cast<chrono::milliseconds>( EXPIRY_INTERVAL ).count( ));
+
+        current_loop = loop;
+        while( true ) {
+            int count = epoll_wait(
+                loop->epoll_handle, events, MAX_EVENTS, loop->served.empty( ) ? -1 : interval );
+            IoStatistics::count( IoStatistics::event_waits );
+            if( count < 0 ) {
+                if( errno == EINTR ) continue;
+
+                ostringstream formatter;
+                formatter << "Problem with epoll_wait: " << strerror( errno );
+                Console::put_exception_line( formatter.str( ).c_str( ));
+                return nullptr;
+            }
+
+            bool woken = false;
+            for( int i = 0; i < count; ++i ) {
+                // The listening socket is registered without a session.
+                if( events[i].data.ptr == nullptr ) {
+                    accept_connections( *loop );
+                    continue;
+                }
+                // The wake up eventfd is registered with the loop itself.
+                if( events[i].data.ptr == loop ) {
+                    woken = true;
+                    continue;
+                }
+
+                Session *session = static_cast<Session *>( events[i].data.ptr );
+                bool keep_open = false;
+
+                try {
+                    uint32_t ready = events[i].events;
+                    if( !( ready & EPOLLERR )) {
+                        keep_open = session->connection->resume(
+                            ( ready & ( EPOLLIN | EPOLLRDHUP | EPOLLHUP )) != 0,
+                            ( ready & ( EPOLLRDHUP | EPOLLHUP )) != 0 );
+                    }
+                }
+                catch( exception &e ) {
+                    Console::put_exception_line( e.what( ));
+                }
+                catch( ... ) {
+                    Console::put_exception_line( "Unknown exception in epoll_event_loop()" );
+                }
+
+                if( !keep_open ) close_epoll_session( *loop, session );
+            }
+            if( woken ) complete_epoll_wake( *loop );
+            expire_epoll_sessions( *loop );
+        }
+    }
+
+#ifdef MAILFLUX_HAVE_IO_URING
+
+    // ====================
+    // The io_uring Backend
+    // ====================
+
+    //! Number of submission queue entries in each ring.
+    const unsigned RING_ENTRIES = 256;
+
+    //! Size of each of a session's input and output buffers.
+    const size_t URING_BUFFER_SIZE = 4096;
+
+    //! The kinds of operations submitted to a ring. Stored in the low bits of user_data.
+    /*!
+     * Sessions and event loops are aligned to at least eight bytes, leaving three bits free.
+     */
+    enum uring_operation { URING_READ, URING_WRITE, URING_ACCEPT, URING_WAKE, URING_TIMER };
+
+    //! Mask of the bits of user_data that hold the operation.
+    const uint64_t URING_OPERATION_MASK = 7;
+
+    //! Combine an object address and an operation into a completion tag.
+    uint64_t make_user_data( void *object, uring_operation operation )
+    {
+        return reinterpret_cast<uintptr_t>( object ) | operation;
+    }
+
+
+    //! Return a submission queue entry, flushing the queue to the kernel if it is full.
+    io_uring_sqe *next_sqe( EventLoop &loop )
+    {
+        io_uring_sqe *sqe;
+
+        while(( sqe = loop.ring->get_sqe( )) == nullptr ) {
+            loop.ring->submit( );
+        }
+        return sqe;
+    }
+
+
+    //! Submit a read of the peer's next input.
+    void arm_read( EventLoop &loop, Session *session )
+    {
+        io_uring_sqe *sqe = next_sqe( loop );
+
+        sqe->opcode = ( session->slot != -1 ) ? IORING_OP_READ_FIXED : IORING_OP_RECV;
+        sqe->fd     = session->handle;
+        sqe->addr   = reinterpret_cast<uintptr_t>( session->buffer );
+        sqe->len    = URING_BUFFER_SIZE;
+        sqe->buf_index = 0;
+        sqe->user_data = make_user_data( session, URING_READ );
+        session->reading = true;
+    }
+
+
+    //! Submit a write of the connection's pending output, if there is any.
+    void arm_write( EventLoop &loop, Session *session )
+    {
+        string_view output = session->connection->get_output( );
+        if( session->writing || output.empty( )) return;
+
+        char  *output_buffer = session->buffer + URING_BUFFER_SIZE;
+        size_t count = ( output.size( ) < URING_BUFFER_SIZE ) ? output.size( ) : URING_BUFFER_SIZE;
+        memcpy( output_buffer, output.data( ), count );
+
+        io_uring_sqe *sqe = next_sqe( loop );
+        sqe->opcode = ( session->slot != -1 ) ? IORING_OP_WRITE_FIXED : IORING_OP_SEND;
+        sqe->fd     = session->handle;
+        sqe->addr   = reinterpret_cast<uintptr_t>( output_buffer );
+        sqe->len    = static_cast<unsigned>( count );
+        sqe->buf_index = 0;
+        if( session->slot == -1 ) sqe->msg_flags = MSG_NOSIGNAL;
+        sqe->user_data = make_user_data( session, URING_WRITE );
+        session->writing = true;
+    }
+
+
+    //! Submit an accept on the loop's listening socket.
+    void arm_accept( EventLoop &loop )
+    {
+        io_uring_sqe *sqe = next_sqe( loop );
+
+        loop.client_length = sizeof( loop.client_address );
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd     = loop.listen_handle;
+        sqe->addr   = reinterpret_cast<uintptr_t>( &loop.client_address );
+        sqe->addr2  = reinterpret_cast<uintptr_t>( &loop.client_length );
+        sqe->user_data = make_user_data( &loop, URING_ACCEPT );
+        loop.accepting = true;
+    }
+
+
+    //! Submit a read on the loop's wake up eventfd.
+    void arm_wake( EventLoop &loop )
+    {
+        io_uring_sqe *sqe = next_sqe( loop );
+
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd     = loop.wake_handle;
+        sqe->addr   = reinterpret_cast<uintptr_t>( &loop.wake_value );
+        sqe->len    = sizeof( loop.wake_value );
+        sqe->user_data = make_user_data( &loop, URING_WAKE );
+    }
+
+
+    //! Submit a timeout that expires after EXPIRY_INTERVAL. See expire_uring_sessions().
+    void arm_timer( EventLoop &loop )
+    {
+        io_uring_sqe *sqe = next_sqe( loop );
+
+        loop.tick.tv_sec  = EXPIRY_INTERVAL.count( );
+        loop.tick.tv_nsec = 0;
+        sqe->opcode = IORING_OP_TIMEOUT;
+        sqe->fd     = -1;
+        sqe->addr   = reinterpret_cast<uintptr_t>( &loop.tick );
+        sqe->len    = 1;
+        sqe->user_data = make_user_data( &loop, URING_TIMER );
+    }
+
+
+    //! Begin the conversation of a session. Must be called by the loop's own thread.
+    void start_uring_session( EventLoop &loop, Session *session )
+    {
+        serve_session( loop, session );
+        session->slot = -1;
+        session->buffer = nullptr;
+        try {
+            if( loop.free_slots.empty( )) {
+                session->buffer = new char[2 * URING_BUFFER_SIZE];
+            }
+            else {
+                session->slot = loop.free_slots.back( );
+                session->buffer = loop.buffers + session->slot * 2 * URING_BUFFER_SIZE;
+                loop.free_slots.pop_back( );
+            }
+
+            session->connection->start( );
+            arm_write( loop, session );
+            if( session->connection->wants_input( )) arm_read( loop, session );
+        }
+        catch( exception &e ) {
+            Console::put_exception_line( e.what( ));
+            if( session->slot != -1 ) loop.free_slots.push_back( session->slot );
+            else delete [] session->buffer;
+            end_session( loop, session );
+        }
+    }
+
+
+    //! Start winding down a session. It is destroyed once its pending operations complete.
+    void close_uring_session( Session *session )
+    {
+        if( session->closing ) return;
+
+        session->closing = true;
+        if( session->reading ) shutdown( session->handle, SHUT_RDWR );
+    }
+
+
+    //! Destroy a closing session if it has no operations pending.
+    void retire_uring_session( EventLoop &loop, Session *session )
+    {
+        if( !session->closing || session->reading || session->writing ) return;
+
+        if( session->slot != -1 ) loop.free_slots.push_back( session->slot );
+        else delete [] session->buffer;
+        end_session( loop, session );
+    }
+
+
+    //! Deal with a completed read or write on a connection.
+    void complete_uring_io( EventLoop &loop, Session *session, bool is_read, int result )
+    {
+        if( is_read )
+            session->reading = false;
+        else
+            session->writing = false;
+
+        try {
+            if( session->closing ) {
+                // Nothing more to do.
+            }
+            else if( result <= 0 && ( is_read || result < 0 )) {
+                close_uring_session( session );
+            }
+            else {
+                if( is_read ) {
+                    IoStatistics::count( IoStatistics::socket_reads );
+                    session->connection->receive( session->buffer, result );
+                }
+                else {
+                    IoStatistics::count( IoStatistics::socket_writes );
+                    session->connection->output_written( result );
+                }
+
+                // A conversation waiting for its output to drain is not given more input.
+                arm_write( loop, session );
+                if( !session->reading && session->connection->wants_input( )) {
+                    arm_read( loop, session );
+                }
+            }
+
+            // Once the final output has been written the connection can be closed.
+            if( !session->closing && !session->writing && session->connection->is_finished( )) {
+                close_uring_session( session );
+            }
+        }
+        catch( exception &e ) {
+            Console::put_exception_line( e.what( ));
+            close_uring_session( session );
+        }
+        catch( ... ) {
+            Console::put_exception_line( "Unknown exception in uring_event_loop()" );
+            close_uring_session( session );
+        }
+        retire_uring_session( loop, session );
+    }
+
+
+    //! Resume a connection whose awaited event has happened.
+    void complete_uring_event( EventLoop &loop, Session *session )
+    {
+        try {
+            // A closing session is resumed only so that it stops waiting.
+            session->connection->event_happened( );
+            if( !session->closing ) {
+                arm_write( loop, session );
+                if( !session->reading && session->connection->wants_input( )) {
+                    arm_read( loop, session );
+                }
+                if( !session->writing && session->connection->is_finished( )) {
+                    close_uring_session( session );
+                }
+            }
+        }
+        catch( exception &e ) {
+            Console::put_exception_line( e.what( ));
+            close_uring_session( session );
+        }
+        catch( ... ) {
+            Console::put_exception_line( "Unknown exception in uring_event_loop()" );
+            close_uring_session( session );
+        }
+        retire_uring_session( loop, session );
+    }
+
+
+    //! End the sessions that have waited too long for their peers.
+    /*!
+     * A write that is still pending may never complete, so the final output of each connection
+     * is sent directly if the socket will take it and the socket is then shut down. That also
+     * completes the session's pending operations.
+     */
+    void expire_uring_sessions( EventLoop &loop )
+    {
+        for( Session *session : take_expired_sessions( loop )) {
+            if( session->closing ) continue;
+            try {
+                session->connection->time_out( );
+                string_view output = session->connection->get_output( );
+                if( !session->writing && !output.empty( )) {
+                    send( session->handle,
+                          output.data( ), output.size( ), MSG_DONTWAIT | MSG_NOSIGNAL );
+                }
+            }
+            catch( exception &e ) {
+                Console::put_exception_line( e.what( ));
+            }
+            session->closing = true;
+            shutdown( session->handle, SHUT_RDWR );
+            retire_uring_session( loop, session );
+        }
+    }
+
+
+    //! Start the sessions and listening sockets handed to the loop by other threads.
+    void complete_wake( EventLoop &loop )
+    {
+        for( Session *session : take_new_sessions( loop )) start_uring_session( loop, session );
+        for( Session *session : take_woken_sessions( loop )) complete_uring_event( loop, session );
+        if( loop.listen_handle != -1 && !loop.accepting ) arm_accept( loop );
+        arm_wake( loop );
+    }
+
+
+    //! Deal with a completed accept on the loop's listening socket.
+    void complete_accept( EventLoop &loop, int result )
+    {
+        loop.accepting = false;
+        if( result >= 0 ) {
+            ++loop.accepted;
+            log_client( loop.client_address );
+            admit( loop, result );
+        }
+        else if( result != -EINTR && result != -ECONNABORTED ) {
+            ostringstream formatter;
+            formatter << "Problem with accept: " << strerror( -result );
+            Console::put_exception_line( formatter.str( ).c_str( ));
+        }
+        arm_accept( loop );
+    }
+
+
+    /*!
+     * This is the io_uring event loop thread function. Each pass around the loop submits every
+     * operation prepared during the previous pass with a single system call, then waits for and
+     * processes completions. A timeout is kept pending so that the loop also wakes once per
+     * EXPIRY_INTERVAL to end the sessions that have waited too long for their peers.
+     */
+    void *uring_event_loop( void *arg )
+    {
+        EventLoop *loop = static_cast<EventLoop *>( arg );
+
+        current_loop = loop;
+        arm_wake( *loop );
+        arm_timer( *loop );
+        while( true ) {
+            try {
+                loop->ring->submit_and_wait( 1 );
+                IoStatistics::count( IoStatistics::ring_enters );
+            }
+            catch( exception &e ) {
+                Console::put_exception_line( e.what( ));
+                return nullptr;
+            }
+
+            io_uring_cqe *cqe;
+            while(( cqe = loop->ring->peek_cqe( )) != nullptr ) {
+                uint64_t user_data = cqe->user_data;
+                int      result    = cqe->res;
+                loop->ring->cqe_seen( );
+
+                auto operation = static_cast<uring_operation>( user_data & URING_OPERATION_MASK );
+                void *object   = reinterpret_cast<void *>( user_data & ~URING_OPERATION_MASK );
+                switch( operation ) {
+                    case URING_READ  :
+                    case URING_WRITE :
+                        complete_uring_io(
+                            *loop, static_cast<Session *>( object ),
+                            operation == URING_READ, result );
+                        break;
+                    case URING_ACCEPT:
+                        complete_accept( *loop, result );
+                        break;
+                    case URING_WAKE  :
+                        complete_wake( *loop );
+                        break;
+                    case URING_TIMER :
+                        expire_uring_sessions( *loop );
+                        arm_timer( *loop );
+                        break;
+                }
+            }
+        }
+    }
+
+
+    //! Prepare the io_uring backend for a loop.
+    /*!
+     * \param slot_count The number of sessions that can use registered buffers at once.
+     * \throw std::runtime_error if io_uring is not available.
+     */
+    void initialize_uring( EventLoop &loop, size_t slot_count )
+    {
+        loop.ring = new IoRing( RING_ENTRIES );
+        if(( loop.wake_handle = eventfd( 0, EFD_CLOEXEC )) < 0 )
+            throw runtime_error( "Unable to create event loop wake up handle" );
+
+        // All of a loop's session buffers are registered as a single region.
+        size_t size = slot_count * 2 * URING_BUFFER_SIZE;
+        loop.buffers = new char[size];
+        iovec region = { loop.buffers, size };
+        if( loop.ring->register_buffers( &region, 1 )) {
+            for( size_t i = slot_count; i > 0; --i ) {
+                loop.free_slots.push_back( static_cast<int>( i - 1 ));
+            }
+        }
+        else {
+            Console::put_warning_line( "Unable to register io_uring buffers" );
+            delete [] loop.buffers;
+            loop.buffers = nullptr;
+        }
+    }
+
+
+    //! Release whatever parts of the io_uring backend were prepared for a loop.
+    void cleanup_uring( EventLoop &loop )
+    {
+        delete loop.ring;
+        loop.ring = nullptr;
+        if( loop.wake_handle != -1 ) close( loop.wake_handle );
+        loop.wake_handle = -1;
+        delete [] loop.buffers;
+        loop.buffers = nullptr;
+        loop.free_slots.clear( );
+    }
+
+#endif
+
+    // ==============
+    // Common Actions
+    // ==============
+
+    void start_session( EventLoop &loop, Session *session )
+    {
+        session->loop = &loop;
+        session->connection->set_waker( wake_session, session );
+
+        // Only the loop's own thread may touch its sessions. Other threads hand the session off.
+        if( current_loop != &loop ) {
+            pthread_mutex_lock( &loop.handoff_lock );
+            loop.handoff.push_back( session );
+            pthread_mutex_unlock( &loop.handoff_lock );
+            wake( loop );
+            return;
+        }
+
+#ifdef MAILFLUX_HAVE_IO_URING
+        if( use_io_uring ) {
+            start_uring_session( loop, session );
+            return;
+        }
+#endif
+        start_epoll_session( loop, session );
+    }
+
+
+    void start_connection( EventLoop &loop, int handle )
+    {
+        Session *session = nullptr;
+
+        ++loop.sessions;
+        ++loop.active;
+        try {
+            session = new Session;
+            session->connection = nullptr;
+            session->handle = handle;
+            session->inbound = true;
+            session->connection = new ServerConnection( handle );
+        }
+        catch( exception &e ) {
+            Console::put_exception_line( e.what( ));
+            delete session;
+            close( handle );
+            --loop.active;
+            release_session( loop );
+            return;
+        }
+        start_session( loop, session );
+    }
+
+
+    //! Start, queue, or reject a newly accepted connection.
+    /*!
+     * If a session slot is free the connection is started on the given event loop. Otherwise it
+     * is put on the pending queue to wait for a slot. If the queue is full the client is sent a
+     * 421 reply and the connection is closed at once.
+     */
+    void admit( EventLoop &loop, int handle )
+    {
+        bool admitted = false;
+        bool queued   = false;
+
+        pthread_mutex_lock( &admission_lock );
+        if( active_sessions < max_sessions ) {
+            ++active_sessions;
+            admitted = true;
+        }
+        else if( pending.size( ) < max_pending ) {
+            pending.push_back( handle );
+            queued = true;
+        }
+        else {
+            ++rejected_sessions;
+        }
+        pthread_mutex_unlock( &admission_lock );
+
+        if( admitted ) {
+            start_connection( loop, handle );
+        }
+        else if( !queued ) {
+            send( handle, rejection, sizeof( rejection ) - 1, MSG_NOSIGNAL | MSG_DONTWAIT );
+            close( handle );
+        }
+    }
+
+
+    //! Display the admission control counters. This is the console's "sessions" command.
+    string sessions_command( )
+    {
+        ostringstream formatter;
+
+        pthread_mutex_lock( &admission_lock );
+        formatter << "Active sessions  : " << active_sessions << " (max " << max_sessions << ")\n"
+                  << "Queued sessions  : " << pending.size( ) << " (max " << max_pending << ")\n"
+                  << "Rejected sessions: " << rejected_sessions;
+        pthread_mutex_unlock( &admission_lock );
+        return formatter.str( );
+    }
+
+
+    //! Display the per loop counters. This is the console's "shards" command.
+    string shards_command( )
+    {
+        ostringstream formatter;
+
+        formatter << "Backend: " << ( use_io_uring ? "io_uring" : "epoll" );
+        for( size_t i = 0; i < loop_count; ++i ) {
+            EventLoop &loop = loops[i];
+
+            formatter << "\nLoop " << i;
+            if( loop.cpu != -1 ) formatter << " (cpu " << loop.cpu << ")";
+            formatter << ": ";
+            if( loop.listen_handle != -1 ) formatter << "accepted " << loop.accepted << ", ";
+            formatter << "sessions " << loop.sessions << ", active " << loop.active;
+        }
+        return formatter.str( );
+    }
+
+} // End of anonymous namespace.
+
+
+namespace Reactor {
+
+    //! Initialize the event loops.
+    /*!
+     * This function prepares the I/O backend and starts the event loop threads. The number of
+     * threads is taken from the LISTEN_SHARDS configuration parameter if it is set, and from the
+     * EVENT_THREADS parameter otherwise. If PIN_EVENT_THREADS is "yes" each thread is bound to a
+     * processor. The admission limits are taken from the MAX_SESSIONS and PENDING_CONNECTIONS
+     * parameters. If IO_BACKEND is "io_uring" that backend is used, with URING_BUFFERS
+     * registered buffer slots per loop. Each connection's input buffer holds INPUT_BUFFER_SIZE
+     * characters and no message larger than MAX_MESSAGE_SIZE is accepted. A client is
+     * disconnected if it leaves its session waiting for SESSION_TIMEOUT seconds. Note that this
+     * function assumes that Support::read_config_files() has already been called.
+     */
+    void initialize( )
+    {
+        size_t thread_count = shard_count( );
+        if( thread_count == 0 ) thread_count = get_count_parameter( "EVENT_THREADS", 2 );
+        max_sessions = get_count_parameter( "MAX_SESSIONS", 1000 );
+        max_pending  = get_count_parameter( "PENDING_CONNECTIONS", 100 );
+        size_t input_size = get_count_parameter( "INPUT_BUFFER_SIZE", 64 * 1024 );
+        Connection::set_input_buffer_size(
+            ( input_size < MIN_INPUT_BUFFER_SIZE ) ? MIN_INPUT_BUFFER_SIZE : input_size );
+        ServerConnection::set_maximum_message_size(
+            get_count_parameter( "MAX_MESSAGE_SIZE", 10 * 1024 * 1024 ));
+        ServerConnection::set_idle_timeout(
+            chrono::seconds( get_count_parameter( "SESSION_TIMEOUT", 300 )));
+        Console::register_command( "sessions", sessions_command );
+        Console::register_command( "shards", shards_command );
+        Console::register_command( "io", IoStatistics::report );
+
+        string *pin = Support::lookup_parameter( "PIN_EVENT_THREADS" );
+        bool pin_threads = ( pin != nullptr && *pin == "yes" );
+        long cpu_count = sysconf( _SC_NPROCESSORS_ONLN );
+        if( cpu_count < 1 ) cpu_count = 1;
+
+        loops.reset( new EventLoop[thread_count] );
+        loop_count = thread_count;
+        for( size_t i = 0; i < loop_count; ++i ) {
+            if(( loops[i].epoll_handle = epoll_create1( 0 )) < 0 ) {
+                ostringstream formatter;
+                formatter << "Problem creating epoll instance: " << strerror( errno );
+                throw runtime_error( formatter.str( ));
+            }
+            if( pin_threads ) loops[i].cpu = static_cast<int>( i % cpu_count );
+        }
+
+        string *backend = Support::lookup_parameter( "IO_BACKEND" );
+        if( backend != nullptr && *backend == "io_uring" ) {
+#ifdef MAILFLUX_HAVE_IO_URING
+            size_t slot_count = get_count_parameter( "URING_BUFFERS", 256 );
+            try {
+                for( size_t i = 0; i < loop_count; ++i ) {
+                    initialize_uring( loops[i], slot_count );
+                }
+                use_io_uring = true;
+            }
+            catch( exception &e ) {
+                Console::put_exception_line( e.what( ));
+                Console::put_warning_line( "io_uring is not available; using epoll" );
+                for( size_t i = 0; i < loop_count; ++i ) {
+                    cleanup_uring( loops[i] );
+                }
+            }
+#else
+            Console::put_warning_line( "io_uring support was not compiled in; using epoll" );
+#endif
+        }
+
+        // An epoll loop watches its wake up eventfd like a socket. See complete_epoll_wake().
+        if( !use_io_uring ) {
+            for( size_t i = 0; i < loop_count; ++i ) {
+                EventLoop &loop = loops[i];
+                epoll_event event;
+                event.events   = EPOLLIN | EPOLLET;
+                event.data.ptr = &loop;
+                if(( loop.wake_handle = eventfd( 0, EFD_CLOEXEC | EFD_NONBLOCK )) < 0 ||
+                    epoll_ctl( loop.epoll_handle, EPOLL_CTL_ADD, loop.wake_handle, &event ) == -1 )
+                    throw runtime_error( "Unable to create event loop wake up handle" );
+            }
+        }
+
+        ostringstream message_formatter;
+        message_formatter << "Starting " << thread_count << " event loop thread(s) using "
+                          << ( use_io_uring ? "io_uring" : "epoll" );
+        Console::put_debug_line( message_formatter.str( ).c_str( ));
+
+        // The loops run forever and are never terminated or joined. This mirrors the handling
+        // of the spool thread.
+        //
+        for( size_t i = 0; i < loop_count; ++i ) {
+            EventLoop &loop = loops[i];
+
+#ifdef MAILFLUX_HAVE_IO_URING
+            if( use_io_uring ) {
+                pthread_create( &loop.thread, nullptr, uring_event_loop, &loop );
+            }
+            else
+#endif
+            pthread_create( &loop.thread, nullptr, epoll_event_loop, &loop );
+            if( loop.cpu != -1 ) {
+                cpu_set_t cpus;
+                CPU_ZERO( &cpus );
+                CPU_SET( loop.cpu, &cpus );
+                if( pthread_setaffinity_np( loop.thread, sizeof( cpus ), &cpus ) != 0 ) {
+                    Console::put_warning_line( "Unable to pin event loop thread to a processor" );
+                    loop.cpu = -1;
+                }
+            }
+            pthread_detach( loop.thread );
+        }
+    }
+
+
+    //! Return the number of SO_REUSEPORT listening shards requested by the configuration.
+    /*!
+     * The value is taken from the LISTEN_SHARDS configuration parameter. Zero means that a
+     * single listening socket served by a single acceptor thread is used instead.
+     */
+    size_t shard_count( )
+    {
+        return get_count_parameter( "LISTEN_SHARDS", 0 );
+    }
+
+
+    //! Give a listening socket to the next event loop.
+    /*!
+     * This function is used in sharded mode. Each listening socket is owned by its own event
+     * loop which accepts connections from it directly. Connections accepted by a shard are
+     * served by that shard's loop. It must be called after initialize(), at most once per
+     * loop.
+     *
+     * \param handle A listening socket bound with SO_REUSEPORT.
+     */
+    void add_listener( int handle )
+    {
+        unsigned index = next_shard++;
+        if( index >= loop_count )
+            throw runtime_error( "More listening sockets than event loops" );
+        EventLoop &loop = loops[index];
+
+#ifdef MAILFLUX_HAVE_IO_URING
+        // The loop arms the accept itself the next time it wakes up.
+        if( use_io_uring ) {
+            pthread_mutex_lock( &loop.handoff_lock );
+            loop.listen_handle = handle;
+            pthread_mutex_unlock( &loop.handoff_lock );
+            wake( loop );
+            return;
+        }
+#endif
+
+        int flags = fcntl( handle, F_GETFL, 0 );
+        if( flags == -1 || fcntl( handle, F_SETFL, flags | O_NONBLOCK ) == -1 )
+            throw runtime_error( "Unable to make listening socket non-blocking" );
+
+        epoll_event event;
+        event.events   = EPOLLIN | EPOLLET;
+        event.data.ptr = nullptr;
+        loop.listen_handle = handle;
+        if( epoll_ctl( loop.epoll_handle, EPOLL_CTL_ADD, handle, &event ) == -1 )
+            throw runtime_error( "Unable to register listening socket with event loop" );
+    }
+
+
+    //! Hand a newly accepted connection to one of the event loops.
+    /*!
+     * If a session slot is free the connection is started on the next event loop in round
+     * robin order. Otherwise it is put on the pending queue to wait for a slot. If the queue is
+     * full the client is sent a 421 reply and the connection is closed at once. In all cases
+     * the connection belongs to the reactor after this function returns; the reactor closes the
+     * socket when the SMTP conversation ends.
+     *
+     * \param handle The socket handle of the newly accepted client connection.
+     */
+    void add_connection( int handle )
+    {
+        admit( loops[next_loop++ % loop_count], handle );
+    }
+
+
+    //! Hand an outbound connection to one of the event loops.
+    /*!
+     * The connection is started on the next event loop in round robin order. Outbound
+     * connections are not subject to admission control. The connection belongs to the reactor
+     * after this function returns; the reactor destroys it and closes its socket when the
+     * conversation ends.
+     *
+     * \param connection A newly created connection to a server.
+     */
+    void add_outbound( Connection *connection )
+    {
+        Session *session;
+
+        try {
+            session = new Session;
+        }
+        catch( ... ) {
+            int handle = connection->get_handle( );
+            delete connection;
+            close( handle );
+            throw;
+        }
+        session->connection = connection;
+        session->handle = connection->get_handle( );
+        session->inbound = false;
+        start_session( loops[next_loop++ % loop_count], session );
+    }
+
+}
@@ -0,0 +1,42 @@
+/*! \file    Reactor.hpp
+ *  \brief   Interface to the connection event loops.
+ *  \author  Peter Chapin <spicacality@kelseymountain.org>
+ */
+
+#ifndef REACTOR_HPP
+#define REACTOR_HPP
+
+#include <cstddef>
+
+class Connection;
+
+//! Namespace for the event driven connection handling facilities.
+/*!
+ * Inbound SMTP sessions are multiplexed over a small, fixed number of event loop threads. Each
+ * loop owns an edge-triggered epoll instance and resumes the ServerConnection objects assigned
+ * to it whenever their sockets become ready. Outbound ClientConnection objects created by the
+ * spool are served by the same loops. The number of threads used to handle connections
+ * is set by the EVENT_THREADS configuration parameter and does not depend on the number of
+ * connections. The number of simultaneous sessions, and the number of connections that may wait
+ * for a session to become available, are bounded by the MAX_SESSIONS and PENDING_CONNECTIONS
+ * configuration parameters. A session whose client leaves it waiting for SESSION_TIMEOUT
+ * seconds is ended. The console command "sessions" displays the admission counters.
+ *
+ * Optionally the listening port can be sharded over several SO_REUSEPORT sockets, each owned by
+ * its own event loop. The console command "shards" displays per loop accept and session counts.
+ * The console command "io" displays the I/O counters kept by IoStatistics.
+ */
+namespace Reactor {
+
+    void initialize( );
+
+    std::size_t shard_count( );
+
+    void add_listener( int handle );
+
+    void add_connection( int handle );
+
+    void add_outbound( Connection *connection );
+}
+
+#endif
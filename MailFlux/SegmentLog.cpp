@@ -0,0 +1,730 @@
+/*! \file    SegmentLog.cpp
+ *  \brief   Implementation of an append-only log of records kept in segment files.
+ *  \author  Peter Chapin <spicacality@kelseymountain.org>
+ *
+ * A segment file is a sequence of records, each starting on an eight byte boundary. Each record
+ * is a RecordHeader followed by the key and then the data. The rest of the segment, after the
+ * last record, holds zeros. The segment's tombstone file is a sequence of eight byte offsets, in
+ * native byte order, of records that have been removed.
+ *
+ * New records are only ever appended to a segment created by this process. Segments found when
+ * the log is opened are read but not extended, because after a crash the space following their
+ * last valid record may hold part of a record that was being written. Nothing written after
+ * such a fragment could be found again.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iomanip>
+#include <sstream>
+#include <stdexcept>
+#include <unordered_set>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "SegmentLog.hpp"
+
+using namespace std;
+
+// Anonymous namespace for module private items.
+namespace {
+
+    //! The first four bytes of every record ("MFR1" when stored little endian).
+    const uint32_t RECORD_MAGIC = 0x3152464DU;
+
+    //! Records start at multiples of this.
+    const uint64_t RECORD_ALIGNMENT = 8;
+
+    //! Longest key a record can have.
+    const size_t MAX_KEY_LENGTH = 255;
+
+    //! A segment is compacted if less than this fraction (1/N) of it holds live records.
+    const uint64_t COMPACT_FRACTION = 16;
+
+    //! Size of the pieces in which a file is copied into the log by append_file().
+    const size_t COPY_SIZE = 64 * 1024;
+
+    //! The start of each record in a segment.
+    struct RecordHeader {
+        uint32_t magic;
+        uint32_t key_length;
+        uint64_t length;      //!< Size of the data.
+        uint64_t checksum;    //!< Of the key and the data. See add_to_checksum().
+    };
+
+    const uint64_t CHECKSUM_START = 14695981039346656037ULL;
+
+    //! Include some text in a checksum.
+    /*!
+     * This is FNV-1a applied to 64 bit words rather than to bytes, so it costs little more than
+     * reading the text. It is meant to detect records that were only partly written, not to
+     * resist tampering. Adding text in pieces gives the same result as adding it all at once,
+     * provided all but the last piece is a multiple of eight bytes long.
+     */
+    void add_to_checksum( uint64_t &checksum, const char *text, size_t length )
+    {
+        while( length >= sizeof( uint64_t )) {
+            uint64_t word;
+            memcpy( &word, text, sizeof( word ));
+            checksum = ( checksum ^ word ) * 1099511628211ULL;
+            text   += sizeof( word );
+            length -= sizeof( word );
+        }
+        while( length > 0 ) {
+            checksum = ( checksum ^ static_cast<unsigned char>( *text )) * 1099511628211ULL;
+            ++text;
+            --length;
+        }
+    }
+
+    //! Return the space taken in a segment by a record with the given key and data sizes.
+    uint64_t record_size( uint64_t key_length, uint64_t length )
+    {
+        uint64_t size = sizeof( RecordHeader ) + key_length + length;
+        return ( size + RECORD_ALIGNMENT - 1 ) & ~( RECORD_ALIGNMENT - 1 );
+    }
+
+    [[noreturn]] void log_error( const char *what )
+    {
+        ostringstream formatter;
+        formatter << what << ": " << strerror( errno );
+        throw runtime_error( formatter.str( ));
+    }
+
+    //! Write all of a buffer at the given offset.
+    bool write_all( int handle, const char *data, size_t length, uint64_t offset )
+    {
+        while( length > 0 ) {
+            ssize_t count = pwrite( handle, data, length, static_cast<off_t>( offset ));
+            if( count == -1 ) {
+                if( errno == EINTR ) continue;
+                return false;
+            }
+            data   += count;
+            length -= static_cast<size_t>( count );
+            offset += static_cast<uint64_t>( count );
+        }
+        return true;
+    }
+
+    //! Lock a mutex for the life of the object.
+    class Guard {
+    public:
+        explicit Guard( pthread_mutex_t &the_mutex ) : mutex( the_mutex )
+        { pthread_mutex_lock( &mutex ); }
+
+        ~Guard( )
+        { pthread_mutex_unlock( &mutex ); }
+
+    private:
+        pthread_mutex_t &mutex;
+
+        // Make copying illegal.
+        Guard( const Guard & );
+        Guard &operator=( const Guard & );
+    };
+
+}   // End of anonymous namespace.
+
+
+// === Private Methods ===
+
+//! Return the name of one of a segment's files, relative to the log directory.
+string SegmentLog::segment_name( uint32_t number, const char *extension ) const
+{
+    char name[32];
+    snprintf( name, sizeof( name ), "%08u.%s", number, extension );
+    return name;
+}
+
+
+//! Open an existing segment and read its records and tombstones.
+void SegmentLog::open_segment( uint32_t number )
+{
+    string name = segment_name( number, "seg" );
+    int handle = openat( directory_handle, name.c_str( ), O_RDWR | O_CLOEXEC );
+    if( handle == -1 ) log_error( "Can't open log segment" );
+
+    struct stat status;
+    if( fstat( handle, &status ) == -1 ) {
+        close( handle );
+        log_error( "Can't examine log segment" );
+    }
+
+    // A crash while the segment was being created can leave it empty.
+    if( status.st_size == 0 ) {
+        close( handle );
+        unlinkat( directory_handle, name.c_str( ), 0 );
+        unlinkat( directory_handle, segment_name( number, "dead" ).c_str( ), 0 );
+        return;
+    }
+
+    uint64_t size = static_cast<uint64_t>( status.st_size );
+    void *mapping = mmap( nullptr, size, PROT_READ, MAP_SHARED, handle, 0 );
+    if( mapping == MAP_FAILED ) {
+        close( handle );
+        log_error( "Can't map log segment" );
+    }
+
+    Segment &segment = segments[number];
+    segment.handle = handle;
+    segment.tombstone_handle = -1;
+    segment.mapping = static_cast<char *>( mapping );
+    segment.size = size;
+    segment.tail = 0;
+    segment.live_count = 0;
+    segment.live_bytes = 0;
+    recover_segment( number, segment );
+}
+
+
+//! Find the records of a segment and apply its tombstones.
+/*!
+ * The records are read from the start of the segment. The first one that is incomplete or
+ * damaged, or the zeros that follow the last record, ends the segment.
+ */
+void SegmentLog::recover_segment( uint32_t number, Segment &segment )
+{
+    uint64_t offset = 0;
+    while( segment.size - offset >= sizeof( RecordHeader )) {
+        RecordHeader header;
+        memcpy( &header, segment.mapping + offset, sizeof( header ));
+        uint64_t available = segment.size - offset - sizeof( header );
+        if( header.magic != RECORD_MAGIC ||
+            header.key_length > MAX_KEY_LENGTH ||
+            header.key_length > available ||
+            header.length > available - header.key_length ) break;
+
+        const char *key = segment.mapping + offset + sizeof( header );
+        uint64_t checksum = CHECKSUM_START;
+        add_to_checksum( checksum, key, header.key_length );
+        add_to_checksum( checksum, key + header.key_length, header.length );
+        if( checksum != header.checksum ) break;
+
+        segment.entries.push_back(
+            Entry{ offset, header.length, string( key, header.key_length ), true, false } );
+        ++segment.live_count;
+        segment.live_bytes += record_size( header.key_length, header.length );
+        offset += record_size( header.key_length, header.length );
+    }
+    segment.tail = offset;
+
+    // Apply the tombstones. A tombstone for a record that wasn't found is ignored.
+    int handle = openat(
+        directory_handle, segment_name( number, "dead" ).c_str( ), O_RDONLY | O_CLOEXEC );
+    if( handle == -1 ) return;
+
+    uint64_t removed_offset;
+    while( read( handle, &removed_offset, sizeof( removed_offset )) ==
+           static_cast<ssize_t>( sizeof( removed_offset ))) {
+        auto entry = lower_bound( segment.entries.begin( ), segment.entries.end( ),
+            removed_offset, []( const Entry &e, uint64_t o ) { return e.offset < o; } );
+        if( entry == segment.entries.end( ) || entry->offset != removed_offset ||
+            entry->removed ) continue;
+        entry->removed = true;
+        --segment.live_count;
+        segment.live_bytes -= record_size( entry->key.size( ), entry->length );
+    }
+    close( handle );
+}
+
+
+//! Close a segment and forget it, optionally removing its files.
+void SegmentLog::close_segment( uint32_t number, bool remove_files )
+{
+    auto position = segments.find( number );
+    if( position == segments.end( )) return;
+
+    Segment &segment = position->second;
+    munmap( segment.mapping, segment.size );
+    close( segment.handle );
+    if( segment.tombstone_handle != -1 ) close( segment.tombstone_handle );
+    if( remove_files ) {
+        unlinkat( directory_handle, segment_name( number, "seg" ).c_str( ), 0 );
+        unlinkat( directory_handle, segment_name( number, "dead" ).c_str( ), 0 );
+        ++removed_segments;
+    }
+    segments.erase( position );
+}
+
+
+//! Return the segment in which a record of the given size is to be appended.
+/*!
+ * If the active segment does not have room a new one is created, preallocated, and made the
+ * active segment. A record larger than the usual segment size gets a segment of its own. The
+ * lock must be held.
+ */
+SegmentLog::Segment &SegmentLog::reserve( uint64_t size )
+{
+    auto position = segments.find( active );
+    if( position != segments.end( ) && position->second.size - position->second.tail >= size )
+        return position->second;
+
+    uint32_t number = segments.empty( ) ? 1 : segments.rbegin( )->first + 1;
+    uint64_t new_size = max( segment_size, ( size + 4095 ) & ~uint64_t( 4095 ));
+    string name = segment_name( number, "seg" );
+    int handle = openat(
+        directory_handle, name.c_str( ), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600 );
+    if( handle == -1 ) log_error( "Can't create log segment" );
+
+    // The segment's size and name are made durable now so that sync() needs only fdatasync().
+    int result = posix_fallocate( handle, 0, static_cast<off_t>( new_size ));
+    if( result != 0 || fsync( handle ) == -1 || fsync( directory_handle ) == -1 ) {
+        if( result != 0 ) errno = result;
+        int saved = errno;
+        close( handle );
+        unlinkat( directory_handle, name.c_str( ), 0 );
+        errno = saved;
+        log_error( "Can't allocate log segment" );
+    }
+
+    void *mapping = mmap( nullptr, new_size, PROT_READ, MAP_SHARED, handle, 0 );
+    if( mapping == MAP_FAILED ) {
+        int saved = errno;
+        close( handle );
+        unlinkat( directory_handle, name.c_str( ), 0 );
+        errno = saved;
+        log_error( "Can't map log segment" );
+    }
+
+    Segment &segment = segments[number];
+    segment.handle = handle;
+    segment.tombstone_handle = -1;
+    segment.mapping = static_cast<char *>( mapping );
+    segment.size = new_size;
+    segment.tail = 0;
+    segment.live_count = 0;
+    segment.live_bytes = 0;
+    active = number;
+    return segment;
+}
+
+
+//! Stop appending to the active segment after a failed write. The lock must be held.
+/*!
+ * Part of the record may have been written after the segment's last record. Appending more
+ * records there could leave the rest of it after them, where it could be mistaken for a record
+ * after a crash. Saving errno lets the caller report the failure.
+ */
+void SegmentLog::seal_active( )
+{
+    int saved = errno;
+    active = 0;
+    errno = saved;
+}
+
+
+//! Return the entry for the record at the given location, or nullptr. The lock must be held.
+SegmentLog::Entry *SegmentLog::find_entry( const Location &where )
+{
+    auto position = segments.find( where.segment );
+    if( position == segments.end( )) return nullptr;
+
+    vector<Entry> &entries = position->second.entries;
+    auto entry = lower_bound( entries.begin( ), entries.end( ), where.offset,
+        []( const Entry &e, uint64_t o ) { return e.offset < o; } );
+    if( entry == entries.end( ) || entry->offset != where.offset ) return nullptr;
+    return &*entry;
+}
+
+
+//! Open a log, creating its directory if necessary.
+/*!
+ * The records of the existing segments are found. If more than one record has the same key,
+ * as can happen after a crash during compact(), only the first is kept.
+ *
+ * \param directory The directory that holds the segment files.
+ * \param segment_size The size of the segments that are created.
+ * \throw std::runtime_error if the directory or a segment can't be opened.
+ */
+SegmentLog::SegmentLog( const string &directory, uint64_t segment_size ) :
+    directory( directory ),
+    segment_size( max( segment_size, uint64_t( 4096 )) & ~uint64_t( 4095 )),
+    active( 0 ),
+    removed_segments( 0 )
+{
+    pthread_mutex_init( &lock, nullptr );
+    pthread_mutex_init( &sync_lock, nullptr );
+
+    if( mkdir( directory.c_str( ), 0700 ) == -1 && errno != EEXIST )
+        log_error( "Can't create log directory" );
+    directory_handle = open( directory.c_str( ), O_RDONLY | O_DIRECTORY | O_CLOEXEC );
+    if( directory_handle == -1 ) log_error( "Can't open log directory" );
+
+    vector<uint32_t> numbers;
+    DIR *scan_state = opendir( directory.c_str( ));
+    if( scan_state == nullptr ) log_error( "Can't scan log directory" );
+    dirent *directory_entry;
+    while(( directory_entry = readdir( scan_state )) != nullptr ) {
+        unsigned number;
+        char extension[8];
+        if( sscanf( directory_entry->d_name, "%8u.%7s", &number, extension ) == 2 &&
+            strcmp( extension, "seg" ) == 0 ) numbers.push_back( number );
+    }
+    closedir( scan_state );
+
+    sort( numbers.begin( ), numbers.end( ));
+    for( uint32_t number : numbers ) open_segment( number );
+
+    unordered_set<string> keys;
+    for( auto &[number, segment] : segments ) {
+        for( Entry &entry : segment.entries ) {
+            if( !entry.removed && !keys.insert( entry.key ).second )
+                remove( Location{ number, entry.offset } );
+        }
+    }
+}
+
+
+//! Close the log. Records that were not synchronized may or may not survive.
+SegmentLog::~SegmentLog( )
+{
+    while( !segments.empty( )) close_segment( segments.begin( )->first, false );
+    close( directory_handle );
+    pthread_mutex_destroy( &sync_lock );
+    pthread_mutex_destroy( &lock );
+}
+
+
+//! Append a record.
+/*!
+ * The record is not durable, and is not returned by get_records(), until sync() is called.
+ *
+ * \param key A short name for the record, at most 255 characters.
+ * \param data The data of the record.
+ * \return The location of the new record.
+ * \throw std::runtime_error if the record can't be written.
+ */
+SegmentLog::Location SegmentLog::append( string_view key, string_view data )
+{
+    if( key.size( ) > MAX_KEY_LENGTH ) throw runtime_error( "Log record key is too long" );
+
+    RecordHeader header;
+    header.magic = RECORD_MAGIC;
+    header.key_length = static_cast<uint32_t>( key.size( ));
+    header.length = data.size( );
+    header.checksum = CHECKSUM_START;
+    add_to_checksum( header.checksum, key.data( ), key.size( ));
+    add_to_checksum( header.checksum, data.data( ), data.size( ));
+
+    uint64_t size = record_size( key.size( ), data.size( ));
+    static const char padding[RECORD_ALIGNMENT] = { };
+    iovec pieces[4] = {
+        { &header, sizeof( header ) },
+        { const_cast<char *>( key.data( )), key.size( ) },
+        { const_cast<char *>( data.data( )), data.size( ) },
+        { const_cast<char *>( padding ), size - sizeof( header ) - key.size( ) - data.size( ) }
+    };
+
+    // Records are written in the order their space is reserved. A gap left by a record that
+    // is not yet written would hide the records after it if there was a crash.
+    Guard guard( lock );
+    Segment &segment = reserve( size );
+    uint64_t offset = segment.tail;
+    uint64_t done = 0;
+    int piece = 0;
+    while( done < size ) {
+        ssize_t count = pwritev(
+            segment.handle, pieces + piece, 4 - piece, static_cast<off_t>( offset + done ));
+        if( count == -1 ) {
+            if( errno == EINTR ) continue;
+            seal_active( );
+            log_error( "Can't write log record" );
+        }
+        done += static_cast<uint64_t>( count );
+        while( piece < 4 && static_cast<size_t>( count ) >= pieces[piece].iov_len ) {
+            count -= static_cast<ssize_t>( pieces[piece].iov_len );
+            ++piece;
+        }
+        if( piece < 4 ) {
+            pieces[piece].iov_base = static_cast<char *>( pieces[piece].iov_base ) + count;
+            pieces[piece].iov_len -= static_cast<size_t>( count );
+        }
+    }
+
+    segment.tail += size;
+    segment.entries.push_back( Entry{ offset, data.size( ), string( key ), false, false } );
+    ++segment.live_count;
+    segment.live_bytes += size;
+    unsynchronized.push_back( Location{ active, offset } );
+    return Location{ active, offset };
+}
+
+
+//! Append a record whose data is the contents of a file.
+/*!
+ * The data is copied into the log. The record's header is written last, so that a record is
+ * never found after a crash unless all of its data was written.
+ *
+ * \param key A short name for the record, at most 255 characters.
+ * \param handle The file, which is read from its start.
+ * \param length The number of bytes of the file to copy.
+ * \return The location of the new record.
+ * \throw std::runtime_error if the file can't be read or the record can't be written.
+ */
+SegmentLog::Location SegmentLog::append_file( string_view key, int handle, uint64_t length )
+{
+    if( key.size( ) > MAX_KEY_LENGTH ) throw runtime_error( "Log record key is too long" );
+
+    RecordHeader header;
+    header.magic = RECORD_MAGIC;
+    header.key_length = static_cast<uint32_t>( key.size( ));
+    header.length = length;
+    header.checksum = CHECKSUM_START;
+    add_to_checksum( header.checksum, key.data( ), key.size( ));
+
+    uint64_t size = record_size( key.size( ), length );
+    Guard guard( lock );
+    Segment &segment = reserve( size );
+    uint64_t offset = segment.tail;
+    uint64_t data_offset = offset + sizeof( header ) + key.size( );
+    scratch.resize( COPY_SIZE );
+
+    // Every piece but the last is COPY_SIZE bytes, so the checksum can be taken in pieces.
+    for( uint64_t copied = 0; copied < length; ) {
+        size_t wanted = static_cast<size_t>( min( length - copied, uint64_t( COPY_SIZE )));
+        size_t filled = 0;
+        while( filled < wanted ) {
+            ssize_t count = pread( handle, scratch.data( ) + filled,
+                wanted - filled, static_cast<off_t>( copied + filled ));
+            if( count == -1 && errno == EINTR ) continue;
+            if( count <= 0 ) {
+                seal_active( );
+                if( count == 0 ) throw runtime_error( "File to be logged is too short" );
+                log_error( "Can't read file to be logged" );
+            }
+            filled += static_cast<size_t>( count );
+        }
+        add_to_checksum( header.checksum, scratch.data( ), filled );
+        if( !write_all( segment.handle, scratch.data( ), filled, data_offset + copied )) {
+            seal_active( );
+            log_error( "Can't write log record" );
+        }
+        copied += filled;
+    }
+
+    if( !write_all( segment.handle, key.data( ), key.size( ), offset + sizeof( header )) ||
+        !write_all( segment.handle,
+            reinterpret_cast<const char *>( &header ), sizeof( header ), offset )) {
+        seal_active( );
+        log_error( "Can't write log record" );
+    }
+
+    segment.tail += size;
+    segment.entries.push_back( Entry{ offset, length, string( key ), false, false } );
+    ++segment.live_count;
+    segment.live_bytes += size;
+    unsynchronized.push_back( Location{ active, offset } );
+    return Location{ active, offset };
+}
+
+
+//! Make all the records appended so far durable.
+/*!
+ * Each segment that was written is flushed with one fdatasync(), however many records were
+ * appended to it. When this method returns, every record appended before it was called, by any
+ * thread, is durable. Records can be appended by other threads while it runs.
+ *
+ * \throw std::runtime_error if a segment can't be flushed. The records appended since the last
+ * successful call are then removed, since whether they survive a crash is unknown.
+ */
+void SegmentLog::sync( )
+{
+    Guard sync_guard( sync_lock );
+    vector<Location> records;
+    vector<int> handles;
+    {
+        Guard guard( lock );
+        records.swap( unsynchronized );
+        for( const Location &where : records ) {
+            int handle = segments[where.segment].handle;
+            if( handles.empty( ) || handles.back( ) != handle ) handles.push_back( handle );
+        }
+    }
+
+    // The segments written are not removed before their records are durable.
+    bool failed = false;
+    for( int handle : handles ) {
+        if( fdatasync( handle ) == -1 ) failed = true;
+    }
+    int saved = errno;
+
+    if( failed ) {
+        for( const Location &where : records ) remove( where );
+        errno = saved;
+        log_error( "Can't flush log segment" );
+    }
+    Guard guard( lock );
+    for( const Location &where : records ) {
+        Entry *entry = find_entry( where );
+        if( entry != nullptr ) entry->durable = true;
+    }
+}
+
+
+//! Add the durable records that have not been removed to a list, oldest first.
+void SegmentLog::get_records( vector<Record> &result ) const
+{
+    Guard guard( lock );
+    for( const auto &[number, segment] : segments ) {
+        for( const Entry &entry : segment.entries ) {
+            if( entry.durable && !entry.removed )
+                result.push_back(
+                    Record{ Location{ number, entry.offset }, entry.length, entry.key } );
+        }
+    }
+}
+
+
+//! Return the data of a record.
+/*!
+ * The data is read in place, from the segment's mapping. It remains valid until the record's
+ * segment is removed by compact().
+ *
+ * \throw std::runtime_error if there is no such segment.
+ */
+string_view SegmentLog::get_data( const Location &where ) const
+{
+    Guard guard( lock );
+    auto position = segments.find( where.segment );
+    if( position == segments.end( ) || where.offset >= position->second.tail )
+        throw runtime_error( "No such log record" );
+
+    RecordHeader header;
+    const char *record = position->second.mapping + where.offset;
+    memcpy( &header, record, sizeof( header ));
+    return string_view( record + sizeof( header ) + header.key_length, header.length );
+}
+
+
+//! Remove a record.
+/*!
+ * A tombstone is appended to the segment's tombstone file. It is not flushed, so after a crash
+ * a record that was removed shortly before may be found again.
+ *
+ * \throw std::runtime_error if the tombstone can't be written. The record is removed from the
+ * log in memory regardless.
+ */
+void SegmentLog::remove( const Location &where )
+{
+    Guard guard( lock );
+    Entry *entry = find_entry( where );
+    if( entry == nullptr || entry->removed ) return;
+
+    Segment &segment = segments[where.segment];
+    entry->removed = true;
+    --segment.live_count;
+    segment.live_bytes -= record_size( entry->key.size( ), entry->length );
+
+    if( segment.tombstone_handle == -1 ) {
+        segment.tombstone_handle = openat( directory_handle,
+            segment_name( where.segment, "dead" ).c_str( ),
+            O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600 );
+        if( segment.tombstone_handle == -1 ) log_error( "Can't open log tombstones" );
+    }
+    uint64_t offset = where.offset;
+    if( write( segment.tombstone_handle, &offset, sizeof( offset )) !=
+        static_cast<ssize_t>( sizeof( offset )))
+        log_error( "Can't write log tombstone" );
+}
+
+
+//! Reclaim the space of segments whose records have been removed.
+/*!
+ * Only segments other than the active one, whose records are all durable, are considered. A
+ * segment with no records left is deleted. A segment whose remaining records fill less than a
+ * sixteenth of it has them appended to the active segment first; they are then synchronized
+ * and the segment is deleted. The old locations of the records moved are no longer valid;
+ * anything that refers to them must be updated. Only one thread should call this method.
+ *
+ * \param moved The records that were moved are added to this list, in the order of their old
+ * locations (by segment number, then offset).
+ * \throw std::runtime_error if records can't be moved. The old segments are then kept and no
+ * records are added to moved.
+ */
+void SegmentLog::compact( vector<Relocation> &moved )
+{
+    vector<uint32_t> moving;
+    {
+        Guard guard( lock );
+        for( auto position = segments.begin( ); position != segments.end( ); ) {
+            uint32_t number = position->first;
+            const Segment &segment = position->second;
+            ++position;
+            if( number == active ) continue;
+            if( any_of( segment.entries.begin( ), segment.entries.end( ),
+                    []( const Entry &e ) { return !e.durable; } )) continue;
+
+            if( segment.live_count == 0 )
+                close_segment( number, true );
+            else if( segment.live_bytes * COMPACT_FRACTION < segment.size )
+                moving.push_back( number );
+        }
+    }
+    if( moving.empty( )) return;
+
+    // The segments being moved are not changed by other threads: their records are all
+    // durable, so only remove() (called by the thread that calls this method) would.
+    vector<Record> records;
+    size_t moved_before = moved.size( );
+    for( uint32_t number : moving ) {
+        records.clear( );
+        {
+            Guard guard( lock );
+            for( const Entry &entry : segments[number].entries ) {
+                if( !entry.removed )
+                    records.push_back(
+                        Record{ Location{ number, entry.offset }, entry.length, entry.key } );
+            }
+        }
+        try {
+            for( const Record &record : records ) {
+                moved.push_back(
+                    Relocation{ record.where, append( record.key, get_data( record.where )) } );
+            }
+        }
+        catch( ... ) {
+            moved.resize( moved_before );
+            throw;
+        }
+    }
+    try {
+        sync( );
+    }
+    catch( ... ) {
+        moved.resize( moved_before );
+        throw;
+    }
+
+    Guard guard( lock );
+    for( uint32_t number : moving ) close_segment( number, true );
+}
+
+
+//! Display the size and contents of the log.
+void SegmentLog::report( ostream &output ) const
+{
+    Guard guard( lock );
+    uint64_t total_size = 0;
+    uint64_t live_bytes = 0;
+    size_t   live_count = 0;
+    size_t   dead_count = 0;
+    for( const auto &[number, segment] : segments ) {
+        total_size += segment.size;
+        live_bytes += segment.live_bytes;
+        live_count += segment.live_count;
+        dead_count += segment.entries.size( ) - segment.live_count;
+    }
+    output << "Log segments   : " << segments.size( ) << " (" << total_size / 1024
+           << " KiB, active " << setw( 8 ) << setfill( '0' ) << active << setfill( ' ' )
+           << "), " << removed_segments << " removed\n"
+           << "Log records    : " << live_count << " live (" << live_bytes / 1024 << " KiB), "
+           << dead_count << " removed";
+}
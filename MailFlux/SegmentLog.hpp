@@ -0,0 +1,132 @@
+/*! \file    SegmentLog.hpp
+ *  \brief   Interface to an append-only log of records kept in segment files.
+ *  \author  Peter Chapin <spicacality@kelseymountain.org>
+ */
+
+#ifndef SEGMENTLOG_HPP
+#define SEGMENTLOG_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <pthread.h>
+
+//! Class to represent an append-only log of records.
+/*!
+ * The log is a directory of segment files, numbered in the order they were created. Each
+ * segment is preallocated at its full size when it is created, so appending a record changes
+ * no file system metadata: the record is written at the tail of the newest segment and a later
+ * sync() makes all the records appended since the last one durable with one fdatasync(). A
+ * record is a header holding a magic number, the record's size, and a checksum, followed by the
+ * record's key (a short name) and its data. After a crash the segments are read from the start
+ * and the first record that is incomplete or damaged marks the end of the log.
+ *
+ * Records are never changed once written. A record is removed by appending its offset to the
+ * segment's tombstone file, a small side log. A segment other than the newest one whose records
+ * have all been removed is deleted by compact(), and one with only a few records left has them
+ * copied to the newest segment first. Only records that have been made durable are returned by
+ * get_records().
+ *
+ * The segments are mapped into memory, so the data of a record can be examined in place. The
+ * methods of this class can be called by several threads at the same time.
+ */
+class SegmentLog {
+public:
+    //! Where a record is kept.
+    struct Location {
+        std::uint32_t segment;   //!< Number of the segment.
+        std::uint64_t offset;    //!< Offset of the record's header in the segment.
+    };
+
+    //! A record that has been made durable and has not been removed.
+    struct Record {
+        Location      where;
+        std::uint64_t length;    //!< Size of the record's data.
+        std::string   key;
+    };
+
+    //! A record moved by compact().
+    struct Relocation {
+        Location from;
+        Location to;
+    };
+
+    SegmentLog( const std::string &directory, std::uint64_t segment_size );
+
+    ~SegmentLog( );
+
+    Location append( std::string_view key, std::string_view data );
+
+    Location append_file( std::string_view key, int handle, std::uint64_t length );
+
+    void sync( );
+
+    void get_records( std::vector<Record> &result ) const;
+
+    std::string_view get_data( const Location &where ) const;
+
+    void remove( const Location &where );
+
+    void compact( std::vector<Relocation> &moved );
+
+    void report( std::ostream &output ) const;
+
+private:
+    //! What is known about one record of a segment.
+    struct Entry {
+        std::uint64_t offset;
+        std::uint64_t length;    //!< Size of the data.
+        std::string   key;
+        bool          durable;   //!< True once the record has been synchronized.
+        bool          removed;
+    };
+
+    //! One segment file.
+    struct Segment {
+        int            handle;            //!< The segment file.
+        int            tombstone_handle;  //!< The tombstone file, or -1 if not yet opened.
+        char          *mapping;           //!< The whole segment, mapped read only.
+        std::uint64_t  size;              //!< Size of the segment file.
+        std::uint64_t  tail;              //!< Offset just after the last record.
+        std::vector<Entry> entries;       //!< In order of offset.
+        std::size_t    live_count;        //!< Number of entries not removed.
+        std::uint64_t  live_bytes;        //!< Total size of the entries not removed.
+    };
+
+    std::string   directory;
+    std::uint64_t segment_size;           //!< Size of new segments (unless a record is larger).
+    int           directory_handle;
+
+    mutable pthread_mutex_t lock;         //!< Protects everything below.
+    pthread_mutex_t         sync_lock;    //!< Held by sync() so that calls don't overlap.
+    std::map<std::uint32_t, Segment> segments;
+    std::uint32_t           active;       //!< Number of the segment receiving new records.
+    std::vector<Location>   unsynchronized;  //!< Records appended since the last sync().
+    std::vector<char>       scratch;      //!< Used by append_file().
+    unsigned long           removed_segments;
+
+    std::string segment_name( std::uint32_t number, const char *extension ) const;
+
+    void open_segment( std::uint32_t number );
+
+    void recover_segment( std::uint32_t number, Segment &segment );
+
+    void close_segment( std::uint32_t number, bool remove_files );
+
+    Segment &reserve( std::uint64_t record_size );
+
+    void seal_active( );
+
+    Entry *find_entry( const Location &where );
+
+    // Make copying illegal.
+    SegmentLog( const SegmentLog & );
+
+    SegmentLog &operator=( const SegmentLog & );
+};
+
+#endif
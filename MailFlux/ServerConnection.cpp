@@ -3,11 +3,11 @@
  *  \author  Peter Chapin <spicacality@kelseymountain.org>
  */
 
-#include <cstring>
+#include <charconv>
 #include <sstream>
 #include <stdexcept>
+#include <string>
 
-#include <unistd.h>
 #include "istring.hpp"
 #include "ServerConnection.hpp"
 #include "Console.hpp"
@@ -17,6 +17,8 @@ using namespace std;
 
 namespace {
 
+    const char *const SIZE_EXCEEDED = "552 Message size exceeds fixed maximum message size";
+
     //! Exception for reporting problems with the client's SMTP conversation.
     class BadClientSMTP : public runtime_error {
     public:
@@ -32,24 +34,27 @@ namespace {
      * commands.
      *
      * \param from_sender A line of SMTP text from the sender (client).
-     * \return A string containing just the email address (without the '<' and '>' delimiters).
+     * \return A view of just the email address (without the '<' and '>' delimiters) in the
+     * given line.
      * \throw BadClientSMTP thrown if no email address found on the given line.
      */
-    istring get_email_address( const istring &from_sender )
+    istring_view get_email_address( istring_view from_sender )
     {
-        istring::size_type open_angle = from_sender.find_first_of( '<' );
-        if( open_angle == istring::npos ) {
+        istring_view::size_type open_angle = from_sender.find_first_of( '<' );
+        if( open_angle == istring_view::npos ) {
             throw BadClientSMTP( "Open angle ('<') expected but not found" );
         }
-        istring::size_type close_angle = from_sender.find_last_of( '>' );
-        if( close_angle == istring::npos ) {
+        istring_view::size_type close_angle = from_sender.find_last_of( '>' );
+        if( close_angle == istring_view::npos ) {
             throw BadClientSMTP( "Close angle ('>') expected but not found" );
         }
         if( close_angle < open_angle ) {
             throw BadClientSMTP( "Malformed email address delimiters found" );
         }
-        istring email_address = from_sender.substr( open_angle + 1, close_angle - open_angle - 1 );
-        if( email_address.length( ) < 3 || email_address.find_first_of( '@' ) == istring::npos ) {
+        istring_view email_address =
+            from_sender.substr( open_angle + 1, close_angle - open_angle - 1 );
+        if( email_address.length( ) < 3 ||
+            email_address.find_first_of( '@' ) == istring_view::npos ) {
             throw BadClientSMTP( "Mailformed email address found" );
         }
         return email_address;
@@ -57,41 +62,128 @@ namespace {
 
 }   // End of anonymous namespace.
 
+size_t ServerConnection::maximum_message_size = 10 * 1024 * 1024;
+chrono::seconds ServerConnection::idle_timeout( 300 );
+
+//! The state machine. Built at compile time. See process_line().
+/*!
+ * The reply to a command that is not allowed in the current state is 503, or 500 if the
+ * command is not one MailFlux knows at all. NOOP, HELP, VRFY, EXPN, RSET, and QUIT are allowed
+ * in every state.
+ */
+constexpr ServerConnection::transition_table ServerConnection::transitions = []( )
+{
+    transition_table table{ };
+
+    for( size_t i = 0; i < table.size( ); ++i ) {
+        state current = static_cast<state>( i );
+        for( transition &entry : table[i] ) {
+            entry = { REJECT, "503 Bad sequence of commands", current };
+        }
+        table[i][HELO]  = { REJECT, "500 Syntax error", current };
+        table[i][EHLO]  = { REJECT, "500 Syntax error", current };
+        table[i][OTHER] = { REJECT, "500 Syntax error", current };
+        table[i][NOOP]  = { REPLY, "250 OK", current };
+        // FIXME: Provide real help.
+        table[i][HELP]  = { REPLY, "250 OK", current };
+        table[i][VRFY]  = { REJECT, "502 Command not implemented", current };
+        table[i][EXPN]  = { REJECT, "502 Command not implemented", current };
+        table[i][RSET]  = { RESET, "250 OK", ( current == WEHLO ) ? WEHLO : WMAIL };
+        table[i][QUIT]  = { REPLY, "221 MailFlux service ending", DONE };
+    }
+
+    table[WEHLO][EHLO]     = { EXTENDED_GREETING, nullptr, WMAIL };
+    table[WEHLO][HELO]     = { REPLY, "250 OK", WMAIL };
+    table[WMAIL][MAIL]     = { SET_SENDER, "250 OK", WRCPT1 };
+    table[WRCPT1][RCPT]    = { ADD_RECIPIENT, "250 OK", WRCPT2 };
+    table[WRCPT2][RCPT]    = { ADD_RECIPIENT, "250 OK", WRCPT2 };
+    table[WRCPT2][DATA]    = { START_DATA, "354 Start mail input; end with <CRLF>.<CRLF>",
+                               GETMESSAGE };
+    table[WRCPT2][BDAT]    = { START_CHUNK, nullptr, GETCHUNKS };
+    table[GETCHUNKS][BDAT] = { START_CHUNK, nullptr, GETCHUNKS };
+    return table;
+}( );
+
 // ===============
 // Private Methods
 // ===============
 
-//! Read a line of text from the connection.
-istring ServerConnection::line_in( )
+//! Fold the first four characters of a command into a key, ignoring the case of letters.
+/*!
+ * Clearing bit 5 of each character maps lower case ASCII letters to upper case. It also maps
+ * some other characters onto each other, but never a character that is not a letter onto a
+ * letter, so keys made from the (all letter) SMTP verbs can't be matched by anything else. The
+ * characters are combined in memory order, which allows the compiler to use a single load.
+ *
+ * \param text Points at (at least) four characters.
+ */
+constexpr uint32_t ServerConnection::verb_key( const char *text )
 {
-    istring result;
-
-    while( true ) {
-        if( buffer_index == buffer_size ) {
-            buffer_size = read( socket_handle, buffer, MAX_BUFFER_SIZE );
-            if( buffer_size == 0 || buffer_size == -1 ) break;
-            buffer[buffer_size] = '\0';
-            buffer_index = 0;
-        }
+    return ( static_cast<uint32_t>( static_cast<unsigned char>( text[0] ))       |
+             static_cast<uint32_t>( static_cast<unsigned char>( text[1] )) <<  8 |
+             static_cast<uint32_t>( static_cast<unsigned char>( text[2] )) << 16 |
+             static_cast<uint32_t>( static_cast<unsigned char>( text[3] )) << 24 ) & 0xDFDFDFDF;
+}
 
-        char ch = buffer[buffer_index++];
-        if( ch == '\r' ) continue;
-        if( ch == '\n' ) break;
 
-        result += ch;
+//! Identify the verb of a command.
+/*!
+ * As in earlier versions of MailFlux only the first four characters of the line are examined.
+ */
+ServerConnection::verb ServerConnection::classify( string_view line )
+{
+    if( line.size( ) < 4 ) return OTHER;
+
+    switch( verb_key( line.data( ))) {
+        case verb_key( "HELO" ): return HELO;
+        case verb_key( "EHLO" ): return EHLO;
+        case verb_key( "MAIL" ): return MAIL;
+        case verb_key( "RCPT" ): return RCPT;
+        case verb_key( "DATA" ): return DATA;
+        case verb_key( "BDAT" ): return BDAT;
+        case verb_key( "RSET" ): return RSET;
+        case verb_key( "QUIT" ): return QUIT;
+        case verb_key( "NOOP" ): return NOOP;
+        case verb_key( "HELP" ): return HELP;
+        case verb_key( "VRFY" ): return VRFY;
+        case verb_key( "EXPN" ): return EXPN;
+        default                : return OTHER;
     }
-    return result;
 }
 
 
-//! Write a line of text to the connection.
-void ServerConnection::line_out( const char *line ) const
+//! Carry out the SMTP conversation with the client.
+/*!
+ * The greeting is sent and then each line from the client is passed to the handler for the
+ * current state until the client quits. The contents of BDAT chunks are read as counted data
+ * instead of lines. The coroutine is suspended while waiting for the
+ * client, and after a command whose replies have filled the output buffer.
+ */
+Task<> ServerConnection::run( )
 {
-    if( line == nullptr )
-        throw invalid_argument( "ServerConnection::line_out" );
+    current_state = WEHLO;
+    co_await line_out( "220 MailFlux v0.0" );
 
-    write( socket_handle, line, strlen( line ));
-    write( socket_handle, "\r\n", 2 );
+    while( current_state != DONE ) {
+        if( chunk_remaining > 0 ) {
+            string_view data = co_await read_bytes( chunk_remaining );
+            chunk_remaining -= data.size( );
+            store_chunk( data );
+            if( chunk_remaining == 0 ) end_chunk( );
+        }
+        else {
+            string_view line = co_await line_in( );
+            process_line( line );
+        }
+
+        // The reply to the end of a message waits until the message is durable.
+        if( awaiting_commit ) {
+            co_await wait_event( );
+            awaiting_commit = false;
+            end_message( );
+        }
+        co_await output_space( );
+    }
 }
 
 
@@ -115,266 +207,397 @@ void ServerConnection::error_out( const char *line )
 }
 
 
-//! Returns an "interesting" line of SMTP text.
+//! Send the reply to EHLO.
 /*!
- * This function internally responds to all SMTP commands that can be issued at any time and
- * that don't change the state of the connection.
+ * The reply lists the SMTP extensions supported by MailFlux, one per line (RFC 5321, 4.1.1.1).
+ *
+ * PIPELINING (RFC 2920) needs no further support. Commands that arrive together are taken
+ * from the input buffer one after another without waiting for the client, and their replies are
+ * written together once the buffered input has been processed. See Connection::resume().
+ *
+ * SIZE (RFC 1870) announces the largest message MailFlux accepts.
  */
-istring ServerConnection::get_nontrivial_SMTP( )
+void ServerConnection::reply_to_EHLO( )
 {
-    if( current_state == GETMESSAGE ) return line_in( );
+    const string extensions[] = {
+        "PIPELINING", "CHUNKING", "SIZE " + to_string( maximum_message_size )
+    };
+    const size_t extension_count = sizeof( extensions ) / sizeof( extensions[0] );
 
-    bool interesting_line = false;
-    istring result;
+    line_out( "250-MailFlux" );
+    for( size_t i = 0; i < extension_count; ++i ) {
+        string line = ( i + 1 < extension_count ) ? "250-" : "250 ";
+        line += extensions[i];
+        line_out( line.c_str( ));
+    }
+}
 
-    while( !interesting_line ) {
-        result = line_in( );
-        ostringstream formatter;
-        formatter << "*** client: " << result.c_str( );
-        Console::put_line( formatter.str( ).c_str( ));
 
-        istring verb = result.substr( 0, 4 );
-        if( verb == "NOOP" ) {
-            line_out( "250 OK" );
-        }
-        else if( verb == "HELP" ) {
-            // FIXME: Provide real help.
-            line_out( "250 OK" );
-        }
-        else if( verb == "VRFY" || verb == "EXPN" ) {
-            error_out( "502 Command not implemented" );
+//! Take the email address from a MAIL or RCPT command.
+/*!
+ * \param what SET_SENDER or ADD_RECIPIENT.
+ * \param from_sender The command.
+ * \return true if the address was taken. If false an error reply has been sent.
+ */
+bool ServerConnection::take_address( action what, istring_view from_sender )
+{
+    try {
+        istring_view address = get_email_address( from_sender );
+        if( what == SET_SENDER ) {
+            if( !declared_size_acceptable( from_sender )) return false;
+            email.set_sender( address );
         }
         else {
-            interesting_line = true;
+            // A repeated recipient is accepted, but the message is only delivered to it once.
+            email.add_recipient( address );
         }
+        return true;
+    }
+    catch( const BadClientSMTP &e ) {
+        // Should a CLIENT ERROR message be issued before each syntax error?
+        ostringstream formatter;
+        formatter << "CLIENT ERROR: " << e.what( );
+        Console::put_line( formatter.str( ).c_str( ));
+        error_out( "500 Syntax error" );
+        return false;
     }
-    return result;
 }
 
 
-void ServerConnection::doWEHLO( const istring &from_sender )
+//! Check the size the client declared for its message, if any.
+/*!
+ * The client may give the size of the message with a SIZE parameter after the reverse path in
+ * the MAIL command (RFC 1870). A message that is declared too large is refused right away,
+ * before the client sends any of it.
+ *
+ * \param from_sender The MAIL command.
+ * \return true if the message may be sent. If false an error reply has been sent.
+ */
+bool ServerConnection::declared_size_acceptable( istring_view from_sender )
 {
-    istring verb = from_sender.substr( 0, 4 );
-
-    if( verb == "HELO" || verb == "EHLO" ) {
-        line_out( "250 OK" );
-        current_state = WMAIL;
-    }
-    else if( verb == "QUIT" ) {
-        line_out( "221 MailFlux service ending" );
-        current_state = DONE;
-    }
-    else if( verb == "RSET" ) {
-        line_out( "250 OK" );
+    istring_view::size_type parameters = from_sender.find_last_of( '>' );
+    istring_view::size_type keyword = from_sender.find( " SIZE=", parameters );
+    if( keyword == istring_view::npos ) return true;
+
+    const char *digits = from_sender.data( ) + keyword + 6;
+    const char *line_end = from_sender.data( ) + from_sender.size( );
+    unsigned long long size;
+    from_chars_result result = from_chars( digits, line_end, size );
+    if( result.ptr == digits || ( result.ptr != line_end && *result.ptr != ' ' )) {
+        error_out( "501 Syntax error in parameters" );
+        return false;
     }
-    else if( verb == "MAIL" ||
-             verb == "RCPT" ||
-             verb == "DATA" ) {
-        error_out( "503 Bad sequence of commands" );
-    }
-    else {
-        error_out( "500 Syntax error" );
+    if( result.ec == errc::result_out_of_range || size > maximum_message_size ) {
+        error_out( SIZE_EXCEEDED );
+        return false;
     }
+    return true;
 }
 
 
-void ServerConnection::doWMAIL( const istring &from_sender )
+//! Account for message text received and check it against the maximum message size.
+/*!
+ * When the limit is first exceeded the spool file is abandoned. The rest of the message is
+ * still read from the client, so that the conversation stays in step, but it is discarded as it
+ * arrives. The client is told when the message (or the current chunk) ends.
+ *
+ * \param count The amount of message text just received.
+ * \return true if the message is still within the limit.
+ */
+bool ServerConnection::within_size_limit( size_t count )
 {
-    istring verb = from_sender.substr( 0, 4 );
+    if( message_too_large ) return false;
 
-    if( verb == "MAIL" ) {
-        try {
-            email.set_sender( get_email_address( from_sender ));
-            line_out( "250 OK" );
-            current_state = WRCPT1;
-        }
-        catch( const BadClientSMTP &e ) {
-            // Should a CLIENT ERROR message be issued before each syntax error?
-            ostringstream formatter;
-            formatter << "CLIENT ERROR: " << e.what( );
-            Console::put_line( formatter.str( ).c_str( ));
-            error_out( "500 Syntax error" );
-        }
-    }
-    else if( verb == "QUIT" ) {
-        line_out( "221 MailFlux service ending" );
-        current_state = DONE;
+    if( count <= maximum_message_size - message_size ) {
+        message_size += count;
+        return true;
     }
-    else if( verb == "RSET" ) {
-        email.clear( );
-        line_out( "250 OK" );
+
+    message_too_large = true;
+    spool_file.reset( );
+    Console::put_line( "*** Message exceeds the maximum size; discarding the rest" );
+    return false;
+}
+
+
+//! Begin receiving a chunk of the message.
+/*!
+ * This function handles the BDAT command (RFC 3030). The command gives the size of the chunk
+ * that follows it and optionally the keyword LAST to mark the final chunk of the message.
+ *
+ * \param from_sender The BDAT command.
+ */
+void ServerConnection::start_chunk( istring_view from_sender )
+{
+    const char *line_end = from_sender.data( ) + from_sender.size( );
+    unsigned long long size;
+
+    if( from_sender.size( ) < 6 || from_sender[4] != ' ' ) {
+        error_out( "501 Syntax error in parameters" );
+        return;
     }
-    else if( verb == "RCPT" || verb == "DATA" ) {
-        error_out( "503 Bad sequence of commands" );
+    from_chars_result result = from_chars( from_sender.data( ) + 5, line_end, size );
+    if( result.ec != errc( )) {
+        error_out( "501 Syntax error in parameters" );
+        return;
     }
-    else {
-        error_out( "500 Syntax error" );
+
+    istring_view keyword( result.ptr, line_end - result.ptr );
+    istring_view::size_type keyword_start = keyword.find_first_not_of( ' ' );
+    keyword.remove_prefix( keyword_start == istring_view::npos ? keyword.size( ) : keyword_start );
+    if( !keyword.empty( ) && keyword != "LAST" ) {
+        error_out( "501 Syntax error in parameters" );
+        return;
     }
+
+    // The first chunk of a message opens the spool file. If that fails the chunks are still
+    // read, but discarded.
+    if( current_state != GETCHUNKS ) open_spool_file( );
+
+    // A chunk that takes the message over the limit is known to do so before it arrives.
+    within_size_limit( size );
+
+    chunk_size = chunk_remaining = size;
+    last_chunk = !keyword.empty( );
+    current_state = GETCHUNKS;
+    if( chunk_remaining == 0 ) end_chunk( );
 }
 
 
-void ServerConnection::doWRCPT1( const istring &from_sender )
+//! Add part of a chunk to the message.
+/*!
+ * Chunks are not dot-stuffed and need no processing at all. They are copied to the spool file
+ * exactly as received.
+ */
+void ServerConnection::store_chunk( string_view data )
 {
-    istring verb = from_sender.substr( 0, 4 );
+    if( spool_file == nullptr ) return;
 
-    if( verb == "RCPT" ) {
-        try {
-            email.add_recipient( get_email_address( from_sender ));
-            line_out( "250 OK" );
-            current_state = WRCPT2;
-        }
-        catch( const BadClientSMTP &e ) {
-            ostringstream formatter;
-            formatter << "CLIENT ERROR: " << e.what( );
-            Console::put_line( formatter.str( ).c_str( ));
-            error_out( "500 Syntax error" );
-        }
+    try {
+        spool_file->append( data );
     }
-    else if( verb == "QUIT" ) {
-        line_out( "221 MailFlux service ending" );
-        current_state = DONE;
+    catch( const Spool::SpoolError &e ) {
+        spool_failed( e );
     }
-    else if( verb == "RSET" ) {
-        email.clear( );
-        line_out( "250 OK" );
-        current_state = WMAIL;
+}
+
+
+//! Acknowledge a completely received chunk and, after the last one, spool the message.
+void ServerConnection::end_chunk( )
+{
+    if( last_chunk ) {
+        finish_message( );
     }
-    else if( verb == "MAIL" || verb == "DATA" ) {
-        error_out( "503 Bad sequence of commands" );
+    else if( message_too_large ) {
+        error_out( SIZE_EXCEEDED );
     }
     else {
-        error_out( "500 Syntax error" );
+        ostringstream formatter;
+        formatter << "250 " << chunk_size << " octets received";
+        line_out( formatter.str( ).c_str( ));
     }
 }
 
 
-void ServerConnection::doWRCPT2( const istring &from_sender )
+//! Begin writing the message text to the spool.
+/*!
+ * \return true if successful; false if the spool file can't be created.
+ */
+bool ServerConnection::open_spool_file( )
 {
-    istring verb = from_sender.substr( 0, 4 );
-
-    if( verb == "RCPT" ) {
-        try {
-            email.add_recipient( get_email_address( from_sender ));
-            line_out( "250 OK" );
-        }
-        catch( const BadClientSMTP &e ) {
-            ostringstream formatter;
-            formatter << "CLIENT ERROR: " << e.what( );
-            Console::put_line( formatter.str( ).c_str( ));
-            error_out( "500 Syntax error" );
-        }
+    message_size = 0;
+    message_too_large = false;
+    try {
+        spool_file = make_unique<Spool::MessageWriter>( email );
+        return true;
     }
-    else if( verb == "QUIT" ) {
-        line_out( "221 MailFlux service ending" );
-        current_state = DONE;
+    catch( const Spool::SpoolError &e ) {
+        spool_failed( e );
+        return false;
     }
-    else if( verb == "RSET" ) {
-        email.clear( );
-        line_out( "250 OK" );
-        current_state = WMAIL;
-    }
-    else if( verb == "DATA" ) {
-        line_out( "354 Start mail input; end with <CRLF>.<CRLF>" );
-        current_state = GETMESSAGE;
+}
+
+
+//! Abandon the spool file after an error. The rest of the message text is discarded.
+void ServerConnection::spool_failed( const exception &e )
+{
+    Console::put_exception_line( e.what( ));
+    spool_file.reset( );
+}
+
+
+//! Begin to commit the completely received message to the spool.
+/*!
+ * If the commit can't be completed at once the conversation waits for it (see run()) before
+ * end_message() replies to the client. The client's input is not read in the meantime.
+ */
+void ServerConnection::finish_message( )
+{
+    if( message_too_large ) {
+        error_out( SIZE_EXCEEDED );
+        spool_file.reset( );
+        current_state = WQUIT;
+        return;
     }
-    else if( verb == "MAIL" ) {
-        error_out( "503 Bad sequence of commands" );
+
+    try {
+        if( spool_file != nullptr && spool_file->start_commit( this )) {
+            awaiting_commit = true;
+            return;
+        }
     }
-    else {
-        error_out( "500 Syntax error" );
+    catch( const Spool::SpoolError &e ) {
+        spool_failed( e );
     }
+    end_message( );
 }
 
 
-void ServerConnection::doGETMESSAGE( const istring &from_sender )
+//! Reply to the client once its message has been committed, or has failed to be.
+void ServerConnection::end_message( )
 {
-    if( from_sender == "." ) {
-        Spool::add_message( email );
-        line_out( "250 OK" );
-        current_state = WQUIT;
+    try {
+        if( spool_file == nullptr )
+            throw Spool::SpoolError( "Message text was not spooled" );
+        spool_file->finish_commit( );
+        string reply = "250 OK queued as " + spool_file->get_queue_id( );
+        line_out( reply );
     }
-    else {
-        email.append_text( from_sender );
+    catch( const Spool::SpoolError &e ) {
+        Console::put_exception_line( e.what( ));
+        error_out( "451 Requested action aborted: local error in processing" );
     }
+    spool_file.reset( );
+    current_state = WQUIT;
 }
 
 
-void ServerConnection::doWQUIT( const istring &from_sender )
+//! Advance the SMTP state machine by one line of client text.
+/*!
+ * Message text is handled directly from the input buffer. Commands are looked up in the state
+ * transition table. Commands are examined in place as views of the input buffer. Only the
+ * addresses in MAIL and RCPT commands are copied, into the message envelope.
+ */
+void ServerConnection::process_line( string_view line )
 {
-    istring verb = from_sender.substr( 0, 4 );
+    if( current_state == GETMESSAGE ) {
+        doGETMESSAGE( line );
+        return;
+    }
 
-    if( verb == "QUIT" ) {
-        line_out( "221 MailFlux service ending" );
-        current_state = DONE;
+    ostringstream formatter;
+    formatter << "*** client: " << line;
+    Console::put_line( formatter.str( ).c_str( ));
+
+    istring_view command( line.data( ), line.size( ));
+    const transition &step = transitions[current_state][classify( line )];
+    switch( step.what ) {
+        case REPLY:
+            line_out( step.reply );
+            break;
+        case REJECT:
+            error_out( step.reply );
+            return;
+        case EXTENDED_GREETING:
+            reply_to_EHLO( );
+            break;
+        case RESET:
+            email.clear( );
+            spool_file.reset( );
+            line_out( step.reply );
+            break;
+        case SET_SENDER:
+        case ADD_RECIPIENT:
+            if( !take_address( step.what, command )) return;
+            line_out( step.reply );
+            break;
+        case START_DATA:
+            if( !open_spool_file( )) {
+                error_out( "451 Requested action aborted: local error in processing" );
+                return;
+            }
+            line_out( step.reply );
+            break;
+        case START_CHUNK:
+            start_chunk( command );
+            return;
     }
-    else if( verb == "RSET" ) {
-        email.clear( );
-        line_out( "250 OK" );
-        current_state = WMAIL;
+    current_state = step.next;
+}
+
+
+void ServerConnection::doGETMESSAGE( string_view from_sender )
+{
+    if( from_sender == "." ) {
+        finish_message( );
+        return;
     }
-    else if( verb == "MAIL" || verb == "RCPT" || verb == "DATA" ) {
-        error_out( "503 Bad sequence of commands" );
+
+    // Remove the transparency period added by the client (RFC 5321, 4.5.2).
+    if( !from_sender.empty( ) && from_sender[0] == '.' ) from_sender.remove_prefix( 1 );
+
+    // Each line is stored with its CR LF terminator.
+    if( !within_size_limit( from_sender.size( ) + 2 ) || spool_file == nullptr ) return;
+    try {
+        spool_file->append_line( from_sender );
     }
-    else {
-        error_out( "500 Syntax error" );
+    catch( const Spool::SpoolError &e ) {
+        spool_failed( e );
     }
 }
 
+
+//! Tell the client why the connection is being closed. See Connection::time_out().
+/*!
+ * A message in progress is abandoned; its spool file is removed when the object is destroyed.
+ */
+void ServerConnection::timed_out( )
+{
+    line_out( "421 Timeout exceeded, closing connection" );
+}
+
+
 // ==============
 // Public Methods
 // ==============
 
 //! Construct the object.
 /*!
- * The constructor initializes SMTP state variables as well as the buffers used to hold the raw
- * data on the connection. This class assumes a connection with the client has been previously
- * established.
+ * The constructor initializes SMTP state variables. This class assumes a connection with the
+ * client has been previously established.
  *
  * \param handle The socket handle of the connection with the client.
  */
-ServerConnection::ServerConnection( int handle )
+ServerConnection::ServerConnection( int handle ) :
+    Connection( handle )
 {
-    if( handle < 0 )
-        throw invalid_argument( "ServerConnection::ServerConnection" );
+    current_state = WEHLO;
+    message_size = 0;
+    message_too_large = false;
+    chunk_size = 0;
+    chunk_remaining = 0;
+    last_chunk = false;
+    awaiting_commit = false;
+    set_timeout( idle_timeout );
+}
+
 
-    buffer_size = 0;
-    buffer_index = 0;
-    socket_handle = handle;
+//! Set the size of the largest message accepted by connections.
+/*!
+ * The size is announced to clients with the SIZE extension (RFC 1870). It is measured as the
+ * amount of message text, with CR LF line terminators, after the removal of dot-stuffing.
+ */
+void ServerConnection::set_maximum_message_size( size_t size )
+{
+    maximum_message_size = size;
 }
 
 
-//! Have an SMTP conversation with the client.
+//! Set the time limit on each wait for the client, for connections created from now on.
 /*!
- * This method executes the full SMTP conversation with the client, accepting as many mail
- * messages as the client wants.
-*/
-void ServerConnection::doSMTP( )
+ * RFC 5321, 4.5.3.2.7 asks for at least five minutes.
+ */
+void ServerConnection::set_idle_timeout( chrono::seconds limit )
 {
-    line_out( "220 MailFlux v0.0" );
-    current_state = WEHLO;
-    while( current_state != DONE ) {
-        istring from_sender = get_nontrivial_SMTP( );
-        switch( current_state ) {
-            case WEHLO     :
-                doWEHLO( from_sender );
-                break;
-            case WMAIL     :
-                doWMAIL( from_sender );
-                break;
-            case WRCPT1    :
-                doWRCPT1( from_sender );
-                break;
-            case WRCPT2    :
-                doWRCPT2( from_sender );
-                break;
-            case GETMESSAGE:
-                doGETMESSAGE( from_sender );
-                break;
-            case WQUIT     :
-                doWQUIT( from_sender );
-                break;
-            case DONE      :
-                break;
-        }
-    }
+    idle_timeout = limit;
 }
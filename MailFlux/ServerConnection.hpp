@@ -6,55 +6,122 @@
 #ifndef SERVERCONNECTION_HPP
 #define SERVERCONNECTION_HPP
 
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <string_view>
+#include "Connection.hpp"
 #include "Message.hpp"
+#include "Spool.hpp"
 #include "istring.hpp"
 
 //! Class to represent a server-oriented endpoint.
 /*!
- * Instances of this class are execute a server side SMTP conversation with a given client.
- * \todo Provide more details.
+ * Instances of this class are execute a server side SMTP conversation with a given client. The
+ * conversation is a coroutine that reads each command with line_in() and looks up what to do
+ * with it in a table indexed by the current state and the command's verb. It is resumed by an
+ * event loop whenever more of the client's input arrives. See Connection.hpp and Reactor.hpp.
+ *
+ * A client that leaves the server waiting, for a command or for room to send a reply, for longer
+ * than the idle timeout is sent a 421 reply and the connection is closed.
  */
-class ServerConnection {
+class ServerConnection : public Connection {
 public:
     explicit ServerConnection( int handle );
 
-    ~ServerConnection( ) = default;
+    static void set_maximum_message_size( std::size_t size );
 
-    void doSMTP( );
+    static void set_idle_timeout( std::chrono::seconds limit );
+
+    //! The commands the server recognizes.
+    enum verb {
+        HELO, EHLO, MAIL, RCPT, DATA, BDAT, RSET, QUIT, NOOP, HELP, VRFY, EXPN, OTHER, VERB_COUNT
+    };
+
+    static verb classify( std::string_view line );
 
 private:
     enum state {
-        WEHLO, WMAIL, WRCPT1, WRCPT2, GETMESSAGE, WQUIT, DONE
+        WEHLO, WMAIL, WRCPT1, WRCPT2, GETMESSAGE, GETCHUNKS, WQUIT, DONE
+    };
+
+    //! What is done with a command, in addition to changing state.
+    enum action {
+        REPLY,              //!< Send the reply.
+        REJECT,             //!< Send the (error) reply and stay in the current state.
+        EXTENDED_GREETING,  //!< Send the reply to EHLO.
+        RESET,              //!< Abandon the current transaction and send the reply.
+        SET_SENDER,         //!< Take the sender's address, then send the reply.
+        ADD_RECIPIENT,      //!< Take a recipient's address, then send the reply.
+        START_DATA,         //!< Open the spool file, then send the reply.
+        START_CHUNK         //!< Begin receiving a BDAT chunk. Sets the state itself.
     };
 
-    static const int MAX_BUFFER_SIZE = 128;
-    char    buffer[MAX_BUFFER_SIZE + 1]; //!< Holds raw text from the client.
-    ssize_t buffer_size;                 //!< Amount of valid text in buffer.
-    int     buffer_index;                //!< "Current point" in buffer.
-    int     socket_handle;               //!< Client socket.
-    state   current_state;               //!< Current state of the SMTP transaction.
-    Message email;                       //!< Accumulating email message.
+    //! An entry of the state transition table.
+    struct transition {
+        action      what;
+        const char *reply;
+        state       next;   //!< The new state if the action succeeds.
+    };
+
+    using transition_table = std::array<std::array<transition, VERB_COUNT>, DONE + 1>;
+
+    static const transition_table transitions;
+
+    static std::size_t maximum_message_size;  //!< Largest message accepted (RFC 1870).
+    static std::chrono::seconds idle_timeout;  //!< Longest wait for the client.
+
+    state       current_state;           //!< Current state of the SMTP transaction.
 
-    istring line_in( );
+    Message     email;                   //!< The envelope of the message being received.
 
-    void line_out( const char *line ) const;
+    //! The spool file receiving the message text. Null if there is none or it failed.
+    std::unique_ptr<Spool::MessageWriter> spool_file;
+    std::size_t message_size;            //!< Amount of message text received so far.
+    bool        message_too_large;       //!< True if message_size exceeds the maximum.
+    bool        awaiting_commit;         //!< True while the message is being made durable.
+
+    // BDAT (RFC 3030) support.
+    std::size_t chunk_size;              //!< Size of the current chunk.
+    std::size_t chunk_remaining;         //!< Amount of the current chunk not yet received.
+    bool        last_chunk;              //!< True if the current chunk ends the message.
+
+    Task<> run( ) override;
 
     void error_out( const char *line );
 
-    istring get_nontrivial_SMTP( );
+    static constexpr std::uint32_t verb_key( const char *text );
+
+    void reply_to_EHLO( );
+
+    bool take_address( action what, istring_view from_sender );
+
+    bool declared_size_acceptable( istring_view from_sender );
+
+    bool within_size_limit( std::size_t count );
+
+    void start_chunk( istring_view from_sender );
+
+    void store_chunk( std::string_view data );
+
+    void end_chunk( );
+
+    bool open_spool_file( );
 
-    // These functions handle the various SMTP states.
-    void doWEHLO( const istring & );
+    void spool_failed( const std::exception &e );
 
-    void doWMAIL( const istring & );
+    void finish_message( );
 
-    void doWRCPT1( const istring & );
+    void end_message( );
 
-    void doWRCPT2( const istring & );
+    void process_line( std::string_view line );
 
-    void doGETMESSAGE( const istring & );
+    void doGETMESSAGE( std::string_view );
 
-    void doWQUIT( const istring & );
+    void timed_out( ) override;
 
     // Make copying illegal.
     ServerConnection( const ServerConnection & );
@@ -4,10 +4,22 @@
  */
 
 // Standard C++
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
 #include <ctime>
+#include <deque>
 #include <fstream>
 #include <iostream>
 #include <iomanip>
+#include <memory>
+#include <random>
 #include <sstream>
 // #include <string>
 #include <string.h>   // Clang 3.0 does not see memset and memcpy in <string>
@@ -16,9 +28,12 @@
 // POSIX
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 #include <netinet/in.h>
 #include <dirent.h>
 #include <netdb.h>
+#include <poll.h>
 #include <pthread.h>
 #include <unistd.h>
 
@@ -26,73 +41,533 @@
 #include "ClientConnection.hpp"
 #include "config.hpp"
 #include "Console.hpp"
+#include "MimeParser.hpp"
+#include "Reactor.hpp"
+#include "SegmentLog.hpp"
 #include "Spool.hpp"
+#include "SpoolRecord.hpp"
 
 using namespace std;
 
 // Anonymous namespace for module private items.
 namespace {
     string spool_directory;
-    pthread_mutex_t spool_lock = PTHREAD_MUTEX_INITIALIZER;
 
+    //! Size of the buffer used when writing a message file.
+    const size_t WRITE_BUFFER_SIZE = 64 * 1024;
+
+    //! Number of subdirectories that message files are spread over.
+    const unsigned BUCKET_COUNT = 256;
+
+    //! Subdirectory of the spool where messages are written before they are committed.
+    const char *const TEMPORARY_DIRECTORY = "tmp";
+
+    //! Subdirectory of the spool that holds the message log.
+    const char *const LOG_DIRECTORY = "log";
+
+    //! Default size of the message log's segment files. See the SEGMENT_SIZE parameter.
+    const uint64_t DEFAULT_SEGMENT_SIZE = 64 * 1024 * 1024;
+
+    // Open handles of the spool's subdirectories. They are never closed.
+    int temporary_handle = -1;
+    int bucket_handles[BUCKET_COUNT];
+
+    //! The message log if SPOOL_BACKEND=log, otherwise null (each message has a file).
+    SegmentLog *message_log = nullptr;
+
+    //! Number of characters in a queue ID.
+    const size_t QUEUE_ID_LENGTH = 22;
+
+    //! Most parts of a message that describe() lists.
+    const size_t MAX_DESCRIBED_PARTS = 8;
+
+    //! Distinguishes the queue IDs of this process from those of others that share the spool.
+    unsigned shard_id = 0;
+
+    //! Advanced for each queue ID made by this process.
+    atomic<unsigned long> queue_sequence( 0 );
+
+    //! How messages are made durable. See the SPOOL_SYNC parameter.
+    enum sync_mode { SYNC_GROUP, SYNC_MESSAGE };
+    sync_mode spool_sync = SYNC_GROUP;
+
+    // The group commit queue. Messages are added by MessageWriter::start_commit() and taken in
+    // groups by the committer thread. See Spool::Committer.
+    pthread_mutex_t commit_lock = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t  commit_arrived;       //!< Signalled when a message is added.
+    pthread_cond_t  commit_done = PTHREAD_COND_INITIALIZER;  //!< Broadcast after each group.
+    vector<Spool::MessageWriter *> commit_queue;
+    long   group_window = 0;              //!< Microseconds a group waits for more messages.
+    size_t group_limit  = 64;             //!< Largest number of messages in a group.
+
+    //! A message in the spool.
+    struct SpooledMessage {
+        string               name;    //!< The message file, or the queue ID of the log record.
+        SegmentLog::Location where;   //!< The log record. Used only with the message log.
+    };
+
+    //! A message waiting to be delivered.
+    struct QueueEntry {
+        chrono::steady_clock::time_point due;       //!< When the next attempt may be made.
+        chrono::system_clock::time_point arrived;   //!< When the message entered the spool.
+        unsigned                         attempts;  //!< Number of failed attempts so far.
+        SpooledMessage                   message;
+
+        //! The recipients that have been delivered to or returned. Empty before the first
+        //! attempt, which is made to every recipient.
+        vector<bool>                     finished;
+    };
+
+    //! A recipient that a message is being returned for.
+    struct Failure {
+        size_t recipient;   //!< The recipient's index in the spool record.
+        string reason;      //!< Why the message couldn't be delivered to the recipient.
+    };
+
+    //! Order queue entries so that the heap has the entry due first at its front.
+    bool due_later( const QueueEntry &left, const QueueEntry &right )
+    {
+        return left.due > right.due;
+    }
+
+    // The delivery queues. New messages are added to the active queue by schedule() and are
+    // delivered in the order they arrive. A message that can't be delivered is moved to the
+    // deferred queue, a heap ordered by when each message is next due, and back to the active
+    // queue when it is due. The messages are taken from both by the spool thread.
+    pthread_mutex_t    queue_lock = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t     queue_changed;     //!< Signalled when the active queue stops being empty.
+    deque<QueueEntry>  active_queue;
+    vector<QueueEntry> deferred_queue;
+
+    // How failed deliveries are retried. See the RETRY_INTERVAL, MAX_RETRY_INTERVAL, and
+    // MAX_QUEUE_LIFETIME parameters.
+    chrono::seconds retry_interval( 60 );           //!< Delay after the first failure.
+    chrono::seconds max_retry_interval( 3600 );     //!< Longest delay between attempts.
+    chrono::seconds max_queue_lifetime( 432000 );   //!< Age at which a message is returned.
+
+    //! Longest wait for a connection to the next server. See CONNECT_TIMEOUT.
+    chrono::seconds connect_timeout( 30 );
+
+    //! Counts of values in power of two ranges. Updated by several threads without locking.
+    class Histogram {
+    public:
+        //! Count a value. Zero is counted in the first range.
+        void record( unsigned long value )
+        {
+            size_t index = min( static_cast<size_t>( bit_width( value )), RANGES - 1 );
+            counts[index].fetch_add( 1, memory_order_relaxed );
+        }
+
+        void report( ostream &output, const char *unit ) const;
+
+    private:
+        static const size_t RANGES = 24;
+        atomic<unsigned long> counts[RANGES] = { };  //!< Range i holds [2^(i-1), 2^i).
+    };
+
+    //! Display the ranges that have been counted, one per line.
+    void Histogram::report( ostream &output, const char *unit ) const
+    {
+        for( size_t i = 0; i < RANGES; ++i ) {
+            unsigned long count = counts[i].load( memory_order_relaxed );
+            if( count == 0 ) continue;
+
+            unsigned long low = ( i == 0 ) ? 0 : 1UL << ( i - 1 );
+            output << "\n  " << setw( 8 ) << low << " - ";
+            if( i == RANGES - 1 )
+                output << setw( 8 ) << "...";
+            else
+                output << setw( 8 ) << ( 1UL << i ) - 1;
+            output << " " << unit << ": " << count;
+        }
+    }
+
+    Histogram commit_latency;   //!< Microseconds from start_commit() until a message is durable.
+    Histogram group_sizes;      //!< Messages in each group commit.
+    atomic<unsigned long> durable_messages( 0 );
+    atomic<unsigned long> commit_groups( 0 );
+
+    //! Account for a message that has been made durable.
+    void record_commit( chrono::steady_clock::time_point start )
+    {
+        auto latency = chrono::steady_clock::now( ) - start;
+        commit_latency.record( static_cast<unsigned long>(
+            chrono::duration_cast<chrono::microseconds>( latency ).count( )));
+        durable_messages.fetch_add( 1, memory_order_relaxed );
+    }
+
+
+    //! Display the commit statistics. This is the console's "spool" command.
+    string spool_command( )
+    {
+        unsigned long messages = durable_messages.load( memory_order_relaxed );
+        unsigned long groups   = commit_groups.load( memory_order_relaxed );
+
+        ostringstream formatter;
+        formatter << "Backend        : " << ( message_log != nullptr ? "log\n" : "directory\n" );
+        if( message_log != nullptr ) {
+            message_log->report( formatter );
+            formatter << "\n";
+        }
+        formatter << "Sync mode      : ";
+        if( spool_sync == SYNC_GROUP )
+            formatter << "group (window " << group_window << " us, at most " << group_limit
+                      << " messages)\n";
+        else
+            formatter << "message\n";
+        formatter << "Durable        : " << messages << " messages";
+        if( groups != 0 )
+            formatter << " in " << groups << " groups ("
+                      << static_cast<double>( messages ) / groups << " per group)";
+        pthread_mutex_lock( &queue_lock );
+        formatter << "\nQueued         : " << active_queue.size( ) << " active, "
+                  << deferred_queue.size( ) << " deferred";
+        pthread_mutex_unlock( &queue_lock );
+        formatter << "\nCommit latency :";
+        commit_latency.report( formatter, "us" );
+        if( spool_sync == SYNC_GROUP ) {
+            formatter << "\nGroup sizes    :";
+            group_sizes.report( formatter, "messages" );
+        }
+        return formatter.str( );
+    }
+
+    //! Read the start of a file, or all of it, into a string.
     /*!
-     * Converts istrings to std::strings. It shouldn't be necessary to copy an istring just to
-     * treat it like a standard string (for purposes of I/O). I'm not sure how to best handle
-     * this. Do I have to make a special instantiation of the basic_ostream?
+     * \param file_name The name of the file.
+     * \param contents The text read. Its previous contents are replaced.
+     * \param limit The most characters to read.
+     * \return false if the file can't be read.
      */
-    std::string to_string( const istring &is )
+    bool read_file( const string &file_name, string &contents, size_t limit = SIZE_MAX )
     {
-        std::string result;
+        ifstream input( file_name.c_str( ), ios::binary );
+        if( !input ) return false;
 
-        for( char i : is ) {
-            result.push_back( i );
+        contents.clear( );
+        char chunk[4096];
+        while( contents.size( ) < limit &&
+               input.read( chunk, min( sizeof( chunk ), limit - contents.size( ))).gcount( ) > 0 ) {
+            contents.append( chunk, static_cast<size_t>( input.gcount( )));
         }
-        return result;
+        return !input.bad( );
     }
 
 
+    //! Make a queue ID that no other message in the spool has or will have.
     /*!
-     * Converts std::sgtrings to istrings. It shouldn't be necessary to copy a std::string just
-     * to treat it like an istring (for purposes of I/O). I'm not sure how to best handle this.
-     * Do I have to make a special instantiation of the basic_istream?
+     * A queue ID is 22 hexadecimal digits: the time in microseconds (14), the low bits of a
+     * sequence number that each call of this function in the process advances (6), and the
+     * shard ID of the process (2). The sequence number is atomic, so connection threads make
+     * IDs without locking and without calling the non-reentrant time functions. IDs sort in the
+     * order they were made.
+     *
+     * Two IDs made by one process can only be equal if more than 2^24 are made in the same
+     * microsecond. Processes that share a spool must be given different shard IDs. In case the
+     * clock is set back, commit() also refuses to replace an existing file.
      */
-    istring to_istring( const string &s )
+    string make_queue_id( )
     {
-        istring result;
+        timespec now;
+        clock_gettime( CLOCK_REALTIME, &now );
+        unsigned long long microseconds =
+            static_cast<unsigned long long>( now.tv_sec ) * 1000000ULL + now.tv_nsec / 1000;
+        unsigned long sequence = queue_sequence.fetch_add( 1, memory_order_relaxed ) & 0xFFFFFFUL;
+
+        char id[QUEUE_ID_LENGTH + 1];
+        snprintf( id, sizeof( id ), "%014llX%06lX%02X", microseconds, sequence, shard_id );
+        return id;
+    }
 
-        for( char i : s ) {
-            result.push_back( i );
+
+    //! Return the number of the subdirectory where the message with the given name is kept.
+    /*!
+     * The subdirectory is chosen by a hash of the message's name so that the messages are spread
+     * evenly over BUCKET_COUNT directories no matter when they arrive.
+     */
+    unsigned bucket_of( const string &message_name )
+    {
+        // FNV-1a, folded to eight bits.
+        uint32_t hash = 2166136261U;
+        for( char c : message_name ) {
+            hash ^= static_cast<unsigned char>( c );
+            hash *= 16777619U;
+        }
+        return ( hash ^ ( hash >> 8 ) ^ ( hash >> 16 ) ^ ( hash >> 24 )) % BUCKET_COUNT;
+    }
+
+
+    //! Return the path of a spool subdirectory.
+    string bucket_path( unsigned bucket )
+    {
+        char name[3];
+        snprintf( name, sizeof( name ), "%02x", bucket );
+        return spool_directory + "/" + name;
+    }
+
+
+    //! Return the path of the file holding the message with the given name.
+    string message_path( const string &message_name )
+    {
+        return bucket_path( bucket_of( message_name )) + "/" + message_name;
+    }
+
+
+    //! Rename a file unless a file with the new name already exists.
+    /*!
+     * The names are relative to the given directory handles, as for renameat().
+     *
+     * \return 0 if successful; otherwise -1 with errno set. If the new name exists errno is
+     * EEXIST.
+     */
+    int rename_new(
+        int old_directory, const string &old_name, int new_directory, const string &new_name )
+    {
+        int result = renameat2(
+            old_directory, old_name.c_str( ), new_directory, new_name.c_str( ), RENAME_NOREPLACE );
+        if( result == -1 && ( errno == EINVAL || errno == ENOSYS )) {
+            // The file system can't do it atomically. Hard links never replace anything.
+            result = linkat(
+                old_directory, old_name.c_str( ), new_directory, new_name.c_str( ), 0 );
+            if( result == 0 ) unlinkat( old_directory, old_name.c_str( ), 0 );
         }
         return result;
     }
 
 
-    //! Reads a single message out of the spool and prepares a Message object.
-    Message read_message( const string &file_name )
+    //! Open a directory, creating it if necessary, and return its handle.
+    int open_directory( const string &path )
+    {
+        if( mkdir( path.c_str( ), 0700 ) == -1 && errno != EEXIST )
+            throw Spool::SpoolError( "Can't create spool subdirectory" );
+        int handle = open( path.c_str( ), O_RDONLY | O_DIRECTORY | O_CLOEXEC );
+        if( handle == -1 ) throw Spool::SpoolError( "Can't open spool subdirectory" );
+        return handle;
+    }
+
+
+    //! Remove all the files in a directory.
+    void empty_directory( const string &path )
     {
-        Message result;
-        ifstream input( file_name.c_str( ));
-        string line;
+        DIR *scan_state = opendir( path.c_str( ));
+        if( scan_state == nullptr ) return;
+
+        dirent *directory_entry;
+        while(( directory_entry = readdir( scan_state )) != nullptr ) {
+            if( directory_entry->d_name[0] == '.' ) continue;
+            unlink(( path + "/" + directory_entry->d_name ).c_str( ));
+        }
+        closedir( scan_state );
+    }
 
-        if( !input ) throw Spool::SpoolError( "Can't open message file" );
 
-        // FIXME: This should be made more robust against file format errors.
+    //! Rewrite the message files of earlier versions of MailFlux as spool records.
+    /*!
+     * Each file in the text form is converted with SpoolRecord::convert_text() into a temporary
+     * file, which then replaces it. The replacements are made durable before this function
+     * returns. A file that is already a spool record is left as it is.
+     */
+    void convert_message_files( )
+    {
+        string contents;
+        string record;
+        size_t converted = 0;
+        for( unsigned i = 0; i < BUCKET_COUNT; ++i ) {
+            string directory = bucket_path( i );
+            DIR *scan_state = opendir( directory.c_str( ));
+            if( scan_state == nullptr ) continue;
 
-        // Get the sender.
-        getline( input, line );
-        result.set_sender( to_istring( line ));
-        getline( input, line );
+            dirent *directory_entry;
+            while(( directory_entry = readdir( scan_state )) != nullptr ) {
+                string name = directory_entry->d_name;
+                string path = directory + "/" + name;
+                if( name[0] == '.' ||
+                    !read_file( path, contents, sizeof( SpoolRecord::Header )) ||
+                    SpoolRecord::is_record( contents ) ||
+                    !read_file( path, contents )) continue;
 
-        // Get the recipient list.
-        while( getline( input, line ) && line != "=====" ) {
-            result.add_recipient( to_istring( line ));
+                SpoolRecord::convert_text( contents, record );
+                string temporary_name = name + ".tmp";
+                int handle = openat( temporary_handle,
+                    temporary_name.c_str( ), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600 );
+                bool written = ( handle != -1 &&
+                    write( handle, record.data( ), record.size( )) ==
+                        static_cast<ssize_t>( record.size( )) &&
+                    fsync( handle ) == 0 );
+                if( handle != -1 ) close( handle );
+                if( !written || renameat( temporary_handle,
+                        temporary_name.c_str( ), bucket_handles[i], name.c_str( )) == -1 ) {
+                    unlinkat( temporary_handle, temporary_name.c_str( ), 0 );
+                    ostringstream formatter;
+                    formatter << "Can't convert '" << path << "' to a spool record";
+                    Console::put_exception_line( formatter.str( ).c_str( ));
+                    continue;
+                }
+                ++converted;
+            }
+            closedir( scan_state );
         }
+        if( converted == 0 ) return;
 
-        // Get the message text.
-        while( getline( input, line )) {
-            result.append_text( to_istring( line ));
+        if( syncfs( temporary_handle ) == -1 ) throw Spool::SpoolError( "Can't write spool" );
+        ostringstream formatter;
+        formatter << "Converted " << converted << " message files to spool records";
+        Console::put_debug_line( formatter.str( ).c_str( ));
+    }
+
+
+    //! Prepare the spool directory for use.
+    /*!
+     * The subdirectories are created if they don't exist and opened. Temporary message files
+     * left behind by an earlier run are removed. Message files in the spool directory itself,
+     * from a version of MailFlux that did not use subdirectories, are moved into their
+     * subdirectories. If the spool uses a message log the subdirectories are not needed; see
+     * import_message_files().
+     */
+    void prepare_spool_directory( )
+    {
+        string temporary_path = spool_directory + "/" + TEMPORARY_DIRECTORY;
+        empty_directory( temporary_path );
+        temporary_handle = open_directory( temporary_path );
+        if( message_log != nullptr ) return;
+
+        for( unsigned i = 0; i < BUCKET_COUNT; ++i ) {
+            bucket_handles[i] = open_directory( bucket_path( i ));
+        }
+
+        DIR *scan_state = opendir( spool_directory.c_str( ));
+        if( scan_state == nullptr ) throw Spool::SpoolError( "Can't scan spool directory" );
+
+        dirent *directory_entry;
+        while(( directory_entry = readdir( scan_state )) != nullptr ) {
+            string name = directory_entry->d_name;
+            if( name.size( ) <= 4 ) continue;
+            string path = spool_directory + "/" + name;
+            if( name[0] == '.' ) {
+                if( name.compare( name.size( ) - 4, 4, ".tmp" ) == 0 ) unlink( path.c_str( ));
+            }
+            else if( name.compare( name.size( ) - 4, 4, ".msg" ) == 0 ) {
+                if( rename_new( AT_FDCWD, path, AT_FDCWD, message_path( name )) == -1 ) {
+                    ostringstream formatter;
+                    formatter << "Can't move '" << path << "' into a spool subdirectory";
+                    Console::put_exception_line( formatter.str( ).c_str( ));
+                }
+            }
+        }
+        closedir( scan_state );
+        convert_message_files( );
+    }
+
+
+    //! Move message files into the message log.
+    /*!
+     * Messages left in files by a run that did not use the message log (in the spool directory
+     * itself or in its subdirectories) are appended to the log, as spool records. The files are
+     * removed once the log has been synchronized.
+     */
+    void import_message_files( )
+    {
+        vector<string> file_names;
+        for( int i = -1; i < static_cast<int>( BUCKET_COUNT ); ++i ) {
+            string directory = ( i == -1 ) ? spool_directory : bucket_path( i );
+            DIR *scan_state = opendir( directory.c_str( ));
+            if( scan_state == nullptr ) continue;
+
+            dirent *directory_entry;
+            while(( directory_entry = readdir( scan_state )) != nullptr ) {
+                string name = directory_entry->d_name;
+                if( name[0] == '.' || name.size( ) <= 4 ||
+                    name.compare( name.size( ) - 4, 4, ".msg" ) != 0 ) continue;
+                file_names.push_back( directory + "/" + name );
+            }
+            closedir( scan_state );
+        }
+
+        string contents;
+        string record;
+        for( const string &file_name : file_names ) {
+            if( !read_file( file_name, contents ))
+                throw Spool::SpoolError( "Can't read message file" );
+            if( !SpoolRecord::is_record( contents )) {
+                SpoolRecord::convert_text( contents, record );
+                contents.swap( record );
+            }
+            size_t slash = file_name.rfind( '/' );
+            string queue_id = file_name.substr( slash + 1, file_name.size( ) - slash - 5 );
+            try {
+                message_log->append( queue_id, contents );
+            }
+            catch( const runtime_error & ) {
+                throw Spool::SpoolError( "Can't move message file into message log" );
+            }
+        }
+        if( file_names.empty( )) return;
+
+        message_log->sync( );
+        for( const string &file_name : file_names ) unlink( file_name.c_str( ));
+
+        ostringstream formatter;
+        formatter << "Moved " << file_names.size( ) << " message files into the message log";
+        Console::put_debug_line( formatter.str( ).c_str( ));
+    }
+
+
+    //! Rewrite the message log records of earlier versions of MailFlux as spool records.
+    /*!
+     * A converted record is appended to the log with the same queue ID, and the original is
+     * removed once the new one is durable.
+     */
+    void convert_log_records( )
+    {
+        vector<SegmentLog::Record> records;
+        vector<SegmentLog::Location> converted;
+        string record;
+        message_log->get_records( records );
+        for( const SegmentLog::Record &old_record : records ) {
+            string_view data = message_log->get_data( old_record.where );
+            if( SpoolRecord::is_record( data )) continue;
+            SpoolRecord::convert_text( data, record );
+            message_log->append( old_record.key, record );
+            converted.push_back( old_record.where );
+        }
+        if( converted.empty( )) return;
+
+        message_log->sync( );
+        for( const SegmentLog::Location &where : converted ) message_log->remove( where );
+
+        ostringstream formatter;
+        formatter << "Converted " << converted.size( ) << " log records to spool records";
+        Console::put_debug_line( formatter.str( ).c_str( ));
+    }
+
+
+    //! Add all the messages in the spool to a list.
+    void scan_spool( vector<SpooledMessage> &messages )
+    {
+        if( message_log != nullptr ) {
+            vector<SegmentLog::Record> records;
+            message_log->get_records( records );
+            for( const SegmentLog::Record &record : records ) {
+                messages.push_back( SpooledMessage{ record.key, record.where } );
+            }
+            return;
+        }
+
+        for( unsigned i = 0; i < BUCKET_COUNT; ++i ) {
+            string directory = bucket_path( i );
+            DIR *scan_state = opendir( directory.c_str( ));
+            if( scan_state == nullptr ) {
+                Console::put_exception_line( "Can't scan spool directory" );
+                continue;
+            }
+            dirent *directory_entry;
+            while(( directory_entry = readdir( scan_state )) != nullptr ) {
+                if( directory_entry->d_name[0] == '.' ) continue;
+                messages.push_back(
+                    SpooledMessage{ directory + "/" + directory_entry->d_name, { 0, 0 } } );
+            }
+            closedir( scan_state );
         }
-        return result;
     }
 
 
@@ -120,7 +595,34 @@ namespace {
         server_address.sin_port = htons( 25 );
         memcpy( &server_address.sin_addr, host_information->h_addr_list[0], 4 );
 
+        // The connection is made without blocking so that a server that doesn't answer can't
+        // hold up the spool thread for longer than connect_timeout.
+        int flags = fcntl( handle, F_GETFL, 0 );
+        if( flags == -1 || fcntl( handle, F_SETFL, flags | O_NONBLOCK ) == -1 ) {
+            close( handle );
+            throw Spool::SpoolError( "Unable to make socket non-blocking" );
+        }
         int result = connect( handle, (sockaddr *) &server_address, sizeof( server_address ));
+        if( result == -1 && errno == EINPROGRESS ) {
+            pollfd waiting = { handle, POLLOUT, 0 };
+            int milliseconds = static_cast<int>(
+                chrono::duration_cast<chrono::milliseconds>( connect_timeout ).count( ));
+            do {
+                result = poll( &waiting, 1, milliseconds );
+            } while( result == -1 && errno == EINTR );
+            if( result == 0 ) {
+                close( handle );
+                throw Spool::SpoolError( "Timed out connecting to next server" );
+            }
+
+            int       status = 0;
+            socklen_t length = sizeof( status );
+            if( result == 1 &&
+                getsockopt( handle, SOL_SOCKET, SO_ERROR, &status, &length ) == 0 && status == 0 )
+                result = 0;
+            else
+                result = -1;
+        }
         if( result == -1 ) {
             close( handle );
             throw Spool::SpoolError( "Unable to connect to next server" );
@@ -130,61 +632,444 @@ namespace {
     }
 
 
+    //! Return when the message entered the spool.
     /*!
-     * This is the spool handling thread function. It wakes up periodically and tries to send
-     * (or deliver) every message it finds in the spool.
+     * The time is taken from the message's queue ID. A message whose name is not a queue ID (it
+     * was spooled by an older version of MailFlux) is treated as arriving now.
      */
-    [[noreturn]] void *spool_loop( void * )
+    chrono::system_clock::time_point arrival_time( const SpooledMessage &message )
     {
-        vector<string> file_names;
-        DIR *scan_state;
-        dirent *directory_entry;
+        string name = message.name.substr( message.name.rfind( '/' ) + 1 );
+        if( name.size( ) > 4 && name.compare( name.size( ) - 4, 4, ".msg" ) == 0 )
+            name.erase( name.size( ) - 4 );
+        if( name.size( ) != QUEUE_ID_LENGTH ||
+            name.find_first_not_of( "0123456789ABCDEF" ) != string::npos )
+            return chrono::system_clock::now( );
 
-        while( true ) {
-            // Catch all possible exceptions and keep going.
+        unsigned long long microseconds = strtoull( name.substr( 0, 14 ).c_str( ), nullptr, 16 );
+        return chrono::system_clock::time_point(
+            chrono::duration_cast<chrono::system_clock::duration>(
+                chrono::microseconds( microseconds )));
+    }
+
+
+    //! Add a new message to the active queue, to be delivered as soon as possible.
+    /*!
+     * The spool thread is woken if it is waiting for messages.
+     *
+     * \param message The message to deliver.
+     */
+    void schedule( const SpooledMessage &message )
+    {
+        QueueEntry entry{
+            chrono::steady_clock::time_point( ), arrival_time( message ), 0, message, { } };
+
+        pthread_mutex_lock( &queue_lock );
+        active_queue.push_back( move( entry ));
+        if( active_queue.size( ) == 1 ) pthread_cond_signal( &queue_changed );
+        pthread_mutex_unlock( &queue_lock );
+    }
+
+
+    //! Return how long to wait before the next attempt to deliver a message.
+    /*!
+     * The delay starts at retry_interval and doubles with each failed attempt, up to
+     * max_retry_interval. It is then shortened by a random amount of up to half, so that
+     * messages that failed together (for example because the next server was down) are not all
+     * retried together.
+     *
+     * \param attempts The number of failed attempts, at least one.
+     * \param generator Source of the random part of the delay.
+     */
+    chrono::milliseconds retry_delay( unsigned attempts, minstd_rand &generator )
+    {
+        chrono::milliseconds delay = retry_interval;
+        for( unsigned i = 1; i < attempts && delay < max_retry_interval; ++i ) delay *= 2;
+        delay = min( delay, chrono::milliseconds( max_retry_interval ));
+
+        uniform_int_distribution<long long> jitter( 0, delay.count( ) / 2 );
+        return delay - chrono::milliseconds( jitter( generator ));
+    }
+
+
+    //! Reclaim the space of delivered messages in the message log.
+    /*!
+     * The locations of the queued messages whose records were moved are updated.
+     */
+    void compact_log( )
+    {
+        vector<SegmentLog::Relocation> moved;
+        message_log->compact( moved );
+        if( moved.empty( )) return;
+
+        auto earlier = []( const SegmentLog::Location &left, const SegmentLog::Location &right ) {
+            return left.segment < right.segment ||
+                   ( left.segment == right.segment && left.offset < right.offset );
+        };
+        auto relocate = [&]( QueueEntry &entry ) {
+            SegmentLog::Location &where = entry.message.where;
+            auto relocation = lower_bound( moved.begin( ), moved.end( ), where,
+                [&earlier]( const SegmentLog::Relocation &r, const SegmentLog::Location &l ) {
+                    return earlier( r.from, l );
+                } );
+            if( relocation != moved.end( ) && !earlier( where, relocation->from ))
+                where = relocation->to;
+        };
+        pthread_mutex_lock( &queue_lock );
+        for_each( active_queue.begin( ), active_queue.end( ), relocate );
+        for_each( deferred_queue.begin( ), deferred_queue.end( ), relocate );
+        pthread_mutex_unlock( &queue_lock );
+    }
+
+
+    //! Return the spool record of a message.
+    unique_ptr<SpoolRecord> open_record( const SpooledMessage &spooled )
+    {
+        if( message_log != nullptr )
+            return unique_ptr<SpoolRecord>(
+                new SpoolRecord( message_log->get_data( spooled.where )));
+        return unique_ptr<SpoolRecord>( new SpoolRecord( spooled.name ));
+    }
+
+
+    //! Describe the structure of a spooled message.
+    /*!
+     * The message's Message-ID is given, if it has one, followed by its MIME type. If the
+     * message has parts, the type, encoding, and encoded size of each part that holds content
+     * (rather than other parts) follows, up to MAX_DESCRIBED_PARTS of them. The text of the
+     * message is parsed in place and nothing is decoded.
+     */
+    string describe( const SpoolRecord &email )
+    {
+        ostringstream formatter;
+        istring_view message_id;
+        if( email.find_header( HeaderIndex::MESSAGE_ID, message_id ) &&
+            message_id.find_first_of( "\r\n" ) == istring_view::npos )
+            formatter << string_view( message_id.data( ), message_id.size( )) << ' ';
+
+        MimeParser parser;
+        parser.parse( email.get_body( ));
+        const vector<MimeParser::Part> &parts = parser.get_parts( );
+        formatter << parts[0].content_type;
+        if( parts.size( ) == 1 ) {
+            formatter << ", " << parts[0].size( ) << " bytes";
+            return formatter.str( );
+        }
+
+        size_t listed = 0;
+        size_t omitted = 0;
+        for( size_t i = 1; i < parts.size( ); ++i ) {
+            // The parts are in the order they start, so a part's first child follows it.
+            if( i + 1 < parts.size( ) && parts[i + 1].parent == static_cast<int>( i )) continue;
+            if( listed == MAX_DESCRIBED_PARTS ) {
+                ++omitted;
+                continue;
+            }
+            const MimeParser::Part &part = parts[i];
+            formatter << ( listed == 0 ? ": " : ", " ) << part.content_type << ' ';
+            if( !part.encoding.empty( ) && part.encoding != "7bit" && part.encoding != "8bit" )
+                formatter << part.encoding << ' ';
+            formatter << part.size( ) << " bytes";
+            ++listed;
+        }
+        if( omitted > 0 ) formatter << ", and " << omitted << " more";
+        return formatter.str( );
+    }
+
+
+    //! Try once to deliver a message.
+    /*!
+     * The conversation with the next server runs on an event loop; this thread waits for its
+     * outcome. The structure of the message is described on the console before the first
+     * attempt.
+     *
+     * \param entry The queued message. Only the recipients not yet finished are tried.
+     * \param error Set to the reason for the failure, if the message wasn't delivered.
+     * \param outcomes Set to the server's reply to each recipient it was sent.
+     * \return true if the message was delivered to the recipients that the server accepted.
+     * \throw SpoolError or std::runtime_error if the attempt could not be made.
+     */
+    bool deliver(
+        QueueEntry &entry, string &error, vector<DeliveryResult::Recipient> &outcomes )
+    {
+        const SpooledMessage &spooled = entry.message;
+        unique_ptr<SpoolRecord> email = open_record( spooled );
+        if( entry.finished.empty( )) entry.finished.resize( email->recipient_count( ));
+        vector<size_t> recipients;
+        for( size_t i = 0; i < entry.finished.size( ); ++i ) {
+            if( !entry.finished[i] ) recipients.push_back( i );
+        }
+
+        ostringstream message_formatter;
+        message_formatter << "Processing spooled message '" << spooled.name << "'";
+        if( entry.attempts == 0 ) message_formatter << ": " << describe( *email );
+        Console::put_debug_line( message_formatter.str( ).c_str( ));
+        DeliveryResult result;
+        ClientConnection *forwarder;
+        int socket_handle = connect_server( );
+        try {
+            forwarder = new ClientConnection( socket_handle, *email, recipients, &result );
+        }
+        catch( ... ) {
+            close( socket_handle );
+            throw;
+        }
+        Reactor::add_outbound( forwarder );
+        return result.wait( error, outcomes );
+    }
+
+
+    //! Return an undeliverable message to its sender.
+    /*!
+     * A notice giving the recipients that could not be reached, the reason for each, and the
+     * header of the message is added to the spool, addressed to the message's sender. The notice
+     * refers to the message's Message-ID, if it has one. A message with no sender is itself a
+     * notice of this kind (RFC 5321, 6.1) and is not returned.
+     *
+     * \param spooled The message.
+     * \param failures The recipients the message is returned for.
+     * \param expired True if the message is returned because it has been in the spool too long,
+     * rather than because the recipients were refused.
+     * \throw SpoolError or std::runtime_error if the notice can't be spooled.
+     */
+    void bounce( const SpooledMessage &spooled, const vector<Failure> &failures, bool expired )
+    {
+        unique_ptr<SpoolRecord> email = open_record( spooled );
+        string_view sender = email->get_sender( );
+        if( sender.empty( )) {
+            ostringstream formatter;
+            formatter << "Discarding undeliverable notice '" << spooled.name << "'";
+            Console::put_warning_line( formatter.str( ).c_str( ));
+            return;
+        }
+
+        char host_name[256] = "localhost";
+        gethostname( host_name, sizeof( host_name ) - 1 );
+        char date[64];
+        time_t now = time( nullptr );
+        tm local;
+        strftime( date, sizeof( date ), "%a, %d %b %Y %H:%M:%S %z", localtime_r( &now, &local ));
+
+        vector<string> lines;
+        lines.push_back( string( "From: Mail Delivery System <MAILER-DAEMON@" ) + host_name + ">" );
+        lines.push_back( "To: <" + string( sender ) + ">" );
+        lines.push_back( "Subject: Undelivered Mail Returned to Sender" );
+        lines.push_back( string( "Date: " ) + date );
+        lines.push_back( "Auto-Submitted: auto-replied" );
+        istring_view message_id;
+        if( email->find_header( HeaderIndex::MESSAGE_ID, message_id ) &&
+            message_id.find_first_of( "\r\n" ) == istring_view::npos ) {
+            // Let the sender's mail program put the notice with the message.
+            string id( message_id.data( ), message_id.size( ));
+            lines.push_back( "In-Reply-To: " + id );
+            lines.push_back( "References: " + id );
+        }
+        lines.push_back( "" );
+        ostringstream formatter;
+        formatter << "Your message could not be delivered";
+        if( expired ) {
+            long lifetime = static_cast<long>( max_queue_lifetime.count( ));
+            formatter << " within ";
+            if( lifetime % 86400 == 0 )     formatter << lifetime / 86400 << " days";
+            else if( lifetime % 3600 == 0 ) formatter << lifetime / 3600 << " hours";
+            else                            formatter << lifetime << " seconds";
+        }
+        formatter << " to these recipients:";
+        lines.push_back( formatter.str( ));
+        lines.push_back( "" );
+        for( const Failure &failure : failures ) {
+            lines.push_back( "    <" + string( email->get_recipient( failure.recipient )) + ">" );
+            lines.push_back( "        " + failure.reason );
+        }
+        lines.push_back( "" );
+        lines.push_back( "The header of your message follows." );
+        lines.push_back( "" );
+
+        // Copy the header a field at a time, splitting folded fields into their lines.
+        for( size_t i = 0; i < email->header_count( ); ++i ) {
+            string_view field = email->get_header_field( i );
+            while( true ) {
+                size_t end = field.find( '\n' );
+                string_view line = field.substr( 0, end );
+                if( !line.empty( ) && line.back( ) == '\r' ) line.remove_suffix( 1 );
+                lines.push_back( string( line ));
+                if( end == string_view::npos ) break;
+                field.remove_prefix( end + 1 );
+            }
+        }
+
+        Message notice;
+        notice.set_sender( istring_view( ));
+        notice.add_recipient( istring_view( sender.data( ), sender.size( )));
+        for( const string &line : lines ) {
+            notice.append_text( istring_view( line.data( ), line.size( )));
+        }
+        Spool::add_message( notice );
+    }
+
+
+    //! Remove a message from the spool.
+    /*!
+     * \return true if the message was in the message log.
+     */
+    bool discard( const SpooledMessage &spooled )
+    {
+        if( message_log != nullptr ) {
             try {
-                sleep( 15 );
-                file_names.clear( );
-
-                // Scan the spool directory and make a list of all files.
-                // FIXME: If an exception is thrown while the lock is held deadlock occurs.
-                pthread_mutex_lock( &spool_lock );
-                if(( scan_state = opendir( spool_directory.c_str( ))) == nullptr ) {
-                    Console::put_exception_line( "Can't scan spool directory" );
+                message_log->remove( spooled.where );
+            }
+            catch( exception &e ) {
+                Console::put_exception_line( e.what( ));
+            }
+            return true;
+        }
+        if( unlink( spooled.name.c_str( )) == -1 && errno != ENOENT ) {
+            ostringstream formatter;
+            formatter << "Can't remove '" << spooled.name << "': " << strerror( errno );
+            Console::put_exception_line( formatter.str( ).c_str( ));
+        }
+        return false;
+    }
+
+
+    /*!
+     * This is the spool handling thread function. It delivers the messages in the active queue
+     * in turn, moves those that can't be delivered to the deferred queue, and sleeps while no
+     * message is due. A message that is still undeliverable after max_queue_lifetime is returned
+     * to its sender.
+     */
+    [[noreturn]] void *spool_loop( void * )
+    {
+        minstd_rand generator( random_device{ }( ));
+        bool removed = false;   // True if log records were removed since the log was compacted.
+        while( true ) {
+            pthread_mutex_lock( &queue_lock );
+            while( true ) {
+                // Move the deferred messages that are now due to the active queue.
+                auto now = chrono::steady_clock::now( );
+                while( !deferred_queue.empty( ) && deferred_queue.front( ).due <= now ) {
+                    pop_heap( deferred_queue.begin( ), deferred_queue.end( ), due_later );
+                    active_queue.push_back( move( deferred_queue.back( )));
+                    deferred_queue.pop_back( );
                 }
-                else {
-                    while(( directory_entry = readdir( scan_state )) != nullptr ) {
-                        if( directory_entry->d_name[0] == '.' ) continue;
-                        file_names.push_back( spool_directory + "/" + directory_entry->d_name );
+                if( !active_queue.empty( )) break;
+
+                // Reclaim the space of delivered messages before going idle.
+                if( removed ) {
+                    pthread_mutex_unlock( &queue_lock );
+                    removed = false;
+                    try {
+                        compact_log( );
+                    }
+                    catch( exception &e ) {
+                        Console::put_exception_line( e.what( ));
                     }
-                    closedir( scan_state );
+                    pthread_mutex_lock( &queue_lock );
+                    continue;
+                }
+
+                if( deferred_queue.empty( )) {
+                    pthread_cond_wait( &queue_changed, &queue_lock );
                 }
-                pthread_mutex_unlock( &spool_lock );
-
-                // For each message in the spool, create ClientConnection object and send it.
-                vector<string>::size_type i;
-                for( i = 0; i < file_names.size( ); ++i ) {
-                    int socket_handle;
-                    ostringstream message_formatter;
-
-                    message_formatter << "Processing spool file '" << file_names[i] << "'";
-                    Console::put_debug_line( message_formatter.str( ).c_str( ));
-
-                    // FIXME: If there is an error sending the message, it should be requeued.
-                    Message email = read_message( file_names[i] );
-                    socket_handle = connect_server( );
-                    ClientConnection forwarder( socket_handle, email );
-                    forwarder.doSMTP( );
-                    close( socket_handle );
-                    unlink( file_names[i].c_str( ));
+                else {
+                    auto due = deferred_queue.front( ).due.time_since_epoch( );
+                    timespec deadline;
+                    deadline.tv_sec  = chrono::duration_cast<chrono::seconds>( due ).count( );
+                    deadline.tv_nsec = chrono::duration_cast<chrono::nanoseconds>(
+                        due - chrono::seconds( deadline.tv_sec )).count( );
+                    pthread_cond_timedwait( &queue_changed, &queue_lock, &deadline );
                 }
             }
+            QueueEntry entry = move( active_queue.front( ));
+            active_queue.pop_front( );
+            pthread_mutex_unlock( &queue_lock );
+
+            // Catch all possible exceptions and keep going.
+            string error;
+            vector<DeliveryResult::Recipient> outcomes;
+            bool delivered = false;
+            try {
+                delivered = deliver( entry, error, outcomes );
+            }
             catch( exception &e ) {
-                Console::put_exception_line( e.what( ));
+                error = e.what( );
             }
             catch( ... ) {
-                Console::put_exception_line( "Unexpected exception in spool thread" );
+                error = "Unexpected exception in spool thread";
             }
+
+            // The recipients that the server accepted are finished if the message was delivered.
+            // Those it refused for good are returned at once. The others are tried again.
+            vector<Failure> refused;
+            for( const DeliveryResult::Recipient &outcome : outcomes ) {
+                if( outcome.what == DeliveryResult::ACCEPTED && delivered )
+                    entry.finished[outcome.index] = true;
+                else if( outcome.what == DeliveryResult::REJECTED )
+                    refused.push_back( { outcome.index, outcome.reply } );
+                else if( outcome.what == DeliveryResult::DEFERRED && error.empty( ))
+                    error = "Server replied: " + outcome.reply;
+            }
+            if( !refused.empty( )) {
+                try {
+                    bounce( entry.message, refused, false );
+                    for( const Failure &failure : refused ) {
+                        entry.finished[failure.recipient] = true;
+                    }
+                }
+                catch( exception &e ) {
+                    Console::put_exception_line( e.what( ));
+                }
+            }
+            if( !entry.finished.empty( ) &&
+                find( entry.finished.begin( ), entry.finished.end( ), false ) ==
+                    entry.finished.end( )) {
+                removed = discard( entry.message ) || removed;
+                continue;
+            }
+
+            ++entry.attempts;
+            ostringstream error_formatter;
+            error_formatter << "Unable to send '" << entry.message.name << "' (attempt "
+                            << entry.attempts << "): " << error;
+            Console::put_exception_line( error_formatter.str( ).c_str( ));
+
+            // Return the message to the remaining recipients once it has been in the spool too
+            // long. If even that fails, it is deferred like any other.
+            auto expires = entry.arrived + max_queue_lifetime;
+            auto remaining = expires - chrono::system_clock::now( );
+            if( remaining <= chrono::system_clock::duration::zero( )) {
+                vector<Failure> expired;
+                for( size_t i = 0; i < entry.finished.size( ); ++i ) {
+                    if( !entry.finished[i] ) expired.push_back( { i, error } );
+                }
+                for( const DeliveryResult::Recipient &outcome : outcomes ) {
+                    if( outcome.what != DeliveryResult::DEFERRED ) continue;
+                    for( Failure &failure : expired ) {
+                        if( failure.recipient == outcome.index ) failure.reason = outcome.reply;
+                    }
+                }
+                try {
+                    bounce( entry.message, expired, true );
+                    removed = discard( entry.message ) || removed;
+                    continue;
+                }
+                catch( exception &e ) {
+                    Console::put_exception_line( e.what( ));
+                }
+            }
+
+            // The last attempt is made when the message expires, even if that is sooner.
+            auto delay = chrono::duration_cast<chrono::steady_clock::duration>(
+                retry_delay( entry.attempts, generator ));
+            if( remaining > chrono::system_clock::duration::zero( ))
+                delay = min( delay,
+                    chrono::duration_cast<chrono::steady_clock::duration>( remaining ));
+            entry.due = chrono::steady_clock::now( ) + delay;
+
+            pthread_mutex_lock( &queue_lock );
+            deferred_queue.push_back( move( entry ));
+            push_heap( deferred_queue.begin( ), deferred_queue.end( ), due_later );
+            pthread_mutex_unlock( &queue_lock );
         }
     }
 
@@ -193,11 +1078,165 @@ namespace {
 
 namespace Spool {
 
+    //! The thread that makes committed messages durable in groups.
+    /*!
+     * The committer takes the messages waiting in the commit queue as a group. If
+     * GROUP_COMMIT_WINDOW is nonzero it first waits that long for more messages to arrive, unless
+     * the group is already full. Messages that arrive while a group is being committed form the
+     * next group in any case, so under load groups form even without a window.
+     */
+    class Committer {
+    public:
+        [[noreturn]] static void *run( void * );
+
+    private:
+        static void commit_group( const vector<MessageWriter *> &group );
+
+        static void commit_log_group( const vector<MessageWriter *> &group );
+    };
+
+
+    //! Make a group of messages durable and put them in the spool.
+    /*!
+     * The files were written and closed by start_commit(). One syncfs() of the file system that
+     * holds the spool makes the text of all of them durable at once; the files are then renamed
+     * into the spool and a second syncfs() makes the new names durable. For best results the
+     * spool should have a file system of its own, since syncfs() also flushes unrelated files.
+     * If the second flush fails the messages are reported as failed although they are in the
+     * spool, so a client that retries may cause a message to be delivered twice, but no
+     * acknowledged message is ever lost.
+     */
+    void Committer::commit_group( const vector<MessageWriter *> &group )
+    {
+        if( message_log != nullptr ) {
+            commit_log_group( group );
+            return;
+        }
+
+        const char *failure = nullptr;
+        if( syncfs( temporary_handle ) == -1 ) failure = "Can't write spool files";
+
+        size_t published = 0;
+        for( MessageWriter *writer : group ) {
+            writer->error = failure;
+            if( failure != nullptr ) continue;
+            try {
+                writer->publish( );
+                ++published;
+            }
+            catch( const SpoolError & ) {
+                writer->error = "Can't add message file to spool";
+            }
+        }
+
+        // A message that is in the spool is delivered even if it is reported as failed.
+        bool names_durable = ( published == 0 || syncfs( temporary_handle ) == 0 );
+        for( MessageWriter *writer : group ) {
+            if( writer->committed ) writer->queue_for_delivery( );
+            if( writer->error != nullptr ) continue;
+            if( names_durable )
+                record_commit( writer->commit_start );
+            else
+                writer->error = "Can't write spool directory";
+        }
+        group_sizes.record( group.size( ));
+        commit_groups.fetch_add( 1, memory_order_relaxed );
+    }
+
+
+    //! Make a group of messages durable by appending them to the message log.
+    /*!
+     * The messages are appended one after another and then one sync() of the log makes them all
+     * durable, usually with a single fdatasync() and no other file system activity.
+     */
+    void Committer::commit_log_group( const vector<MessageWriter *> &group )
+    {
+        size_t appended = 0;
+        for( MessageWriter *writer : group ) {
+            try {
+                writer->append_to_log( );
+                ++appended;
+            }
+            catch( const SpoolError & ) {
+                writer->error = "Can't write message log";
+            }
+        }
+
+        bool durable = true;
+        if( appended != 0 ) {
+            try {
+                message_log->sync( );
+            }
+            catch( const runtime_error & ) {
+                durable = false;
+            }
+        }
+        for( MessageWriter *writer : group ) {
+            if( writer->error != nullptr ) continue;
+            if( durable ) {
+                record_commit( writer->commit_start );
+                writer->queue_for_delivery( );
+            }
+            else
+                writer->error = "Can't write message log";
+        }
+        group_sizes.record( group.size( ));
+        commit_groups.fetch_add( 1, memory_order_relaxed );
+    }
+
+
+    /*!
+     * This is the committer thread function. It commits one group of messages after another, and
+     * then tells the writer of each message that its commit is complete.
+     */
+    void *Committer::run( void * )
+    {
+        vector<MessageWriter *> group;
+        vector<Connection *> waiting;
+
+        pthread_mutex_lock( &commit_lock );
+        while( true ) {
+            while( commit_queue.empty( )) pthread_cond_wait( &commit_arrived, &commit_lock );
+
+            // Give more messages a chance to join the group.
+            if( group_window > 0 && commit_queue.size( ) < group_limit ) {
+                timespec deadline;
+                clock_gettime( CLOCK_MONOTONIC, &deadline );
+                deadline.tv_nsec += group_window * 1000;
+                deadline.tv_sec  += deadline.tv_nsec / 1000000000;
+                deadline.tv_nsec %= 1000000000;
+                while( commit_queue.size( ) < group_limit &&
+                       pthread_cond_timedwait( &commit_arrived, &commit_lock, &deadline ) == 0 ) { }
+            }
+
+            size_t count = min( commit_queue.size( ), group_limit );
+            group.assign( commit_queue.begin( ), commit_queue.begin( ) + count );
+            commit_queue.erase( commit_queue.begin( ), commit_queue.begin( ) + count );
+            pthread_mutex_unlock( &commit_lock );
+
+            commit_group( group );
+
+            // A writer may be destroyed as soon as it is no longer pending, so the connections
+            // to notify are collected first.
+            waiting.clear( );
+            pthread_mutex_lock( &commit_lock );
+            for( MessageWriter *writer : group ) {
+                if( writer->waiting != nullptr ) waiting.push_back( writer->waiting );
+                writer->pending = false;
+            }
+            pthread_cond_broadcast( &commit_done );
+            pthread_mutex_unlock( &commit_lock );
+            for( Connection *connection : waiting ) connection->notify( );
+            pthread_mutex_lock( &commit_lock );
+        }
+    }
+
+
     //! Initialize the spool.
     /*!
      * This function initializes the in-memory data structures and the on-disk data structures
-     * (if any) required by the spool. It also starts the spool monitoring thread that
-     * periodically tries to send all messages that it finds in the spool. Note that this
+     * (if any) required by the spool. It also starts the spool handling thread that delivers the
+     * messages in the spool, and those added to it later, as they become due. Note that this
      * function assumes that Support::read_config_files() has already been called.
      */
     void initialize( )
@@ -213,6 +1252,85 @@ namespace Spool {
         message_formatter << "Using spool directory of '" << spool_directory << "'";
         Console::put_debug_line( message_formatter.str( ).c_str( ));
 
+        temp = Support::lookup_parameter( "SPOOL_SHARD" );
+        if( temp != nullptr ) {
+            int shard = atoi( temp->c_str( ));
+            if( shard < 0 || shard > 255 ) throw SpoolError( "SPOOL_SHARD must be from 0 to 255" );
+            shard_id = static_cast<unsigned>( shard );
+        }
+
+        temp = Support::lookup_parameter( "SPOOL_BACKEND" );
+        if( temp != nullptr && *temp == "log" ) {
+            uint64_t segment_size = DEFAULT_SEGMENT_SIZE;
+            temp = Support::lookup_parameter( "SEGMENT_SIZE" );
+            if( temp != nullptr && atoll( temp->c_str( )) > 0 )
+                segment_size = static_cast<uint64_t>( atoll( temp->c_str( )));
+            try {
+                message_log = new SegmentLog( spool_directory + "/" + LOG_DIRECTORY, segment_size );
+            }
+            catch( const runtime_error &e ) {
+                Console::put_exception_line( e.what( ));
+                throw SpoolError( "Can't open message log" );
+            }
+        }
+        prepare_spool_directory( );
+        if( message_log != nullptr ) {
+            convert_log_records( );
+            import_message_files( );
+        }
+
+        // Failed deliveries are retried after RETRY_INTERVAL seconds, doubling to at most
+        // MAX_RETRY_INTERVAL, until the message is MAX_QUEUE_LIFETIME seconds old.
+        temp = Support::lookup_parameter( "RETRY_INTERVAL" );
+        if( temp != nullptr && atol( temp->c_str( )) > 0 )
+            retry_interval = chrono::seconds( atol( temp->c_str( )));
+        temp = Support::lookup_parameter( "MAX_RETRY_INTERVAL" );
+        if( temp != nullptr && atol( temp->c_str( )) > 0 )
+            max_retry_interval = chrono::seconds( atol( temp->c_str( )));
+        max_retry_interval = max( max_retry_interval, retry_interval );
+        temp = Support::lookup_parameter( "MAX_QUEUE_LIFETIME" );
+        if( temp != nullptr && atol( temp->c_str( )) > 0 )
+            max_queue_lifetime = chrono::seconds( atol( temp->c_str( )));
+
+        // A delivery attempt fails if the next server doesn't accept the connection within
+        // CONNECT_TIMEOUT seconds or leaves any reply outstanding for REPLY_TIMEOUT seconds.
+        temp = Support::lookup_parameter( "CONNECT_TIMEOUT" );
+        if( temp != nullptr && atol( temp->c_str( )) > 0 )
+            connect_timeout = chrono::seconds( atol( temp->c_str( )));
+        temp = Support::lookup_parameter( "REPLY_TIMEOUT" );
+        if( temp != nullptr && atol( temp->c_str( )) > 0 )
+            ClientConnection::set_reply_timeout( chrono::seconds( atol( temp->c_str( ))));
+
+        // The delivery queue is built from the spool only now. After this messages are added to
+        // it as they are committed, so the spool is never scanned again.
+        pthread_condattr_t attributes;
+        pthread_condattr_init( &attributes );
+        pthread_condattr_setclock( &attributes, CLOCK_MONOTONIC );
+        pthread_cond_init( &queue_changed, &attributes );
+        vector<SpooledMessage> messages;
+        scan_spool( messages );
+        for( const SpooledMessage &spooled : messages ) schedule( spooled );
+
+        // Start the committer, unless each message is to be made durable on its own.
+        temp = Support::lookup_parameter( "SPOOL_SYNC" );
+        if( temp != nullptr && *temp == "message" ) spool_sync = SYNC_MESSAGE;
+        if( spool_sync == SYNC_GROUP ) {
+            temp = Support::lookup_parameter( "GROUP_COMMIT_WINDOW" );
+            if( temp != nullptr ) group_window = max( atol( temp->c_str( )), 0L );
+            temp = Support::lookup_parameter( "GROUP_COMMIT_SIZE" );
+            if( temp != nullptr && atol( temp->c_str( )) > 0 )
+                group_limit = static_cast<size_t>( atol( temp->c_str( )));
+
+            pthread_cond_init( &commit_arrived, &attributes );
+
+            pthread_t committer_thread;
+            Console::put_debug_line( "Initializing spool committer thread" );
+            pthread_create( &committer_thread, nullptr, Committer::run, nullptr );
+            pthread_detach( committer_thread );
+        }
+        pthread_condattr_destroy( &attributes );
+        Console::register_command( "spool", spool_command );
+
         // Create the spool handling thread. The thread runs forever and is never terminated or
         // joined. This is probably not ideal.
         //
@@ -223,68 +1341,312 @@ namespace Spool {
     }
 
 
-    //! Add an email message to the spool.
+    // === Private Methods ===
+
+    //! Create the temporary file for the message.
     /*!
-     * This function copies the given email message to non-volatile storage for later delivery.
+     * The temporary file is in a subdirectory of the spool that the spool thread never looks at.
      *
-     * \param the_message The email message to add to the spool.
+     * \throw SpoolError if the file can't be created.
      */
-    void add_message( const Message &the_message )
+    void MessageWriter::open_file( )
     {
-        time_t raw_time;
-        struct tm *cooked_time;
+        handle = openat( temporary_handle,
+            temporary_name.c_str( ), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600 );
+        if( handle == -1 ) throw SpoolError( "Can't open spool file" );
+    }
 
-        // Build the file name based on the current date/time.
-        raw_time = std::time( nullptr );
-        cooked_time = localtime( &raw_time );
 
-        ostringstream formatter;
-        formatter << setfill( '0' );
-        formatter << cooked_time->tm_year + 1900
-                  << setw( 2 ) << cooked_time->tm_mon + 1
-                  << setw( 2 ) << cooked_time->tm_mday;
-        formatter << 'T';
-        formatter << setw( 2 ) << cooked_time->tm_hour
-                  << setw( 2 ) << cooked_time->tm_min
-                  << setw( 2 ) << cooked_time->tm_sec;
-        string file_name = spool_directory + "/" + formatter.str( ) + ".msg";
+    //! Write out the buffered text, creating the temporary file if necessary.
+    void MessageWriter::flush( )
+    {
+        if( handle == -1 ) open_file( );
 
-        ostringstream message_formatter;
-        message_formatter << "Writing message to '" << file_name << "'";
-        Console::put_debug_line( message_formatter.str( ).c_str( ));
+        const char *next = buffer.get( );
+        while( buffered > 0 ) {
+            ssize_t count = write( handle, next, buffered );
+            if( count == -1 ) {
+                if( errno == EINTR ) continue;
+                throw SpoolError( "Can't write spool file" );
+            }
+            next += count;
+            buffered -= static_cast<size_t>( count );
+            written += static_cast<uint64_t>( count );
+        }
+    }
+
+
+    //! Record the length of the message text in the record's header.
+    /*!
+     * The header is patched in the buffer if it is still there, or else in the temporary file.
+     *
+     * \throw SpoolError if the file can't be written.
+     */
+    void MessageWriter::set_body_length( )
+    {
+        uint64_t length = written + buffered - body_offset;
+        size_t position = offsetof( SpoolRecord::Header, body_length );
+        if( written == 0 )
+            memcpy( buffer.get( ) + position, &length, sizeof( length ));
+        else if( pwrite( handle, &length, sizeof( length ), static_cast<off_t>( position )) !=
+                 static_cast<ssize_t>( sizeof( length )))
+            throw SpoolError( "Can't write spool file" );
+    }
 
-        // Write the entire file to disk under the lock so that the spool handling thread never
-        // tries to send a partially written message.
-        //
-        pthread_mutex_lock( &spool_lock );
-        {
-            ofstream output( file_name.c_str( ));
 
-            if( !output ) {
-                Console::put_exception_line( "Can't open spool file" );
+    //! Move the written file into the spool.
+    /*!
+     * The file is renamed into its subdirectory with a name made from the queue ID. The rename
+     * is atomic so the spool thread never sees a partially written message, and it never
+     * replaces an existing message. No lock is taken.
+     *
+     * \return The subdirectory that now holds the file.
+     * \throw SpoolError if the file can't be renamed.
+     */
+    unsigned MessageWriter::publish( )
+    {
+        // The queue ID is unique, so a collision means the clock was set back. Make another.
+        string file_name = queue_id + ".msg";
+        unsigned bucket = bucket_of( file_name );
+        while( rename_new(
+                   temporary_handle, temporary_name, bucket_handles[bucket], file_name ) == -1 ) {
+            if( errno != EEXIST ) throw SpoolError( "Can't add message file to spool" );
+            queue_id = make_queue_id( );
+            file_name = queue_id + ".msg";
+            bucket = bucket_of( file_name );
+        }
+        committed = true;
+        return bucket;
+    }
+
+
+    //! Append the message to the message log.
+    /*!
+     * A message that fit in the buffer is appended from there. Otherwise the rest of it is
+     * written to the temporary file, which is copied into the log and removed. The record is
+     * not durable until the log is synchronized.
+     *
+     * \throw SpoolError if the message can't be appended.
+     */
+    void MessageWriter::append_to_log( )
+    {
+        try {
+            if( handle == -1 ) {
+                log_location =
+                    message_log->append( queue_id, string_view( buffer.get( ), buffered ));
             }
             else {
+                flush( );
+                struct stat status;
+                if( fstat( handle, &status ) == -1 ) throw SpoolError( "Can't read spool file" );
+                log_location = message_log->append_file(
+                    queue_id, handle, static_cast<uint64_t>( status.st_size ));
+                close( handle );
+                handle = -1;
+                unlinkat( temporary_handle, temporary_name.c_str( ), 0 );
+            }
+        }
+        catch( const runtime_error &e ) {
+            Console::put_exception_line( e.what( ));
+            throw SpoolError( "Can't write message log" );
+        }
+        committed = true;
+    }
 
-                // Sender
-                output << to_string( the_message.get_sender( )) << "\n";
-                output << "=====\n";
 
-                // Recipients
-                const vector<istring> &recipients = the_message.get_recipients( );
-                vector<istring>::const_iterator p;
-                for( p = recipients.begin( ); p != recipients.end( ); ++p ) {
-                    output << to_string( *p ) << "\n";
-                }
-                output << "=====\n";
+    //! Add the committed message to the delivery queue, to be delivered as soon as possible.
+    void MessageWriter::queue_for_delivery( )
+    {
+        SpooledMessage spooled;
+        if( message_log != nullptr )
+            spooled = SpooledMessage{ queue_id, log_location };
+        else
+            spooled = SpooledMessage{ message_path( queue_id + ".msg" ), { 0, 0 } };
+        schedule( spooled );
+    }
+
+
+    //! Prepare to write a new message and write the start of its spool record.
+    /*!
+     * If the spool has a message log the text is kept in the buffer and a temporary file is
+     * only created if the message outgrows it. Otherwise the temporary file is created now.
+     *
+     * \param envelope A message holding the sender and recipients. Its text is not used.
+     * \throw SpoolError if the file can't be created.
+     */
+    MessageWriter::MessageWriter( const Message &envelope ) :
+        buffer( new char[WRITE_BUFFER_SIZE] ), buffered( 0 ), written( 0 ), body_offset( 0 ),
+        queue_id( make_queue_id( ))
+    {
+        temporary_name = queue_id + ".tmp";
+        handle = -1;
+        committed = false;
+        pending = false;
+        error = nullptr;
+        waiting = nullptr;
+        if( message_log == nullptr ) open_file( );
+
+        try {
+            string start;
+            SpoolRecord::encode_envelope( envelope, start );
+            body_offset = start.size( );
+            append( start );
+        }
+        catch( ... ) {
+            if( handle != -1 ) close( handle );
+            unlinkat( temporary_handle, temporary_name.c_str( ), 0 );
+            throw;
+        }
+    }
+
 
-                // Message body.
-                const vector<istring> &text = the_message.get_text( );
-                for( p = text.begin( ); p != text.end( ); ++p ) {
-                    output << to_string( *p ) << "\n";
+    //! Discard the message unless it has been committed.
+    MessageWriter::~MessageWriter( )
+    {
+        if( !committed ) {
+            if( handle != -1 ) close( handle );
+            unlinkat( temporary_handle, temporary_name.c_str( ), 0 );
+        }
+    }
+
+
+    //! Add a line of text to the message. The line must not include a line terminator.
+    void MessageWriter::append_line( string_view line )
+    {
+        append( line );
+        append( "\r\n" );
+    }
+
+
+    //! Add raw message text, including its line terminators, to the message.
+    void MessageWriter::append( string_view data )
+    {
+        while( !data.empty( )) {
+            if( buffered == WRITE_BUFFER_SIZE ) flush( );
+            size_t count = min( data.size( ), WRITE_BUFFER_SIZE - buffered );
+            memcpy( buffer.get( ) + buffered, data.data( ), count );
+            buffered += count;
+            data.remove_prefix( count );
+        }
+    }
+
+
+    //! Begin to make the message durable and part of the spool.
+    /*!
+     * The file is written out and closed. With SPOOL_SYNC=message it is then flushed to stable
+     * storage, put in the spool, and its directory is flushed as well, before this method
+     * returns. If the spool has a message log the message is instead appended to the log, and
+     * with SPOOL_SYNC=message the log is synchronized. Otherwise the message is given to the
+     * committer thread to be made durable with others. The outcome is reported by
+     * finish_commit().
+     *
+     * \param waiting The connection to notify when the commit is complete, if any.
+     * \return true if the commit is in progress. The caller must wait until it is notified (or
+     * see commit()) before it calls finish_commit() or destroys this object.
+     * \throw SpoolError if the file can't be completed.
+     */
+    bool MessageWriter::start_commit( Connection *waiting )
+    {
+        commit_start = chrono::steady_clock::now( );
+        set_body_length( );
+
+        if( message_log != nullptr ) {
+            // The committer appends the message itself, from the buffer if it fits there.
+            if( spool_sync == SYNC_MESSAGE ) {
+                append_to_log( );
+                try {
+                    message_log->sync( );
+                }
+                catch( const runtime_error &e ) {
+                    Console::put_exception_line( e.what( ));
+                    throw SpoolError( "Can't write message log" );
                 }
+                record_commit( commit_start );
+                queue_for_delivery( );
+                return false;
+            }
+        }
+        else if( spool_sync == SYNC_MESSAGE ) {
+            flush( );
+            int result = fsync( handle );
+            close( handle );
+            handle = -1;
+            if( result == -1 ) throw SpoolError( "Can't write spool file" );
+            unsigned bucket = publish( );
+            queue_for_delivery( );
+            if( fsync( bucket_handles[bucket] ) == -1 )
+                throw SpoolError( "Can't write spool directory" );
+            record_commit( commit_start );
+            return false;
+        }
+        else {
+            flush( );
+            if( close( handle ) == -1 ) {
+                handle = -1;
+                throw SpoolError( "Can't write spool file" );
             }
+            handle = -1;
+        }
+
+        this->waiting = waiting;
+        pending = true;
+        pthread_mutex_lock( &commit_lock );
+        commit_queue.push_back( this );
+        pthread_cond_signal( &commit_arrived );
+        pthread_mutex_unlock( &commit_lock );
+        return true;
+    }
+
+
+    //! Report the outcome of a commit that start_commit() began.
+    /*!
+     * \throw SpoolError if the message could not be made durable.
+     */
+    void MessageWriter::finish_commit( )
+    {
+        if( error != nullptr ) throw SpoolError( error );
+
+        ostringstream message_formatter;
+        if( message_log != nullptr )
+            message_formatter << "Wrote message " << queue_id << " to the message log";
+        else
+            message_formatter << "Wrote message to '" << message_path( queue_id + ".msg" ) << "'";
+        Console::put_debug_line( message_formatter.str( ).c_str( ));
+    }
+
+
+    //! Make the message durable and part of the spool, waiting until that is done.
+    /*!
+     * When this method returns the message survives a crash.
+     *
+     * \throw SpoolError if the message can't be committed.
+     */
+    void MessageWriter::commit( )
+    {
+        if( start_commit( nullptr )) {
+            pthread_mutex_lock( &commit_lock );
+            while( pending ) pthread_cond_wait( &commit_done, &commit_lock );
+            pthread_mutex_unlock( &commit_lock );
+        }
+        finish_commit( );
+    }
+
+
+    //! Add an email message to the spool.
+    /*!
+     * This function copies the given email message to non-volatile storage for later delivery.
+     *
+     * \param the_message The email message to add to the spool.
+     * \throw SpoolError if the message can't be written.
+     */
+    void add_message( const Message &the_message )
+    {
+        MessageWriter writer( the_message );
+
+        for( istring_view line : the_message.get_text( )) {
+            writer.append_line( string_view( line.data( ), line.size( )));
         }
-        pthread_mutex_unlock( &spool_lock );
+        writer.commit( );
     }
 
 }
@@ -6,8 +6,16 @@
 #ifndef SPOOL_HPP
 #define SPOOL_HPP
 
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
 #include <stdexcept>
+#include <string>
+#include <string_view>
+#include "Connection.hpp"
 #include "Message.hpp"
+#include "SegmentLog.hpp"
 
 //! Namespace for spool handling facilities.
 /*!
@@ -15,9 +23,47 @@
  * MailFlux currently does not have any concept of local delivery and instead must forward all
  * messages to another mail server. The spool handling functions in this namespace deal with
  * this.
+ *
+ * Each message is identified by a queue ID that is unique over the life of the spool. Its file,
+ * named after the queue ID, is kept in one of 256 subdirectories of the spool directory, chosen
+ * by a hash of the name, so that no one directory becomes large.
+ *
+ * Alternatively (SPOOL_BACKEND=log) the messages are appended as records to a SegmentLog in the
+ * spool's "log" subdirectory, and delivered messages are marked with tombstones rather than
+ * removed. No file is created, named, or removed for a message of ordinary size, so the spool
+ * does not depend on how quickly the file system can change directories. Segments are
+ * SEGMENT_SIZE bytes. Those whose messages have all been delivered are removed by the spool
+ * thread whenever it runs out of messages to deliver.
+ *
+ * The spool thread delivers messages from an in-memory active queue. The queue is built from
+ * the spool at startup and messages are added to it as they are committed, so new mail is
+ * delivered at once, the spool is never scanned again, and the thread sleeps while no message
+ * is due. A message that can't be delivered is moved to a separate deferred queue and tried
+ * again after RETRY_INTERVAL seconds, a delay that doubles with each failed attempt up to
+ * MAX_RETRY_INTERVAL and is shortened by a random amount so that retries are spread out. A
+ * message still undeliverable MAX_QUEUE_LIFETIME seconds after it was spooled is returned to
+ * its sender. A recipient that the next server refuses for good (with a 5xx reply) is returned
+ * to the sender at once and the message is still delivered to the others; a recipient refused
+ * for the time being is tried again with the next attempt. Attempt counts, and which recipients
+ * are finished, are kept in memory only; after a restart every message is tried at once to all
+ * its recipients, but its age is known from its queue ID.
+ *
+ * An attempt also fails, and is retried in the same way, if the next server doesn't accept the
+ * connection within CONNECT_TIMEOUT seconds or doesn't answer some command within REPLY_TIMEOUT
+ * seconds (twice that for the end of the message text). Thus a silent server can't stop the
+ * spool thread from delivering other messages.
+ *
+ * A message is durable before it is acknowledged. By default (SPOOL_SYNC=group) messages that
+ * are committed at about the same time are made durable together by a committer thread, at the
+ * cost of two file system flushes per group rather than two per message. The group is formed
+ * over at most GROUP_COMMIT_WINDOW microseconds and holds at most GROUP_COMMIT_SIZE messages.
+ * With SPOOL_SYNC=message each message is flushed on its own. The console command "spool"
+ * displays histograms of the commit latency and of the group sizes.
  */
 namespace Spool {
 
+    class Committer;
+
     //! Exception for various kinds of runtime problems related to the spool.
     class SpoolError : public std::runtime_error {
     public:
@@ -25,6 +71,78 @@ namespace Spool {
         { }
     };
 
+    //! Class to represent a message being written to the spool.
+    /*!
+     * The message is written in the form of a SpoolRecord. The envelope is written when the
+     * object is created and the record's header is completed when the message is committed. The
+     * message text is written to a temporary file as it arrives, so the text of a message never
+     * has to be held in memory. The file only becomes part of the spool, atomically and durably,
+     * when it is committed. If the object is destroyed before that the file is removed. If the
+     * spool has a message log the temporary file is only created for a message that does not fit
+     * in the writer's buffer.
+     *
+     * A connection commits a message without blocking its event loop: start_commit() hands the
+     * message to the committer, the connection waits in Connection::wait_event() until it is
+     * notified, and finish_commit() then reports the outcome. The object must not be destroyed
+     * in between. Other callers can simply use commit().
+     */
+    class MessageWriter {
+    public:
+        explicit MessageWriter( const Message &envelope );
+
+        ~MessageWriter( );
+
+        void append_line( std::string_view line );
+
+        void append( std::string_view data );
+
+        void commit( );
+
+        bool start_commit( Connection *waiting );
+
+        void finish_commit( );
+
+        //! Return the queue ID that identifies the message in the spool and in the log.
+        [[nodiscard]] const std::string &get_queue_id( ) const
+        { return queue_id; }
+
+    private:
+        friend class Committer;
+
+        std::unique_ptr<char[]> buffer;          //!< Output buffer for the file (or the log).
+        std::size_t             buffered;        //!< Number of characters in the buffer.
+        std::uint64_t           written;         //!< Number of characters in the file.
+        std::uint64_t           body_offset;     //!< Where the text starts in the spool record.
+        std::string             queue_id;
+        std::string             temporary_name;  //!< Name of the file while it is written.
+        int                     handle;          //!< The temporary file, or -1 if not open.
+        bool                    committed;       //!< True once the file is in the spool.
+        SegmentLog::Location    log_location;    //!< The record, once it is in the message log.
+
+        // The state of a commit. Set by the committer while the message is in a group.
+        bool        pending;                     //!< True while the committer has the message.
+        const char *error;                       //!< Why the commit failed, or null.
+        Connection *waiting;                     //!< Notified when the commit is complete.
+        std::chrono::steady_clock::time_point commit_start;
+
+        void open_file( );
+
+        void flush( );
+
+        void set_body_length( );
+
+        unsigned publish( );
+
+        void append_to_log( );
+
+        void queue_for_delivery( );
+
+        // Make copying illegal.
+        MessageWriter( const MessageWriter & );
+
+        MessageWriter &operator=( const MessageWriter & );
+    };
+
     void initialize( );
 
     void add_message( const Message &the_message );
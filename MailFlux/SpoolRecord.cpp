@@ -0,0 +1,318 @@
+/*! \file    SpoolRecord.cpp
+ *  \brief   Implementation of the binary form of spooled messages.
+ *  \author  Peter Chapin <spicacality@kelseymountain.org>
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "SpoolRecord.hpp"
+
+using namespace std;
+
+// Anonymous namespace for module private items.
+namespace {
+
+    const char RECORD_MAGIC[4] = { 'M', 'F', 'S', 'P' };
+
+    [[noreturn]] void record_error( const char *what )
+    {
+        ostringstream formatter;
+        formatter << what << ": " << strerror( errno );
+        throw runtime_error( formatter.str( ));
+    }
+
+}   // End of anonymous namespace.
+
+
+// === Private Methods ===
+
+//! Check that the record is complete and find its parts.
+/*!
+ * \throw std::runtime_error if the record is not a spool record of a known version or if any of
+ * its parts extends past its end.
+ */
+void SpoolRecord::check( )
+{
+    if( !is_record( data )) throw runtime_error( "Not a spool record" );
+
+    Header header;
+    memcpy( &header, data.data( ), sizeof( header ));
+    if( header.version == 0 || header.version > VERSION )
+        throw runtime_error( "Unknown spool record version" );
+
+    // The sizes are at most 32 bits, so the sums below can't overflow.
+    uint64_t size = data.size( );
+    uint64_t sender_offset = uint64_t( header.header_size ) +
+                             uint64_t( header.recipient_count ) * sizeof( RecipientEntry );
+    if( header.header_size < sizeof( Header ) || sender_offset + header.sender_length > size ||
+        header.body_offset > size || header.body_length > size - header.body_offset )
+        throw runtime_error( "Damaged spool record" );
+
+    count  = header.recipient_count;
+    table  = data.data( ) + header.header_size;
+    sender = data.substr( sender_offset, header.sender_length );
+    body   = data.substr( header.body_offset, header.body_length );
+    for( size_t i = 0; i < count; ++i ) {
+        RecipientEntry entry;
+        memcpy( &entry, table + i * sizeof( entry ), sizeof( entry ));
+        if( uint64_t( entry.offset ) + entry.length > size )
+            throw runtime_error( "Damaged spool record" );
+    }
+}
+
+
+//! Index the header of the message text if that hasn't been done yet.
+void SpoolRecord::index_header( ) const
+{
+    if( header_indexed ) return;
+    header_indexed = true;
+
+    size_t start = 0;
+    while( start < body.size( )) {
+        size_t end = body.find( '\n', start );
+        size_t length = ( end == string_view::npos ? body.size( ) : end ) - start;
+        if( length > 0 && body[start + length - 1] == '\r' ) --length;
+        if( !header_index.add_line( body.data( ), start, length )) break;
+        if( end == string_view::npos ) break;
+        start = end + 1;
+    }
+}
+
+
+//! Examine a record in memory.
+/*!
+ * \param record The record. It must remain valid while this object is used.
+ * \throw std::runtime_error if the record is not valid.
+ */
+SpoolRecord::SpoolRecord( string_view record ) :
+    data( record ), mapping( nullptr ), header_indexed( false )
+{
+    check( );
+}
+
+
+//! Examine a record in a file by mapping the file into memory.
+/*!
+ * \param file_name The name of the file.
+ * \throw std::runtime_error if the file can't be mapped or the record is not valid.
+ */
+SpoolRecord::SpoolRecord( const string &file_name ) :
+    mapping( nullptr ), header_indexed( false )
+{
+    int handle = open( file_name.c_str( ), O_RDONLY | O_CLOEXEC );
+    if( handle == -1 ) record_error( "Can't open spool record" );
+
+    struct stat status;
+    if( fstat( handle, &status ) == -1 ) {
+        close( handle );
+        record_error( "Can't examine spool record" );
+    }
+    if( static_cast<size_t>( status.st_size ) < sizeof( Header )) {
+        close( handle );
+        throw runtime_error( "Not a spool record" );
+    }
+
+    size_t size = static_cast<size_t>( status.st_size );
+    void *address = mmap( nullptr, size, PROT_READ, MAP_PRIVATE, handle, 0 );
+    close( handle );
+    if( address == MAP_FAILED ) record_error( "Can't map spool record" );
+
+    mapping = address;
+    data = string_view( static_cast<const char *>( address ), size );
+    try {
+        check( );
+    }
+    catch( ... ) {
+        munmap( mapping, data.size( ));
+        throw;
+    }
+}
+
+
+//! Release the record's mapping, if it has one.
+SpoolRecord::~SpoolRecord( )
+{
+    if( mapping != nullptr ) munmap( mapping, data.size( ));
+}
+
+
+//! Return true if the given data starts with the header of a spool record.
+bool SpoolRecord::is_record( string_view data )
+{
+    return data.size( ) >= sizeof( Header ) &&
+           memcmp( data.data( ), RECORD_MAGIC, sizeof( RECORD_MAGIC )) == 0;
+}
+
+
+//! Make the start of a record: everything but the message text.
+/*!
+ * The Header's body_offset is the size of the result. Its body_length is zero; it must be set
+ * once the length of the text is known.
+ *
+ * \param envelope A message holding the sender and recipients. Its text is not used.
+ * \param result The start of the record. Its previous contents are replaced.
+ */
+void SpoolRecord::encode_envelope( const Message &envelope, string &result )
+{
+    size_t count = envelope.get_recipients( ).size( );
+    istring_view sender_address = envelope.get_sender( );
+
+    Header header;
+    memcpy( header.magic, RECORD_MAGIC, sizeof( RECORD_MAGIC ));
+    header.version = VERSION;
+    header.header_size = sizeof( Header );
+    header.recipient_count = static_cast<uint32_t>( count );
+    header.sender_length = static_cast<uint32_t>( sender_address.size( ));
+    header.body_offset = 0;
+    header.body_length = 0;
+
+    result.assign( reinterpret_cast<const char *>( &header ), sizeof( header ));
+    result.resize( sizeof( header ) + count * sizeof( RecipientEntry ));
+    result.append( sender_address.data( ), sender_address.size( ));
+
+    size_t index = 0;
+    for( const Message::DomainGroup &group : envelope.get_domains( )) {
+        for( const Message::Recipient *recipient : group.members ) {
+            RecipientEntry entry;
+            entry.offset = static_cast<uint32_t>( result.size( ));
+            entry.length = static_cast<uint32_t>( recipient->address.size( ));
+            memcpy( result.data( ) + sizeof( header ) + index * sizeof( entry ),
+                &entry, sizeof( entry ));
+            result.append( recipient->address.data( ), recipient->address.size( ));
+            ++index;
+        }
+    }
+
+    header.body_offset = result.size( );
+    memcpy( result.data( ), &header, sizeof( header ));
+}
+
+
+//! Make a record from a message in the text form used by earlier versions of MailFlux.
+/*!
+ * The text form is the sender, a line of "=====", the recipients (one per line), another line
+ * of "=====", and then the message text. The message text is kept as it is.
+ *
+ * \param text The message in text form.
+ * \param result The record. Its previous contents are replaced.
+ */
+void SpoolRecord::convert_text( string_view text, string &result )
+{
+    // Return the next line of the text, without its terminator.
+    auto next_line = [&text]( ) {
+        size_t end = text.find( '\n' );
+        istring_view line( text.data( ), min( end, text.size( )));
+        text.remove_prefix( end == string_view::npos ? text.size( ) : end + 1 );
+        if( !line.empty( ) && line.back( ) == '\r' ) line.remove_suffix( 1 );
+        return line;
+    };
+
+    Message envelope;
+    envelope.set_sender( next_line( ));
+    next_line( );
+    while( !text.empty( )) {
+        istring_view line = next_line( );
+        if( line == "=====" ) break;
+        envelope.add_recipient( line );
+    }
+
+    encode_envelope( envelope, result );
+    result.append( text );
+    uint64_t body_length = text.size( );
+    memcpy( result.data( ) + offsetof( Header, body_length ), &body_length, sizeof( body_length ));
+}
+
+
+//! Return the address of one of the recipients.
+/*!
+ * \param index The recipient, counting from zero. It must be less than recipient_count().
+ */
+string_view SpoolRecord::get_recipient( size_t index ) const
+{
+    RecipientEntry entry;
+    memcpy( &entry, table + index * sizeof( entry ), sizeof( entry ));
+    return data.substr( entry.offset, entry.length );
+}
+
+
+//! Return the number of fields in the header of the message text.
+size_t SpoolRecord::header_count( ) const
+{
+    index_header( );
+    return header_index.size( );
+}
+
+
+//! Return the name of the header field with the given index, counting from zero.
+istring_view SpoolRecord::get_header_name( size_t index ) const
+{
+    index_header( );
+    return header_index.get_name( body.data( ), index );
+}
+
+
+//! Return the value of the header field with the given index, counting from zero.
+/*!
+ * Leading white space is not included in the value. The value of a folded field includes its
+ * line breaks.
+ */
+istring_view SpoolRecord::get_header_value( size_t index ) const
+{
+    index_header( );
+    return header_index.get_value( body.data( ), index );
+}
+
+
+//! Return the header field with the given index as it appears in the text.
+/*!
+ * The field runs from the start of its name to the end of its last line, not including that
+ * line's terminator.
+ */
+string_view SpoolRecord::get_header_field( size_t index ) const
+{
+    index_header( );
+    const HeaderIndex::Field &field = header_index[index];
+    return body.substr( field.name_offset, field.value_end - field.name_offset );
+}
+
+
+//! Look up one of the common header fields.
+/*!
+ * \param which The field wanted.
+ * \param value Receives the value of the field's first occurrence.
+ * \return true if the field is present.
+ */
+bool SpoolRecord::find_header( HeaderIndex::common_header which, istring_view &value ) const
+{
+    index_header( );
+    int index = header_index.find( which );
+    if( index < 0 ) return false;
+    value = header_index.get_value( body.data( ), static_cast<size_t>( index ));
+    return true;
+}
+
+
+//! Look up a header field by name. The name is compared without regard to case.
+/*!
+ * \param name The name of the field wanted.
+ * \param value Receives the value of the field's first occurrence.
+ * \return true if the field is present.
+ */
+bool SpoolRecord::find_header( istring_view name, istring_view &value ) const
+{
+    index_header( );
+    int index = header_index.find( body.data( ), name );
+    if( index < 0 ) return false;
+    value = header_index.get_value( body.data( ), static_cast<size_t>( index ));
+    return true;
+}
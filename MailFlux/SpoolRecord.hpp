@@ -0,0 +1,118 @@
+/*! \file    SpoolRecord.hpp
+ *  \brief   Interface to the binary form of spooled messages.
+ *  \author  Peter Chapin <spicacality@kelseymountain.org>
+ */
+
+#ifndef SPOOLRECORD_HPP
+#define SPOOLRECORD_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include "HeaderIndex.hpp"
+#include "Message.hpp"
+
+//! Class to represent a message in the form in which it is spooled.
+/*!
+ * A spool record is a fixed size Header, a table giving the offset and length of each
+ * recipient's address, the sender's address, the recipients' addresses, and then the text of
+ * the message exactly as it was received. All offsets are from the start of the record and all
+ * numbers are in native byte order. The recipients are stored grouped by domain, in the order
+ * given by Message::get_domains(), so that they can be sent in that order.
+ *
+ * A SpoolRecord object examines a record in place: the sender, the recipients, and the text are
+ * returned as views of the record, which is only checked, never parsed or copied. A record in a
+ * file is mapped into memory. A record in memory (for example in a SegmentLog) must outlive the
+ * object.
+ *
+ * The header of the message text is indexed, with a HeaderIndex, when one of its fields is
+ * first wanted. Since the text keeps its line terminators, the value of a folded field includes
+ * its line breaks; removing each CR LF that is followed by white space unfolds it.
+ *
+ * Records whose version is newer than VERSION are rejected. A later version may lengthen the
+ * Header; header_size says where the rest of the record starts.
+ */
+class SpoolRecord {
+public:
+    //! The version of the record format that is written.
+    static const std::uint16_t VERSION = 1;
+
+    //! The fixed part at the start of every record.
+    struct Header {
+        char          magic[4];         //!< Always "MFSP".
+        std::uint16_t version;
+        std::uint16_t header_size;      //!< Offset of the recipient table.
+        std::uint32_t recipient_count;
+        std::uint32_t sender_length;    //!< The sender's address follows the recipient table.
+        std::uint64_t body_offset;      //!< Offset of the message text.
+        std::uint64_t body_length;      //!< Length of the message text.
+    };
+
+    //! An entry of the recipient table.
+    struct RecipientEntry {
+        std::uint32_t offset;
+        std::uint32_t length;
+    };
+
+    explicit SpoolRecord( std::string_view record );
+
+    explicit SpoolRecord( const std::string &file_name );
+
+    ~SpoolRecord( );
+
+    static bool is_record( std::string_view data );
+
+    static void encode_envelope( const Message &envelope, std::string &result );
+
+    static void convert_text( std::string_view text, std::string &result );
+
+    //! Return the address of the message's sender.
+    [[nodiscard]] std::string_view get_sender( ) const
+    { return sender; }
+
+    //! Return the number of recipients.
+    [[nodiscard]] std::size_t recipient_count( ) const
+    { return count; }
+
+    std::string_view get_recipient( std::size_t index ) const;
+
+    //! Return the message text, with its line terminators.
+    [[nodiscard]] std::string_view get_body( ) const
+    { return body; }
+
+    std::size_t header_count( ) const;
+
+    istring_view get_header_name( std::size_t index ) const;
+
+    istring_view get_header_value( std::size_t index ) const;
+
+    std::string_view get_header_field( std::size_t index ) const;
+
+    bool find_header( HeaderIndex::common_header which, istring_view &value ) const;
+
+    bool find_header( istring_view name, istring_view &value ) const;
+
+private:
+    std::string_view data;          //!< The whole record.
+    void            *mapping;       //!< The mapped file, or nullptr.
+    std::size_t      count;
+    const char      *table;         //!< The recipient table, which may not be aligned.
+    std::string_view sender;
+    std::string_view body;
+
+    // The header index is built by index_header() on first use.
+    mutable HeaderIndex header_index;
+    mutable bool        header_indexed;
+
+    void check( );
+
+    void index_header( ) const;
+
+    // Make copying illegal.
+    SpoolRecord( const SpoolRecord & );
+
+    SpoolRecord &operator=( const SpoolRecord & );
+};
+
+#endif
@@ -0,0 +1,157 @@
+/*! \file    Task.hpp
+ *  \brief   Coroutine task type used by the connection classes.
+ *  \author  Peter Chapin <spicacality@kelseymountain.org>
+ */
+
+#ifndef TASK_HPP
+#define TASK_HPP
+
+#include <coroutine>
+#include <exception>
+#include <type_traits>
+#include <utility>
+
+template<typename T> class Task;
+
+namespace TaskDetails {
+
+    //! Resumes whoever is awaiting a finished task, if anyone.
+    struct FinalAwaiter {
+        bool await_ready( ) const noexcept
+        { return false; }
+
+        template<typename Promise>
+        std::coroutine_handle<> await_suspend( std::coroutine_handle<Promise> finished ) noexcept
+        {
+            std::coroutine_handle<> continuation = finished.promise( ).continuation;
+            return continuation ? continuation : std::noop_coroutine( );
+        }
+
+        void await_resume( ) const noexcept
+        { }
+    };
+
+    //! The parts of a task's promise that don't depend on the result type.
+    struct PromiseBase {
+        std::coroutine_handle<> continuation;  //!< The coroutine awaiting this task, if any.
+        std::exception_ptr      exception;     //!< Exception that escaped the task, if any.
+
+        std::suspend_always initial_suspend( ) const noexcept
+        { return { }; }
+
+        FinalAwaiter final_suspend( ) const noexcept
+        { return { }; }
+
+        void unhandled_exception( ) noexcept
+        { exception = std::current_exception( ); }
+    };
+
+    template<typename T>
+    struct Promise : PromiseBase {
+        T value{ };
+
+        Task<T> get_return_object( );
+
+        void return_value( T result )
+        { value = std::move( result ); }
+    };
+
+    template<>
+    struct Promise<void> : PromiseBase {
+        Task<void> get_return_object( );
+
+        void return_void( ) const noexcept
+        { }
+    };
+
+}
+
+
+//! A lazily started coroutine.
+/*!
+ * A task does not run until it is either started with start() or awaited by another coroutine.
+ * When an awaited task finishes, control transfers directly back to the awaiting coroutine.
+ * Exceptions that escape a task are rethrown in the awaiting coroutine, or by rethrow() for a
+ * task that was started directly. The coroutine frame is destroyed with the Task object.
+ *
+ * Tasks are resumed by whatever event they are waiting for (see the awaitables in
+ * Connection.hpp), so they run on whichever event loop thread delivers that event.
+ */
+template<typename T = void>
+class Task {
+public:
+    using promise_type = TaskDetails::Promise<T>;
+
+    Task( ) = default;
+
+    explicit Task( std::coroutine_handle<promise_type> coroutine ) : handle( coroutine )
+    { }
+
+    Task( Task &&other ) noexcept : handle( std::exchange( other.handle, nullptr ))
+    { }
+
+    Task &operator=( Task &&other ) noexcept
+    {
+        if( this != &other ) {
+            if( handle ) handle.destroy( );
+            handle = std::exchange( other.handle, nullptr );
+        }
+        return *this;
+    }
+
+    ~Task( )
+    { if( handle ) handle.destroy( ); }
+
+    //! Run a task that is not awaited by another coroutine until its first suspension.
+    void start( )
+    { handle.resume( ); }
+
+    //! Return true if the task has finished (normally or by exception).
+    [[nodiscard]] bool done( ) const
+    { return !handle || handle.done( ); }
+
+    //! Rethrow the exception that ended the task, if there was one.
+    void rethrow( ) const
+    {
+        if( handle && handle.promise( ).exception )
+            std::rethrow_exception( handle.promise( ).exception );
+    }
+
+    // Awaiting a task runs it and suspends the awaiting coroutine until it finishes.
+    bool await_ready( ) const noexcept
+    { return false; }
+
+    std::coroutine_handle<> await_suspend( std::coroutine_handle<> awaiting ) noexcept
+    {
+        handle.promise( ).continuation = awaiting;
+        return handle;
+    }
+
+    T await_resume( )
+    {
+        rethrow( );
+        if constexpr( !std::is_void_v<T> ) return std::move( handle.promise( ).value );
+    }
+
+private:
+    std::coroutine_handle<promise_type> handle;
+
+    // Make copying illegal.
+    Task( const Task & );
+
+    Task &operator=( const Task & );
+};
+
+
+namespace TaskDetails {
+
+    template<typename T>
+    Task<T> Promise<T>::get_return_object( )
+    { return Task<T>( std::coroutine_handle<Promise<T>>::from_promise( *this )); }
+
+    inline Task<void> Promise<void>::get_return_object( )
+    { return Task<void>( std::coroutine_handle<Promise<void>>::from_promise( *this )); }
+
+}
+
+#endif
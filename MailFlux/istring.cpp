@@ -0,0 +1,305 @@
+/*! \file    istring.cpp
+ *  \brief   Comparison, search, and input operations of case insensitive strings.
+ *  \author  Peter Chapin <spicacality@kelseymountain.org>
+ *
+ * On x86-64 the ASCII operations examine a block of characters at a time: 16 with SSE2, which
+ * every such processor has, or 32 with AVX2 if the processor running the program has it. The
+ * AVX2 versions are compiled for that instruction set alone and are chosen when the program
+ * starts, so the program needs no special compiler options and runs on any x86-64 processor.
+ * The case of a whole block is folded without branches by adding 0x20 to each byte in the range
+ * 'A'..'Z'. The characters that don't fill a block are handled one at a time. On other
+ * processors all characters are handled one at a time.
+ */
+
+#include <cctype>
+#include <cstdio>
+#include "istring.hpp"
+
+#if defined( __x86_64__ )
+#include <immintrin.h>
+#endif
+
+// Anonymous namespace for module private items.
+namespace {
+
+    inline int folded( char c )
+    { return ichar_traits::fold( static_cast<unsigned char>( c )); }
+
+#if defined( __x86_64__ )
+
+    // Each of the functions below examines whole blocks only. The mismatch functions return
+    // the position of the first pair of characters that differ (ignoring case) or, if there is
+    // none, the number of characters examined. The find functions return the position of the
+    // first character that matches the target or the number of characters examined. The AVX2
+    // functions finish with a 16 character block if there is room for one, which matters for
+    // strings as short as most addresses. The 16 character helpers are always inlined so that
+    // the AVX2 functions don't call code using the older SSE encoding, which can be very slow
+    // right after AVX2 instructions.
+
+    //! Return the lower case form of a block of 16 characters.
+    __attribute__(( always_inline ))
+    inline __m128i fold_16( __m128i b )
+    {
+        // Bytes in 'A'..'Z' are moved to the bottom of the signed range and then picked out.
+        __m128i shifted = _mm_add_epi8( b, _mm_set1_epi8( static_cast<char>( 0x80 - 'A' )));
+        __m128i upper = _mm_cmplt_epi8( shifted, _mm_set1_epi8( static_cast<char>( -128 + 26 )));
+        return _mm_or_si128( b, _mm_and_si128( upper, _mm_set1_epi8( 0x20 )));
+    }
+
+    __attribute__(( always_inline ))
+    inline __m128i load_16( const char *p )
+    { return _mm_loadu_si128( reinterpret_cast<const __m128i *>( p )); }
+
+    size_t sse2_mismatch( const char *s1, const char *s2, size_t n )
+    {
+        size_t i = 0;
+        for( ; i + 16 <= n; i += 16 ) {
+            unsigned mask = static_cast<unsigned>( _mm_movemask_epi8(
+                _mm_cmpeq_epi8( fold_16( load_16( s1 + i )), fold_16( load_16( s2 + i )))));
+            if( mask != 0xFFFFu ) return i + __builtin_ctz( ~mask );
+        }
+        return i;
+    }
+
+    size_t sse2_find( const char *s, size_t n, int target )
+    {
+        __m128i wanted = _mm_set1_epi8( static_cast<char>( target ));
+        size_t i = 0;
+        for( ; i + 16 <= n; i += 16 ) {
+            unsigned mask = static_cast<unsigned>(
+                _mm_movemask_epi8( _mm_cmpeq_epi8( fold_16( load_16( s + i )), wanted )));
+            if( mask != 0 ) return i + __builtin_ctz( mask );
+        }
+        return i;
+    }
+
+    //! Return the lower case form of a block of 32 characters.
+    __attribute__(( target( "avx2" )))
+    inline __m256i fold_32( __m256i b )
+    {
+        __m256i shifted = _mm256_add_epi8( b, _mm256_set1_epi8( static_cast<char>( 0x80 - 'A' )));
+        __m256i upper = _mm256_cmpgt_epi8(
+            _mm256_set1_epi8( static_cast<char>( -128 + 26 )), shifted );
+        return _mm256_or_si256( b, _mm256_and_si256( upper, _mm256_set1_epi8( 0x20 )));
+    }
+
+    __attribute__(( target( "avx2" )))
+    inline __m256i load_32( const char *p )
+    { return _mm256_loadu_si256( reinterpret_cast<const __m256i *>( p )); }
+
+    __attribute__(( target( "avx2" )))
+    size_t avx2_mismatch( const char *s1, const char *s2, size_t n )
+    {
+        size_t i = 0;
+        for( ; i + 32 <= n; i += 32 ) {
+            unsigned mask = static_cast<unsigned>( _mm256_movemask_epi8(
+                _mm256_cmpeq_epi8( fold_32( load_32( s1 + i )), fold_32( load_32( s2 + i )))));
+            if( mask != 0xFFFFFFFFu ) return i + __builtin_ctz( ~mask );
+        }
+        if( i + 16 <= n ) {
+            unsigned mask = static_cast<unsigned>( _mm_movemask_epi8(
+                _mm_cmpeq_epi8( fold_16( load_16( s1 + i )), fold_16( load_16( s2 + i )))));
+            if( mask != 0xFFFFu ) return i + __builtin_ctz( ~mask );
+            i += 16;
+        }
+        return i;
+    }
+
+    __attribute__(( target( "avx2" )))
+    size_t avx2_find( const char *s, size_t n, int target )
+    {
+        __m256i wanted = _mm256_set1_epi8( static_cast<char>( target ));
+        size_t i = 0;
+        for( ; i + 32 <= n; i += 32 ) {
+            unsigned mask = static_cast<unsigned>(
+                _mm256_movemask_epi8( _mm256_cmpeq_epi8( fold_32( load_32( s + i )), wanted )));
+            if( mask != 0 ) return i + __builtin_ctz( mask );
+        }
+        if( i + 16 <= n ) {
+            unsigned mask = static_cast<unsigned>( _mm_movemask_epi8(
+                _mm_cmpeq_epi8( fold_16( load_16( s + i )), _mm256_castsi256_si128( wanted ))));
+            if( mask != 0 ) return i + __builtin_ctz( mask );
+            i += 16;
+        }
+        return i;
+    }
+
+    //! Return true if the processor running the program has AVX2.
+    bool detect_avx2( )
+    {
+        __builtin_cpu_init( );
+        return __builtin_cpu_supports( "avx2" );
+    }
+
+    const bool have_avx2 = detect_avx2( );
+
+    // Strings compared while static objects are initialized, before this is set, use SSE2.
+    ichar_traits::instruction_set block_instructions =
+        have_avx2 ? ichar_traits::AVX2 : ichar_traits::SSE2;
+
+    inline size_t block_mismatch( const char *s1, const char *s2, size_t n )
+    {
+        switch( block_instructions ) {
+            case ichar_traits::AVX2: return avx2_mismatch( s1, s2, n );
+            case ichar_traits::SSE2: return sse2_mismatch( s1, s2, n );
+            default                : return 0;
+        }
+    }
+
+    inline size_t block_find( const char *s, size_t n, int target )
+    {
+        switch( block_instructions ) {
+            case ichar_traits::AVX2: return avx2_find( s, n, target );
+            case ichar_traits::SSE2: return sse2_find( s, n, target );
+            default                : return 0;
+        }
+    }
+
+    //! Return true if the processor running the program has the instructions.
+    bool available( ichar_traits::instruction_set which )
+    { return which != ichar_traits::AVX2 || have_avx2; }
+
+#else
+
+    ichar_traits::instruction_set block_instructions = ichar_traits::SCALAR;
+
+    inline size_t block_mismatch( const char *, const char *, size_t )
+    { return 0; }
+
+    inline size_t block_find( const char *, size_t, int )
+    { return 0; }
+
+    bool available( ichar_traits::instruction_set which )
+    { return which == ichar_traits::SCALAR; }
+
+#endif
+
+}   // End of anonymous namespace.
+
+
+//! Choose the instructions used by the ASCII comparisons and searches.
+/*!
+ * Like use_locale(), this must be called before any threads start.
+ *
+ * \param which The instructions to use. SCALAR handles one character at a time.
+ * \return false, and nothing is changed, if the processor doesn't have the instructions.
+ */
+bool ichar_traits::use_instructions( instruction_set which )
+{
+    if( !available( which )) return false;
+    block_instructions = which;
+    return true;
+}
+
+
+//! Compare two arrays of characters, ignoring the case of ASCII letters.
+/*!
+ * \return A negative value, zero, or a positive value if s1 is less than, equal to, or greater
+ * than s2. Characters are ordered by the values of their lower case forms as unsigned char.
+ */
+int ichar_traits::ascii_compare( const char_type *s1, const char_type *s2, size_t n )
+{
+    for( size_t i = block_mismatch( s1, s2, n ); i < n; ++i ) {
+        int c1 = folded( s1[i] );
+        int c2 = folded( s2[i] );
+        if( c1 != c2 ) return ( c1 < c2 ) ? -1 : +1;
+    }
+    return 0;
+}
+
+
+//! Compare two arrays of characters with std::tolower.
+int ichar_traits::locale_compare( const char_type *s1, const char_type *s2, size_t n )
+{
+    for( size_t i = 0; i < n; ++i ) {
+        int c1 = to_lower( s1[i] );
+        int c2 = to_lower( s2[i] );
+        if( c1 != c2 ) return ( c1 < c2 ) ? -1 : +1;
+    }
+    return 0;
+}
+
+
+//! Find a character in an array, ignoring the case of ASCII letters.
+/*!
+ * \return A pointer to the first occurrence of the character or nullptr if there is none.
+ */
+const ichar_traits::char_type *ichar_traits::ascii_find(
+    const char_type *s, size_t n, char_type a )
+{
+    int target = folded( a );
+    for( size_t i = block_find( s, n, target ); i < n; ++i ) {
+        if( folded( s[i] ) == target ) return s + i;
+    }
+    return nullptr;
+}
+
+
+//! Find a character in an array with std::tolower.
+const ichar_traits::char_type *ichar_traits::locale_find(
+    const char_type *s, size_t n, char_type a )
+{
+    int target = to_lower( a );
+    for( size_t i = 0; i < n; ++i ) {
+        if( to_lower( s[i] ) == target ) return s + i;
+    }
+    return nullptr;
+}
+
+
+//! Read a whitespace delimited word from a stream, as operator>> does for std::string.
+std::istream &operator>>( std::istream &is, istring &s )
+{
+    std::istream::sentry ready( is );
+    if( !ready ) return is;
+
+    std::streambuf *buffer = is.rdbuf( );
+    std::ios_base::iostate state = std::ios_base::goodbit;
+    s.clear( );
+    while( true ) {
+        int c = buffer->sgetc( );
+        if( c == EOF ) {
+            state |= std::ios_base::eofbit;
+            break;
+        }
+        if( std::isspace( c )) break;
+        s.push_back( static_cast<char>( c ));
+        buffer->sbumpc( );
+    }
+    if( s.empty( )) state |= std::ios_base::failbit;
+    is.setstate( state );
+    return is;
+}
+
+
+//! Read a line from a stream, as std::getline does for std::string.
+/*!
+ * The characters are moved directly from the stream's buffer into the string.
+ *
+ * \param is The stream to read.
+ * \param line Receives the line without its delimiter.
+ * \param delimiter The character that ends the line. It is extracted but not stored.
+ */
+std::istream &getline( std::istream &is, istring &line, char delimiter )
+{
+    std::istream::sentry ready( is, true );
+    line.clear( );
+    if( !ready ) return is;
+
+    std::streambuf *buffer = is.rdbuf( );
+    std::ios_base::iostate state = std::ios_base::goodbit;
+    bool extracted = false;
+    while( true ) {
+        int c = buffer->sbumpc( );
+        if( c == EOF ) {
+            state |= std::ios_base::eofbit;
+            if( !extracted ) state |= std::ios_base::failbit;
+            break;
+        }
+        extracted = true;
+        if( c == static_cast<unsigned char>( delimiter )) break;
+        line.push_back( static_cast<char>( c ));
+    }
+    is.setstate( state );
+    return is;
+}
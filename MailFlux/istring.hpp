@@ -7,7 +7,11 @@
 #define ISTRING_HPP
 
 #include <cctype>
+#include <cstddef>
+#include <istream>
+#include <ostream>
 #include <string>
+#include <string_view>
 
 //! Character traits type with case insensitive comparisons.
 /*!
@@ -15,44 +19,105 @@
  * specialization of std::string is provided using this customized character traits type. This
  * type inherits from the standard character traits and only provides new implementations for
  * the operations pertaining to character comparisons.
+ *
+ * By default only the ASCII letters are folded. This is all SMTP requires and it allows long
+ * comparisons and searches to be done 16 or 32 characters at a time with vector instructions
+ * (see istring.cpp). If use_locale() is called the case of characters is instead folded with
+ * std::tolower, one character at a time, according to the current C locale. Either way every
+ * character is folded as an unsigned char, so the comparisons and istring_hash agree.
+ *
+ * The best block instructions the processor has are used unless use_instructions() chooses
+ * others. This is meant for tests and benchmarks; the results are the same either way.
  */
 struct ichar_traits : std::char_traits<char> {
 
+  //! Instructions that the ASCII comparisons and searches can use.
+  enum instruction_set { SCALAR, SSE2, AVX2 };
+
+  //! Fold the case of characters with std::tolower. Must be called before any threads start.
+  static void use_locale( bool enabled )
+    { locale_folding = enabled; }
+
+  static bool use_instructions( instruction_set which );
+
+  //! Return the lower case form of an ASCII letter; return other characters unchanged.
+  static int fold( int c )
+    { return( c + ( ( static_cast<unsigned>( c - 'A' ) < 26u ) << 5 ) ); }
+
+  //! Return the form of a character that is used in comparisons.
+  static int to_lower( char c )
+  {
+    unsigned char u = static_cast<unsigned char>( c );
+    return( locale_folding ? std::tolower( u ) : fold( u ) );
+  }
+
   static bool eq( const char_type &c1, const char_type &c2 )
-    { return( std::tolower( c1 ) == std::tolower( c2 ) ); }
+    { return( to_lower( c1 ) == to_lower( c2 ) ); }
 
   static bool lt( const char_type &c1, const char_type &c2 )
-    { return( std::tolower( c1 ) < std::tolower( c2 ) ); }
+    { return( to_lower( c1 ) < to_lower( c2 ) ); }
 
   static int compare( const char_type *s1, const char_type *s2, size_t n )
   {
-    for( size_t i = 0; i < n; ++i ) {
-      if( std::tolower( *s1 ) < std::tolower( *s2 ) ) return( -1 );
-      if( std::tolower( *s1 ) > std::tolower( *s2 ) ) return( +1 );
-      ++s1; ++s2;
-    }
-    return( 0 );
+    if( locale_folding ) return( locale_compare( s1, s2, n ) );
+    return( ascii_compare( s1, s2, n ) );
   }
 
   static const char_type *find( const char_type *s, size_t n, const char_type &a )
   {
-    const char_type *result = nullptr;
-    for( size_t i = 0; i < n; ++i ) {
-      if( std::tolower( *s ) == std::tolower( a ) ) {
-        result = s;
-        break;
-      }
-      ++s;
-    }
-    return( result );
+    if( locale_folding ) return( locale_find( s, n, a ) );
+    return( ascii_find( s, n, a ) );
   }
 
+  //! Compare characters as returned by to_int_type(), which are unsigned char values, or EOF.
   static bool eq_int_type( const int_type &c1, const int_type &c2 )
-    { return( std::tolower( c1 ) == std::tolower( c2 ) ); }
+  {
+    if( c1 == eof( ) || c2 == eof( ) ) return( c1 == c2 );
+    return( to_lower( to_char_type( c1 ) ) == to_lower( to_char_type( c2 ) ) );
+  }
+
+private:
+  static inline bool locale_folding = false;
 
+  static int ascii_compare( const char_type *s1, const char_type *s2, size_t n );
+  static int locale_compare( const char_type *s1, const char_type *s2, size_t n );
+  static const char_type *ascii_find( const char_type *s, size_t n, char_type a );
+  static const char_type *locale_find( const char_type *s, size_t n, char_type a );
 };
 
 //! Definition of case insensitive string type.
 typedef std::basic_string<char, ichar_traits> istring;
 
+//! Definition of case insensitive string view type.
+typedef std::basic_string_view<char, ichar_traits> istring_view;
+
+//! Hash function for case insensitive strings. Strings that compare equal have equal hashes.
+struct istring_hash {
+  std::size_t operator()( istring_view s ) const
+  {
+    // FNV-1a.
+    std::size_t hash = 14695981039346656037ULL;
+    for( char c : s ) {
+      hash ^= static_cast<std::size_t>( ichar_traits::to_lower( c ) );
+      hash *= 1099511628211ULL;
+    }
+    return( hash );
+  }
+};
+
+// Case insensitive strings are read and written with the ordinary character streams. Only the
+// comparisons differ from those of the standard strings; the characters themselves are the same.
+
+//! Write a case insensitive string to a stream as if it were a std::string_view.
+inline std::ostream &operator<<( std::ostream &os, istring_view s )
+  { return( os << std::string_view( s.data( ), s.size( ) ) ); }
+
+//! Write a case insensitive string to a stream as if it were a std::string.
+inline std::ostream &operator<<( std::ostream &os, const istring &s )
+  { return( os << istring_view( s ) ); }
+
+std::istream &operator>>( std::istream &is, istring &s );
+
+std::istream &getline( std::istream &is, istring &line, char delimiter = '\n' );
+
 #endif
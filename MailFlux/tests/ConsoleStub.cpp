@@ -0,0 +1,55 @@
+/*! \file    ConsoleStub.cpp
+ *  \brief   Replacement for the console used by the test and benchmark programs.
+ *  \author  Peter Chapin <spicacality@kelseymountain.org>
+ *
+ * The test programs are linked with this file instead of Console.cpp so that they don't need a
+ * terminal or curses. Lines are written to the standard error stream; commands are ignored.
+ */
+
+#include <iostream>
+#include <pthread.h>
+#include "../Console.hpp"
+
+using namespace std;
+
+// Anonymous namespace for module private items.
+namespace {
+
+    pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
+
+    void put( const char *prefix, const char *line )
+    {
+        pthread_mutex_lock( &output_lock );
+        cerr << prefix << line << endl;
+        pthread_mutex_unlock( &output_lock );
+    }
+
+}   // End of anonymous namespace.
+
+
+namespace Console {
+
+    void initialize( )
+    { }
+
+    void cleanup( )
+    { }
+
+    void put_line( const char *line )
+    { put( "", line ); }
+
+    void put_warning_line( const char *line )
+    { put( "WARNING: ", line ); }
+
+    void put_exception_line( const char *line )
+    { put( "EXCEPTION: ", line ); }
+
+    void put_debug_line( const char *line )
+    { put( "DEBUG: ", line ); }
+
+    void register_command( const char *, command_handler )
+    { }
+
+    void command_loop( )
+    { }
+}
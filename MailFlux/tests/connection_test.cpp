@@ -0,0 +1,159 @@
+/*! \file    connection_test.cpp
+ *  \brief   Tests of the input handling of Connection.
+ *  \author  Peter Chapin <spicacality@kelseymountain.org>
+ *
+ * The conversations here are driven directly through receive(), event_happened(), and
+ * output_written(), as the io_uring event loop drives them, without any event loop or socket
+ * I/O. The program returns a nonzero exit status if any test fails.
+ */
+
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <sys/socket.h>
+#include <unistd.h>
+#include "../Connection.hpp"
+
+using namespace std;
+
+// Anonymous namespace for module private items.
+namespace {
+
+    const size_t BUFFER_SIZE = 4096;
+
+    int failures = 0;
+
+    void check( bool condition, const char *description )
+    {
+        cout << ( condition ? "PASS: " : "FAIL: " ) << description << endl;
+        if( !condition ) ++failures;
+    }
+
+
+    void ignore_wake( void * )
+    { }
+
+
+    //! A conversation that stops reading after each line until it is allowed to continue.
+    class SlowConnection : public Connection {
+    public:
+        enum pause_kind { EVENT, OUTPUT };
+
+        SlowConnection( int handle, pause_kind kind ) : Connection( handle ), pause( kind )
+        { set_waker( ignore_wake, nullptr ); }
+
+        vector<string> lines;   //!< The lines read so far.
+
+    private:
+        pause_kind pause;
+
+        Task<> run( ) override
+        {
+            while( true ) {
+                string_view line = co_await line_in( );
+                lines.emplace_back( line );
+                if( pause == EVENT ) {
+                    co_await wait_event( );
+                }
+                else {
+                    // Enough output to wait until the peer has read it.
+                    co_await line_out( string( 16 * 1024, 'x' ));
+                }
+            }
+        }
+    };
+
+
+    //! Return the text of count numbered lines, each 80 characters long with its terminator.
+    string numbered_lines( int count )
+    {
+        string text;
+        for( int i = 0; i < count; ++i ) {
+            string line = "LINE " + to_string( i ) + " ";
+            line.resize( 78, '-' );
+            text += line + "\r\n";
+        }
+        return text;
+    }
+
+
+    //! Return true if the lines read are the lines of numbered_lines( count ), in order.
+    bool lines_match( const vector<string> &lines, int count )
+    {
+        if( lines.size( ) != static_cast<size_t>( count )) return false;
+        string expected = numbered_lines( count );
+        for( int i = 0; i < count; ++i ) {
+            if( expected.compare( i * 80, 78, lines[i] ) != 0 ) return false;
+        }
+        return true;
+    }
+
+
+    //! Pipelined lines that don't fit in the buffer wait while the conversation waits.
+    void test_pipelined_lines( int handle, SlowConnection::pause_kind kind, const char *name )
+    {
+        const int COUNT = 200;   // About four times the buffer size.
+        SlowConnection connection( handle, kind );
+        string         text = numbered_lines( COUNT );
+        bool           failed = false;
+
+        try {
+            connection.start( );
+            connection.receive( text.data( ), text.size( ));
+            for( int i = 0; i < COUNT && !connection.wants_input( ); ++i ) {
+                if( kind == SlowConnection::EVENT )
+                    connection.event_happened( );
+                else
+                    connection.output_written( connection.get_output( ).size( ));
+            }
+        }
+        catch( exception &e ) {
+            cout << e.what( ) << endl;
+            failed = true;
+        }
+        string description = string( "pipelined lines are all read after " ) + name;
+        check( !failed && lines_match( connection.lines, COUNT ), description.c_str( ));
+        check( connection.wants_input( ), "the conversation then wants more input" );
+    }
+
+
+    //! A line that fills the buffer by itself is still rejected.
+    void test_long_line( int handle )
+    {
+        SlowConnection connection( handle, SlowConnection::EVENT );
+        string         text( BUFFER_SIZE + 1, 'x' );
+        bool           rejected = false;
+
+        connection.start( );
+        try {
+            connection.receive( text.data( ), text.size( ));
+        }
+        catch( length_error & ) {
+            rejected = true;
+        }
+        check( rejected, "a line longer than the buffer is rejected" );
+    }
+
+}   // End of anonymous namespace.
+
+
+int main( )
+{
+    // The connections do no I/O, but they need a valid handle.
+    int handles[2];
+    if( socketpair( AF_UNIX, SOCK_STREAM, 0, handles ) == -1 ) {
+        cout << "FAIL: socketpair" << endl;
+        return 1;
+    }
+
+    Connection::set_input_buffer_size( BUFFER_SIZE );
+    test_pipelined_lines( handles[0], SlowConnection::EVENT, "events" );
+    test_pipelined_lines( handles[0], SlowConnection::OUTPUT, "output is written" );
+    test_long_line( handles[0] );
+
+    close( handles[0] );
+    close( handles[1] );
+    return ( failures == 0 ) ? 0 : 1;
+}
@@ -0,0 +1,94 @@
+/*! \file    dispatch_bench.cpp
+ *  \brief   Benchmark of the classification of SMTP commands.
+ *  \author  Peter Chapin <spicacality@kelseymountain.org>
+ *
+ * The program times ServerConnection::classify() against the way commands were recognized
+ * before it existed: the line was copied into an istring, its verb was copied out with
+ * substr( 0, 4 ), and the verb was compared with a chain of case insensitive comparisons, first
+ * for the commands allowed in any state and then by the handler for the current state. The old
+ * way is timed with both kinds of case folding that istring supports; folding with std::tolower
+ * is what istring did at the time.
+ */
+
+#include <chrono>
+#include <clocale>
+#include <cstdio>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "../istring.hpp"
+#include "../ServerConnection.hpp"
+
+using namespace std;
+
+// Anonymous namespace for module private items.
+namespace {
+
+    const int COMMAND_COUNT = 20000000;
+
+    //! A mix of commands in both cases, including one the server doesn't know.
+    const vector<string> commands = {
+        "RCPT TO:<someone@example.com>", "rcpt to:<x@example.org>", "MAIL FROM:<a@b.c>",
+        "DATA", "NOOP", "QUIT", "RSET", "BDAT 100 LAST", "XYZZY"
+    };
+
+    //! Recognize a command as the server did while waiting for a recipient or DATA.
+    __attribute__(( noinline )) int old_classify( string_view line )
+    {
+        istring from_sender( line.data( ), line.size( ));
+
+        // handle_trivial_SMTP( ).
+        istring verb = from_sender.substr( 0, 4 );
+        if( verb == "NOOP" ) return ServerConnection::NOOP;
+        if( verb == "HELP" ) return ServerConnection::HELP;
+        if( verb == "VRFY" || verb == "EXPN" ) return ServerConnection::VRFY;
+
+        // The handler for the state.
+        istring state_verb = from_sender.substr( 0, 4 );
+        if( state_verb == "RCPT" ) return ServerConnection::RCPT;
+        if( state_verb == "QUIT" ) return ServerConnection::QUIT;
+        if( state_verb == "RSET" ) return ServerConnection::RSET;
+        if( state_verb == "DATA" ) return ServerConnection::DATA;
+        if( state_verb == "BDAT" ) return ServerConnection::BDAT;
+        if( state_verb == "MAIL" ) return ServerConnection::MAIL;
+        return ServerConnection::OTHER;
+    }
+
+
+    __attribute__(( noinline )) int new_classify( string_view line )
+    {
+        return ServerConnection::classify( line );
+    }
+
+
+    //! Return the average time, in nanoseconds, taken by the classifier for one command.
+    double time_classifier( int ( *classifier )( string_view ), long &checksum )
+    {
+        auto start = chrono::steady_clock::now( );
+        for( int i = 0; i < COMMAND_COUNT; ++i ) {
+            checksum += classifier( commands[i % commands.size( )] );
+        }
+        auto elapsed = chrono::steady_clock::now( ) - start;
+        return chrono::duration<double, nano>( elapsed ).count( ) / COMMAND_COUNT;
+    }
+
+}   // End of anonymous namespace.
+
+
+int main( )
+{
+    long checksum = 0;
+
+    setlocale( LC_CTYPE, "" );
+    ichar_traits::use_locale( true );
+    double old_locale = time_classifier( old_classify, checksum );
+    ichar_traits::use_locale( false );
+    double old_ascii = time_classifier( old_classify, checksum );
+    double current = time_classifier( new_classify, checksum );
+
+    printf( "Command classification, ns per command (checksum %ld)\n", checksum );
+    printf( "  substr and compare, std::tolower: %7.2f\n", old_locale );
+    printf( "  substr and compare, ASCII fold:   %7.2f\n", old_ascii );
+    printf( "  ServerConnection::classify:       %7.2f\n", current );
+    return 0;
+}
@@ -0,0 +1,129 @@
+/*! \file    istring_bench.cpp
+ *  \brief   Benchmark of the case insensitive comparisons and searches of istring.
+ *  \author  Peter Chapin <spicacality@kelseymountain.org>
+ *
+ * The program times the uses of istring that matter most to the server, folding case with
+ * std::tolower (CASE_FOLDING=locale) and then with each instruction set that the processor has:
+ * comparing, and looking for the '@' in, email addresses; matching the verb of a command with
+ * substr( 0, 4 ) and a chain of comparisons, as the server did before it classified commands
+ * itself; and comparing long strings that differ only in case.
+ */
+
+#include <chrono>
+#include <clocale>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include "../istring.hpp"
+
+using namespace std;
+
+// Anonymous namespace for module private items.
+namespace {
+
+    const int ADDRESS_COUNT = 2000000;
+    const int COMMAND_COUNT = 2000000;
+    const int LONG_COUNT    = 200000;
+    const size_t LONG_SIZE  = 4096;
+
+    const vector<istring> addresses = {
+        "someone@example.com", "Someone.Else@Example.ORG", "postmaster@mail.example.net",
+        "a.very.long.local.part+with.a.tag@subdomain.of.some.example.com"
+    };
+
+    const vector<istring> commands = {
+        "RCPT TO:<someone@example.com>", "rcpt to:<x@example.org>", "MAIL FROM:<a@b.c>",
+        "DATA", "NOOP", "QUIT", "RSET", "BDAT 100 LAST", "XYZZY"
+    };
+
+    //! Compare an address with a copy in a different case and find its '@'.
+    __attribute__(( noinline )) long address_work( const istring &address, const istring &other )
+    {
+        long result = ( address == other );
+        result += static_cast<long>( address.find( '@' ));
+        result += address.compare( addresses[0] );
+        return result;
+    }
+
+
+    __attribute__(( noinline )) long verb_work( const istring &command )
+    {
+        istring verb = command.substr( 0, 4 );
+        if( verb == "NOOP" || verb == "HELP" || verb == "VRFY" || verb == "EXPN" ) return 1;
+        if( verb == "RCPT" || verb == "QUIT" || verb == "RSET" ) return 2;
+        if( verb == "DATA" || verb == "BDAT" || verb == "MAIL" ) return 3;
+        return 0;
+    }
+
+
+    double nanoseconds_since( chrono::steady_clock::time_point start, int count )
+    {
+        auto elapsed = chrono::steady_clock::now( ) - start;
+        return chrono::duration<double, nano>( elapsed ).count( ) / count;
+    }
+
+
+    //! Time each kind of work and print the results on one line.
+    void run( const char *name, long &checksum )
+    {
+        vector<istring> other_case;
+        for( istring address : addresses ) {
+            for( char &ch : address ) {
+                if(( ch >= 'A' && ch <= 'Z' ) || ( ch >= 'a' && ch <= 'z' )) ch ^= 0x20;
+            }
+            other_case.push_back( address );
+        }
+        auto start = chrono::steady_clock::now( );
+        for( int i = 0; i < ADDRESS_COUNT; ++i ) {
+            size_t which = i % addresses.size( );
+            checksum += address_work( addresses[which], other_case[which] );
+        }
+        double address_time = nanoseconds_since( start, ADDRESS_COUNT );
+
+        start = chrono::steady_clock::now( );
+        for( int i = 0; i < COMMAND_COUNT; ++i ) {
+            checksum += verb_work( commands[i % commands.size( )] );
+        }
+        double verb_time = nanoseconds_since( start, COMMAND_COUNT );
+
+        string lower( LONG_SIZE, 'x' );
+        string upper( LONG_SIZE, 'X' );
+        start = chrono::steady_clock::now( );
+        for( int i = 0; i < LONG_COUNT; ++i ) {
+            checksum += ichar_traits::compare( lower.data( ), upper.data( ), LONG_SIZE );
+        }
+        double long_time = nanoseconds_since( start, LONG_COUNT );
+
+        printf( "  %-7s %10.1f %10.1f %14.2f\n", name, address_time, verb_time,
+                LONG_SIZE / long_time );
+    }
+
+}   // End of anonymous namespace.
+
+
+int main( )
+{
+    const struct {
+        ichar_traits::instruction_set which;
+        const char *name;
+    } instruction_sets[] = {
+        { ichar_traits::SCALAR, "scalar" },
+        { ichar_traits::SSE2,   "SSE2" },
+        { ichar_traits::AVX2,   "AVX2" }
+    };
+    long checksum = 0;
+
+    printf( "istring operations\n" );
+    printf( "  %-7s %10s %10s %14s\n", "folding", "ns/addr", "ns/verb", "4 KiB GB/s" );
+    setlocale( LC_CTYPE, "" );
+    ichar_traits::use_locale( true );
+    run( "locale", checksum );
+    ichar_traits::use_locale( false );
+    for( const auto &instructions : instruction_sets ) {
+        if( ichar_traits::use_instructions( instructions.which )) {
+            run( instructions.name, checksum );
+        }
+    }
+    printf( "  checksum %ld\n", checksum );
+    return 0;
+}
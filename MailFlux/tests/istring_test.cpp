@@ -0,0 +1,170 @@
+/*! \file    istring_test.cpp
+ *  \brief   Tests of the case insensitive comparisons and searches of istring.
+ *  \author  Peter Chapin <spicacality@kelseymountain.org>
+ *
+ * The ASCII comparisons and searches are checked against a reference that folds one character
+ * at a time, with each of the instruction sets that the processor has. The strings are 0 to 65
+ * characters long so that every length of block and leftover characters is covered for both
+ * 16 and 32 character blocks. The program returns a nonzero exit status if any test fails.
+ */
+
+#include <cstddef>
+#include <iostream>
+#include <random>
+#include <string>
+#include "../istring.hpp"
+
+using namespace std;
+
+// Anonymous namespace for module private items.
+namespace {
+
+    const size_t MAXIMUM_LENGTH = 65;
+
+    //! Pairs of characters placed where strings differ. The letter pairs are equal; the others
+    //! are close to the letters or differ only in bits that the case folding looks at.
+    const unsigned char differences[][2] = {
+        { 'A', 'a' }, { 'Z', 'z' }, { 'a', 'b' }, { '@', '`' }, { '[', '{' }, { 'A', 0xC1 },
+        { 0xC1, 0xE1 }, { 0xDA, 0xFA }, { 0x80, 0x00 }, { 0xFF, 0x7F }, { 0xFF, 'z' },
+        { 0x9A, 0xBA }
+    };
+
+    int failures = 0;
+
+    void check( bool condition, const char *description )
+    {
+        cout << ( condition ? "PASS: " : "FAIL: " ) << description << endl;
+        if( !condition ) ++failures;
+    }
+
+
+    int reference_fold( char c )
+    {
+        unsigned char u = static_cast<unsigned char>( c );
+        return ( u >= 'A' && u <= 'Z' ) ? u + ( 'a' - 'A' ) : u;
+    }
+
+
+    //! Compare two arrays of characters one at a time. Returns -1, 0, or +1.
+    int reference_compare( const char *s1, const char *s2, size_t n )
+    {
+        for( size_t i = 0; i < n; ++i ) {
+            int c1 = reference_fold( s1[i] );
+            int c2 = reference_fold( s2[i] );
+            if( c1 != c2 ) return ( c1 < c2 ) ? -1 : +1;
+        }
+        return 0;
+    }
+
+
+    //! Find a character one position at a time. Returns n if it is absent.
+    size_t reference_find( const char *s, size_t n, char a )
+    {
+        size_t i = 0;
+        while( i < n && reference_fold( s[i] ) != reference_fold( a )) ++i;
+        return i;
+    }
+
+
+    int sign( int value )
+    { return ( value > 0 ) - ( value < 0 ); }
+
+
+    //! Return a string of random bytes. Half of them, on average, are 0x80 or more.
+    string random_text( mt19937 &generator, size_t length )
+    {
+        string text( length, ' ' );
+        for( char &ch : text ) ch = static_cast<char>( generator( ) % 256 );
+        return text;
+    }
+
+
+    //! Return the text with the case of some of its ASCII letters changed.
+    string change_case( mt19937 &generator, string text )
+    {
+        for( char &ch : text ) {
+            if(( ch >= 'A' && ch <= 'Z' ) || ( ch >= 'a' && ch <= 'z' )) {
+                if( generator( ) % 2 == 0 ) ch ^= 0x20;
+            }
+        }
+        return text;
+    }
+
+
+    //! Compare strings that differ, apart from case, in at most one position.
+    bool compare_agrees( mt19937 &generator )
+    {
+        for( size_t length = 0; length <= MAXIMUM_LENGTH; ++length ) {
+            string first = random_text( generator, length );
+            string second = change_case( generator, first );
+            if( sign( ichar_traits::compare( first.data( ), second.data( ), length )) !=
+                reference_compare( first.data( ), second.data( ), length )) return false;
+
+            for( size_t position = 0; position < length; ++position ) {
+                for( const auto &difference : differences ) {
+                    for( int order = 0; order < 2; ++order ) {
+                        string left = first;
+                        string right = second;
+                        left[position] = static_cast<char>( difference[order] );
+                        right[position] = static_cast<char>( difference[1 - order] );
+                        if( sign( ichar_traits::compare( left.data( ), right.data( ), length )) !=
+                            reference_compare( left.data( ), right.data( ), length ))
+                            return false;
+                    }
+                }
+            }
+        }
+        return true;
+    }
+
+
+    //! Search for characters at every position of strings that may also contain them earlier.
+    bool find_agrees( mt19937 &generator )
+    {
+        for( size_t length = 0; length <= MAXIMUM_LENGTH; ++length ) {
+            string text = random_text( generator, length );
+            for( size_t position = 0; position <= length; ++position ) {
+                for( const auto &difference : differences ) {
+                    string haystack = text;
+                    if( position < length ) haystack[position] = static_cast<char>( difference[0] );
+                    char wanted = static_cast<char>( difference[1] );
+                    const char *found = ichar_traits::find( haystack.data( ), length, wanted );
+                    size_t expected = reference_find( haystack.data( ), length, wanted );
+                    if( found != ( expected == length ? nullptr : haystack.data( ) + expected ))
+                        return false;
+                }
+            }
+        }
+        return true;
+    }
+
+}   // End of anonymous namespace.
+
+
+int main( )
+{
+    const struct {
+        ichar_traits::instruction_set which;
+        const char *name;
+    } instruction_sets[] = {
+        { ichar_traits::SCALAR, "scalar" },
+        { ichar_traits::SSE2,   "SSE2" },
+        { ichar_traits::AVX2,   "AVX2" }
+    };
+
+    for( const auto &instructions : instruction_sets ) {
+        if( !ichar_traits::use_instructions( instructions.which )) {
+            cout << "The processor doesn't have " << instructions.name << "; not tested" << endl;
+            continue;
+        }
+        // The same strings are used for each instruction set.
+        mt19937 generator( 1 );
+        string compare_description =
+            string( "compare() agrees with the reference using " ) + instructions.name;
+        check( compare_agrees( generator ), compare_description.c_str( ));
+        string find_description =
+            string( "find() agrees with the reference using " ) + instructions.name;
+        check( find_agrees( generator ), find_description.c_str( ));
+    }
+    return ( failures == 0 ) ? 0 : 1;
+}
@@ -0,0 +1,220 @@
+/*! \file    reactor_test.cpp
+ *  \brief   Tests of the connection event loops.
+ *  \author  Peter Chapin <spicacality@kelseymountain.org>
+ *
+ * The program runs the event loops with the backend named on the command line ("epoll" or
+ * "io_uring") and talks to them over socket pairs. It returns a nonzero exit status if any test
+ * fails.
+ */
+
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <sys/socket.h>
+#include <unistd.h>
+#include "../ClientConnection.hpp"
+#include "../config.hpp"
+#include "../Reactor.hpp"
+#include "../SpoolRecord.hpp"
+
+using namespace std;
+
+// Anonymous namespace for module private items.
+namespace {
+
+    int failures = 0;
+
+    void check( bool condition, const char *description )
+    {
+        cout << ( condition ? "PASS: " : "FAIL: " ) << description << endl;
+        if( !condition ) ++failures;
+    }
+
+
+    //! Read from the socket until the peer closes it. Returns the text read.
+    string read_to_end( int handle )
+    {
+        string text;
+        char   buffer[1024];
+        ssize_t count;
+        while(( count = read( handle, buffer, sizeof( buffer ))) > 0 ) {
+            text.append( buffer, count );
+        }
+        return text;
+    }
+
+
+    //! Read one line, without its terminator, from the socket. Empty at the end of the input.
+    string read_line( int handle )
+    {
+        string line;
+        char   ch;
+        while( read( handle, &ch, 1 ) == 1 && ch != '\n' ) {
+            if( ch != '\r' ) line += ch;
+        }
+        return line;
+    }
+
+
+    //! Send text to the socket.
+    void send_text( int handle, const string &text )
+    {
+        write( handle, text.data( ), text.size( ));
+    }
+
+
+    //! A server that greets the client and then never replies must not hold up delivery.
+    void test_silent_server( )
+    {
+        int handles[2];
+        if( socketpair( AF_UNIX, SOCK_STREAM, 0, handles ) == -1 ) {
+            check( false, "socketpair" );
+            return;
+        }
+        const char greeting[] = "220 silent.example.com\r\n";
+        write( handles[1], greeting, sizeof( greeting ) - 1 );
+
+        string record;
+        SpoolRecord::convert_text(
+            "sender@example.com\n\nrecipient@example.com\n=====\n"
+            "Subject: test\r\n\r\nHello\r\n", record );
+        SpoolRecord    email{ string_view( record ) };
+        DeliveryResult result;
+        string         error;
+
+        auto start = chrono::steady_clock::now( );
+        vector<DeliveryResult::Recipient> outcomes;
+        Reactor::add_outbound( new ClientConnection( handles[0], email, { 0 }, &result ));
+        bool delivered = result.wait( error, outcomes );
+        auto elapsed = chrono::steady_clock::now( ) - start;
+
+        check( !delivered, "delivery to a silent server fails" );
+        check( error.find( "Timed out" ) != string::npos, "the failure is a time out" );
+        check( elapsed >= chrono::seconds( 1 ) && elapsed < chrono::seconds( 4 ),
+               "the attempt ends soon after the reply timeout" );
+
+        // The client said EHLO and then closed the connection.
+        string sent = read_to_end( handles[1] );
+        check( sent.compare( 0, 5, "EHLO " ) == 0, "the client waited for the reply to EHLO" );
+        close( handles[1] );
+    }
+
+
+    //! A client that says nothing is disconnected and gives up its session slot.
+    /*!
+     * Only one session is allowed, so a second client waits for the first one's slot.
+     */
+    void test_idle_client( )
+    {
+        int first[2], second[2];
+        if( socketpair( AF_UNIX, SOCK_STREAM, 0, first ) == -1 ||
+            socketpair( AF_UNIX, SOCK_STREAM, 0, second ) == -1 ) {
+            check( false, "socketpair" );
+            return;
+        }
+
+        auto start = chrono::steady_clock::now( );
+        Reactor::add_connection( first[0] );
+        Reactor::add_connection( second[0] );
+        string first_text = read_to_end( first[1] );
+        auto elapsed = chrono::steady_clock::now( ) - start;
+
+        check( first_text.compare( 0, 4, "220 " ) == 0, "an idle client is greeted" );
+        check( first_text.find( "\r\n421 " ) != string::npos, "an idle client is sent 421" );
+        check( elapsed >= chrono::seconds( 1 ) && elapsed < chrono::seconds( 4 ),
+               "an idle client is disconnected soon after the session timeout" );
+
+        string second_text = read_to_end( second[1] );
+        check( second_text.compare( 0, 4, "220 " ) == 0,
+               "the next client is started in the freed slot" );
+        close( first[1] );
+        close( second[1] );
+    }
+
+
+    //! A recipient the server refuses does not stop delivery to the others.
+    /*!
+     * The test plays the part of a server that supports PIPELINING. Of three recipients it
+     * accepts the first, refuses the second for good, and the third for the time being.
+     */
+    void test_refused_recipients( )
+    {
+        int handles[2];
+        if( socketpair( AF_UNIX, SOCK_STREAM, 0, handles ) == -1 ) {
+            check( false, "socketpair" );
+            return;
+        }
+
+        string record;
+        SpoolRecord::convert_text(
+            "sender@example.com\n\n"
+            "good@example.com\nbad@example.com\nbusy@example.com\n=====\n"
+            "Subject: test\r\n\r\nHello\r\n", record );
+        SpoolRecord    email{ string_view( record ) };
+        DeliveryResult result;
+        string         error;
+        vector<DeliveryResult::Recipient> outcomes;
+
+        Reactor::add_outbound( new ClientConnection( handles[0], email, { 0, 1, 2 }, &result ));
+        int server = handles[1];
+        send_text( server, "220 test.example.com\r\n" );
+        read_line( server );
+        send_text( server, "250-test.example.com\r\n250 PIPELINING\r\n" );
+
+        vector<string> envelope;
+        do {
+            envelope.push_back( read_line( server ));
+        } while( !envelope.back( ).empty( ) && envelope.back( ) != "DATA" );
+        send_text( server, "250 OK\r\n250 OK\r\n550 No such user\r\n"
+                           "450 Mailbox busy\r\n354 Go ahead\r\n" );
+        // The count stops the loop if the client closes the connection instead.
+        string text;
+        for( int count = 0; count < 100; ++count ) {
+            string line = read_line( server );
+            if( line == "." ) break;
+            text += line + "\n";
+        }
+        send_text( server, "250 Queued\r\n" );
+        read_line( server );
+        send_text( server, "221 Bye\r\n" );
+
+        bool delivered = result.wait( error, outcomes );
+        check( envelope.size( ) == 5, "the whole envelope is pipelined" );
+        check( delivered, "the message is delivered to the accepted recipient" );
+        check( text.find( "Hello" ) != string::npos, "the text is sent" );
+        check( outcomes.size( ) == 3 &&
+               outcomes[0].index == 0 && outcomes[0].what == DeliveryResult::ACCEPTED &&
+               outcomes[1].index == 1 && outcomes[1].what == DeliveryResult::REJECTED &&
+               outcomes[2].index == 2 && outcomes[2].what == DeliveryResult::DEFERRED,
+               "each recipient's outcome is recorded" );
+        check( outcomes.size( ) == 3 && outcomes[1].reply == "550 No such user",
+               "a refused recipient's reply is kept" );
+        close( server );
+    }
+
+}   // End of anonymous namespace.
+
+
+int main( int argc, char *argv[] )
+{
+    const char *backend = ( argc > 1 ) ? argv[1] : "epoll";
+
+    // Nothing here should take long; don't let a hung test stop the build.
+    alarm( 30 );
+
+    Support::register_parameter( "EVENT_THREADS", "1", false );
+    Support::register_parameter( "IO_BACKEND", backend, false );
+    Support::register_parameter( "MAX_SESSIONS", "1", false );
+    Support::register_parameter( "SESSION_TIMEOUT", "1", false );
+    ClientConnection::set_reply_timeout( chrono::seconds( 1 ));
+    Reactor::initialize( );
+
+    cout << "Reactor tests using " << backend << endl;
+    test_silent_server( );
+    test_idle_client( );
+    test_refused_recipients( );
+    return ( failures == 0 ) ? 0 : 1;
+}
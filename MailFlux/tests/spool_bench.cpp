@@ -0,0 +1,195 @@
+/*! \file    spool_bench.cpp
+ *  \brief   Benchmark of the directory and message log spools.
+ *  \author  Peter Chapin <spicacality@kelseymountain.org>
+ *
+ * The program times making messages durable and removing them again, both as the directory
+ * spool does it, with a file per message, and with a SegmentLog. In the directory spool a group
+ * of messages is committed by writing a file for each one, flushing them all with syncfs(),
+ * renaming them into the spool's bucket directories, and flushing again. A message committed on
+ * its own (SPOOL_SYNC=message) is written, flushed with fsync(), and renamed, and then its bucket
+ * directory is flushed. In the log a group of messages is appended and then made durable with
+ * one sync(). A delivered message is unlinked from the directory spool; in the log it is given a
+ * tombstone, and the log is compacted afterwards.
+ *
+ * The spools are created in a temporary directory under the directory named on the command line,
+ * or under the current directory, and are removed afterwards. The results only mean something
+ * for the file system that holds that directory; a file system in memory, such as /tmp often
+ * is, makes flushing free.
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "../SegmentLog.hpp"
+
+using namespace std;
+
+// Anonymous namespace for module private items.
+namespace {
+
+    const int BUCKET_COUNT = 256;       // As in the directory spool.
+    const uint64_t SEGMENT_SIZE = 64 * 1024 * 1024;
+
+    //! One way of using the spools.
+    struct Workload {
+        int    count;   //!< Number of messages.
+        int    group;   //!< Number of messages made durable together.
+        size_t size;    //!< Size of each message.
+    };
+
+    const Workload workloads[] = {
+        { 4000,  64,  2048 },
+        {  500,   1,  2048 },
+        { 2000,  64, 16384 }
+    };
+
+    //! Throughput of one spool, in messages per second.
+    struct Result {
+        double commit_rate;
+        double remove_rate;
+    };
+
+    void check_call( bool succeeded, const char *what )
+    {
+        if( !succeeded ) throw runtime_error( string( what ) + " failed" );
+    }
+
+
+    double messages_per_second( int count, chrono::steady_clock::time_point start )
+    {
+        chrono::duration<double> elapsed = chrono::steady_clock::now( ) - start;
+        return count / elapsed.count( );
+    }
+
+
+    //! Commit and remove messages with a file each, as the directory spool does.
+    Result run_directory( const string &root, const Workload &load )
+    {
+        string text( load.size, 'x' );
+        string temporary_path = root + "/tmp";
+        check_call( mkdir( temporary_path.c_str( ), 0700 ) == 0, "mkdir" );
+        int temporary = open( temporary_path.c_str( ), O_RDONLY | O_DIRECTORY );
+        check_call( temporary != -1, "open" );
+        vector<int> buckets( BUCKET_COUNT );
+        for( int i = 0; i < BUCKET_COUNT; ++i ) {
+            char path[16];
+            snprintf( path, sizeof( path ), "/%02x", i );
+            string bucket_path = root + path;
+            check_call( mkdir( bucket_path.c_str( ), 0700 ) == 0, "mkdir" );
+            buckets[i] = open( bucket_path.c_str( ), O_RDONLY | O_DIRECTORY );
+            check_call( buckets[i] != -1, "open" );
+        }
+
+        auto start = chrono::steady_clock::now( );
+        for( int first = 0; first < load.count; first += load.group ) {
+            int last = min( first + load.group, load.count );
+            for( int i = first; i < last; ++i ) {
+                string name = to_string( i );
+                int handle = openat( temporary, name.c_str( ), O_WRONLY | O_CREAT | O_EXCL, 0600 );
+                check_call( handle != -1, "openat" );
+                check_call( write( handle, text.data( ), text.size( )) ==
+                                static_cast<ssize_t>( text.size( )), "write" );
+                if( load.group == 1 ) check_call( fsync( handle ) == 0, "fsync" );
+                close( handle );
+            }
+            if( load.group > 1 ) check_call( syncfs( temporary ) == 0, "syncfs" );
+            for( int i = first; i < last; ++i ) {
+                string name = to_string( i );
+                check_call( renameat( temporary, name.c_str( ),
+                                      buckets[i % BUCKET_COUNT], name.c_str( )) == 0, "renameat" );
+                if( load.group == 1 )
+                    check_call( fsync( buckets[i % BUCKET_COUNT] ) == 0, "fsync" );
+            }
+            if( load.group > 1 ) check_call( syncfs( temporary ) == 0, "syncfs" );
+        }
+        Result result;
+        result.commit_rate = messages_per_second( load.count, start );
+
+        start = chrono::steady_clock::now( );
+        for( int i = 0; i < load.count; ++i ) {
+            check_call( unlinkat( buckets[i % BUCKET_COUNT], to_string( i ).c_str( ), 0 ) == 0,
+                        "unlinkat" );
+        }
+        result.remove_rate = messages_per_second( load.count, start );
+
+        for( int handle : buckets ) close( handle );
+        close( temporary );
+        return result;
+    }
+
+
+    //! Commit and remove messages with a SegmentLog.
+    Result run_log( const string &root, const Workload &load )
+    {
+        string text( load.size, 'x' );
+        SegmentLog log( root + "/log", SEGMENT_SIZE );
+        vector<SegmentLog::Location> locations;
+
+        auto start = chrono::steady_clock::now( );
+        for( int first = 0; first < load.count; first += load.group ) {
+            int last = min( first + load.group, load.count );
+            for( int i = first; i < last; ++i ) {
+                locations.push_back( log.append( to_string( i ), text ));
+            }
+            log.sync( );
+        }
+        Result result;
+        result.commit_rate = messages_per_second( load.count, start );
+
+        start = chrono::steady_clock::now( );
+        for( const SegmentLog::Location &where : locations ) {
+            log.remove( where );
+        }
+        vector<SegmentLog::Relocation> moved;
+        log.compact( moved );
+        result.remove_rate = messages_per_second( load.count, start );
+        return result;
+    }
+
+}   // End of anonymous namespace.
+
+
+int main( int argc, char *argv[] )
+{
+    string parent = ( argc > 1 ) ? argv[1] : ".";
+    string pattern = parent + "/spool_bench.XXXXXX";
+    if( mkdtemp( pattern.data( )) == nullptr ) {
+        perror( "Can't create the benchmark directory" );
+        return 1;
+    }
+    const string root = pattern;
+
+    int status = 0;
+    try {
+        printf( "Spool throughput in %s, messages per second\n", root.c_str( ));
+        printf( "  %6s %6s %6s   %10s %10s   %10s %10s\n", "count", "group", "size",
+                "dir commit", "dir remove", "log commit", "log remove" );
+        for( const Workload &load : workloads ) {
+            string directory_root = root + "/directory";
+            string log_root = root + "/log";
+            check_call( mkdir( directory_root.c_str( ), 0700 ) == 0, "mkdir" );
+            check_call( mkdir( log_root.c_str( ), 0700 ) == 0, "mkdir" );
+            Result directory = run_directory( directory_root, load );
+            Result log = run_log( log_root, load );
+            printf( "  %6d %6d %6zu   %10.0f %10.0f   %10.0f %10.0f\n",
+                    load.count, load.group, load.size,
+                    directory.commit_rate, directory.remove_rate,
+                    log.commit_rate, log.remove_rate );
+            filesystem::remove_all( directory_root );
+            filesystem::remove_all( log_root );
+        }
+    }
+    catch( exception &e ) {
+        fprintf( stderr, "%s\n", e.what( ));
+        status = 1;
+    }
+    filesystem::remove_all( root );
+    return status;
+}